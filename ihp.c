@@ -1,19 +1,54 @@
 #include <endian.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef IHP_STATS
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#endif
 
 #include "ihp.h"
+#include "ihp_hex.h"
 
 /* Parsing support includes hex codes up to 05
- * The maximum fixed length line is code 03, as in
+ * A record is
  *
- * :0400000300003800C1\r\n
+ * :BBAAAACC<2 * BB data characters>KK
  *
- * which is 21 bytes
+ * followed by CRLF, LF or nothing at the end of the input;
+ * its length is known once the 9 character header is decoded.
  *
  * */
 
-#define MAX_HEADER 19
+#define RECORD_HEADER 9
+
+/** @brief Size of the read buffer of contexts made by ihp_file. */
+#define IHP_CHUNK (64 * 1024)
+
+/** @brief Longest record; the read buffer of every other context, which
+ *  holds the carry of ihp_feed or a record read through stdio. */
+#define IHP_CARRY (RECORD_HEADER + 2 * 255 + 2)
+
+/** @brief Internal status: parsing stopped because more input is needed. */
+#define IHP_MORE COUNT_IHP_ERR
+
+/* Statistics; without IHP_STATS these compile to nothing. */
+#ifdef IHP_STATS
+#define STAT_ADD(ihp, field, n) ((ihp)->stats.field += (n))
+#define STAT_START(t) uint64_t t = ihp_ticks()
+#define STAT_STOP(ihp, phase, t) ((ihp)->stats.ticks[phase] += ihp_ticks() - (t))
+#else
+#define STAT_ADD(ihp, field, n) ((void)0)
+#define STAT_START(t) ((void)0)
+#define STAT_STOP(ihp, phase, t) ((void)0)
+#endif
 
 enum {
 	ST_BEGIN
@@ -36,6 +71,36 @@ struct IHP {
 	unsigned state;
 	FILE* f;
 
+	/** @brief If set, f is closed along with the context. */
+	bool own_f;
+
+	/** @brief In-memory source; if set, input is taken from src
+	 *  instead of f and is never copied. */
+	bool in_mem;
+	const char* src;
+	size_t src_len;
+	size_t src_pos;
+
+	/** @brief Mapping owned by the context, if any. */
+	void* map;
+	size_t map_len;
+
+	/** @brief Characters of an incomplete record held back by ihp_feed. */
+	size_t carry;
+
+	/** @brief Set once ihp_finish made the final callback. */
+	bool finished;
+
+	/** @brief Error that stopped parsing. */
+	unsigned err;
+
+	/** @brief If set, records are only validated and summarized here. */
+	struct ihp_summary* summary;
+
+#ifdef IHP_STATS
+	struct ihp_stats stats;
+#endif
+
 	uint32_t base_address;
 	uint32_t next_address;
 
@@ -44,343 +109,592 @@ struct IHP {
 
 	size_t bufpos;
 	size_t max;
+
+	/** @brief Size of the read buffer following the data buffer. */
+	size_t chunk;
 	uint8_t buffer[];
 };
 
-static uint32_t checksum(const uint8_t* src, size_t len, unsigned checksum);
-static uint8_t fin(unsigned checksum);
-static int ihp_hex_parse(uint8_t* dest, const char* src, size_t src_len);
-static bool ihp_on_payload(struct IHP* ctx, const uint8_t* src, size_t src_len);
+static unsigned ihp_drive(struct IHP* ihp);
+static unsigned ihp_parse(struct IHP* ihp, const char* in, size_t len, bool eof, size_t* used);
+static unsigned ihp_record(struct IHP* ihp, const char* in, size_t len, size_t* used);
+static bool ihp_map(struct IHP* ihp, int fd, off_t offset);
+static void ihp_release(struct IHP* ihp);
+static void ihp_clear(struct IHP* ihp);
+static bool ihp_on_payload(struct IHP* ihp, size_t len);
+static bool ihp_flush(struct IHP* ihp);
+static inline bool ihp_call(struct IHP* ihp, uint32_t address, const uint8_t* data, size_t len);
+static inline int ihp_decode(struct IHP* ihp, uint8_t* dest, const char* src, size_t len, uint32_t* sum);
+
+#ifdef IHP_STATS
+static uint64_t ihp_ticks(void);
+
+/** @brief Counters of destroyed contexts. */
+static struct ihp_stats stats_total;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 size_t ihp_size(size_t max_buffer){
-	return sizeof(struct IHP) + 2 * max_buffer;
+	return sizeof(struct IHP) + max_buffer + IHP_CARRY;
+}
+
+size_t ihp_file_size(size_t max_buffer){
+	return sizeof(struct IHP) + max_buffer + IHP_CHUNK;
 }
 
 struct ihp_ctx* ihp_file(uint8_t* mem, size_t max_buffer, FILE* f){
-	memset(mem, 0, ihp_size(max_buffer));
+	memset(mem, 0, sizeof(struct IHP));
 	__auto_type ret = (struct IHP*)mem;
 
 	ret->f = f;
+	ret->own_f = f != NULL;
+	ret->max = max_buffer;
+	ret->chunk = IHP_CARRY;
+
+	/* Regular files are mapped and parsed in place; the FILE is kept
+	 * only so that it is closed on destroy. It is left at its end, as
+	 * reading it would. */
+	long pos = f ? ftell(f) : -1;
+	if(pos >= 0 && ihp_map(ret, fileno(f), pos))
+		fseeko(f, 0, SEEK_END);
+	return &(ret->ctx);
+}
+
+struct ihp_ctx* ihp_file_buffered(uint8_t* mem, size_t max_buffer, FILE* f){
+	struct ihp_ctx* ret = ihp_file(mem, max_buffer, f);
+	((struct IHP*)ret)->chunk = IHP_CHUNK;
+	return ret;
+}
+
+struct ihp_ctx* ihp_mem(uint8_t* mem, size_t max_buffer, const void* src, size_t len){
+	memset(mem, 0, sizeof(struct IHP));
+	__auto_type ret = (struct IHP*)mem;
+
+	ret->in_mem = true;
+	ret->src = src;
+	ret->src_len = len;
 	ret->max = max_buffer;
+	ret->chunk = IHP_CARRY;
 	return &(ret->ctx);
 }
 
+struct ihp_ctx* ihp_mmap(uint8_t* mem, size_t max_buffer, const char* path){
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+
+	struct ihp_ctx* ret = ihp_mem(mem, max_buffer, NULL, 0);
+	bool mapped = ihp_map((struct IHP*)ret, fd, 0);
+	close(fd);
+	return mapped ? ret : NULL;
+}
+
 void ihp_destroy(struct ihp_ctx* ctx){
 	__auto_type ihp = (struct IHP*)ctx;
 
 	/* If callbacks are set, then call them if not finished parsing. */
 	if(ST_ERROR != ihp->state && ST_END != ihp->state){
 		if(ihp->ctx.cb)
-			ihp->ctx.cb(&ihp->ctx, 0, NULL, IHP_ERR_EARLY_ABORT);
+			ihp_call(ihp, 0, NULL, IHP_ERR_EARLY_ABORT);
 	}
 
-	if(ihp->f)
-		fclose(ihp->f);
+#ifdef IHP_STATS
+	pthread_mutex_lock(&stats_lock);
+	for(unsigned i = 0; i < 6; ++i)
+		stats_total.records[i] += ihp->stats.records[i];
+	stats_total.bytes += ihp->stats.bytes;
+	stats_total.discontinuities += ihp->stats.discontinuities;
+	stats_total.callbacks += ihp->stats.callbacks;
+	stats_total.copied += ihp->stats.copied;
+	for(unsigned i = 0; i < COUNT_IHP_PHASE; ++i)
+		stats_total.ticks[i] += ihp->stats.ticks[i];
+	pthread_mutex_unlock(&stats_lock);
+#endif
+
+	ihp_release(ihp);
+}
+
+void ihp_reset(struct ihp_ctx* ctx, FILE* f){
+	__auto_type ihp = (struct IHP*)ctx;
+	ihp_release(ihp);
+	ihp_clear(ihp);
+
+	ihp->f = f;
+	long pos = f ? ftell(f) : -1;
+	if(pos >= 0 && ihp_map(ihp, fileno(f), pos))
+		fseeko(f, 0, SEEK_END);
+}
+
+void ihp_reset_mem(struct ihp_ctx* ctx, const void* src, size_t len){
+	__auto_type ihp = (struct IHP*)ctx;
+	ihp_release(ihp);
+	ihp_clear(ihp);
+
+	ihp->in_mem = true;
+	ihp->src = src;
+	ihp->src_len = len;
 }
 
 unsigned ihp_run(struct ihp_ctx* ctx){
 	__auto_type ihp = (struct IHP*)ctx;
-	ihp->state = ST_PARSING;
+	unsigned err = ihp_drive(ihp);
+	ihp_call(ihp, 0, NULL, err);
+	return err;
+}
 
-	char ibuff[MAX_HEADER];
-	uint8_t hbuff[1 + 2 + 1 + 4 + 1];
+unsigned ihp_validate(struct ihp_ctx* ctx, struct ihp_summary* summary){
+	__auto_type ihp = (struct IHP*)ctx;
+	memset(summary, 0, sizeof(*summary));
+	ihp->summary = summary;
+	unsigned err = ihp_drive(ihp);
+	ihp->summary = NULL;
+	return err;
+}
 
-	int ret;
-	unsigned err = IHP_ERR_OK;
-	while(ihp->state == ST_PARSING && (ret = fread(ibuff, 1, 9, ihp->f))){
-		if(ret < 9){
-			err = IHP_ERR_EARLY_ABORT;
-			break;
-		}
+struct ihp_ctx* ihp_push(uint8_t* mem, size_t max_buffer){
+	memset(mem, 0, sizeof(struct IHP));
+	__auto_type ret = (struct IHP*)mem;
 
-		/* Check that line begins with ':' */
-		if(ibuff[0] != ':'){
-			err = IHP_ERR_BAD_HEADER;
-			break;
+	ret->max = max_buffer;
+	ret->chunk = IHP_CARRY;
+	return &(ret->ctx);
+}
+
+unsigned ihp_feed(struct ihp_ctx* ctx, const void* bytes, size_t len){
+	__auto_type ihp = (struct IHP*)ctx;
+	if(ST_BEGIN == ihp->state)
+		ihp->state = ST_PARSING;
+
+	/* Data after the EOF record is ignored; errors stick. */
+	if(ST_PARSING != ihp->state)
+		return ihp->err;
+
+	STAT_START(t);
+	const char* in = bytes;
+	char* carry = (char*)ihp->buffer + ihp->max;
+	unsigned err = IHP_MORE;
+	size_t used;
+
+	/* Complete the record left over from the previous call.
+	 * The carry always starts at a record, so it is either consumed
+	 * entirely along with some of the new input, or not at all. */
+	if(ihp->carry && len){
+		size_t old = ihp->carry;
+		size_t take = ihp->chunk - old;
+		if(take > len)
+			take = len;
+		memcpy(carry + old, in, take);
+		ihp->carry += take;
+		STAT_ADD(ihp, copied, take);
+
+		err = ihp_parse(ihp, carry, ihp->carry, false, &used);
+		if(used < old){
+			in += take;
+			len -= take;
+		}
+		else{
+			in += used - old;
+			len -= used - old;
+			ihp->carry = 0;
 		}
+	}
 
-		uint8_t byte_count;
-		uint16_t hdr_address;
-		uint8_t code;
-		if(ihp_hex_parse(hbuff, ibuff + 1, 8) < 0){
-			err = IHP_ERR_BAD_HEX;
-			break;
+	/* Parse straight out of the caller's bytes and keep the tail. */
+	if(IHP_MORE == err && len){
+		assert(!ihp->carry);
+		err = ihp_parse(ihp, in, len, false, &used);
+		if(IHP_MORE == err){
+			ihp->carry = len - used;
+			memcpy(carry, in + used, ihp->carry);
+			STAT_ADD(ihp, copied, ihp->carry);
 		}
+	}
+	STAT_STOP(ihp, IHP_PHASE_TOTAL, t);
+
+	if(IHP_MORE == err || IHP_ERR_OK == err)
+		return IHP_ERR_OK;
+
+	ihp->state = ST_ERROR;
+	ihp->err = err;
+	ihp_call(ihp, 0, NULL, err);
+	return err;
+}
+
+unsigned ihp_finish(struct ihp_ctx* ctx){
+	__auto_type ihp = (struct IHP*)ctx;
+
+	/* The error was already reported by ihp_feed, or the end by an
+	 * earlier call. */
+	if(ST_ERROR == ihp->state || ihp->finished)
+		return ihp->err;
 
-		byte_count = hbuff[0];
-		memcpy(&hdr_address, hbuff + 1, 2);
-		hdr_address = be16toh(hdr_address);
-		code = hbuff[3];
+	/* Whatever is left over can only be a truncated record. */
+	unsigned err = IHP_ERR_OK;
+	if(ST_PARSING == ihp->state){
+		STAT_START(t);
+		size_t used;
+		err = ihp_parse(ihp, (char*)ihp->buffer + ihp->max, ihp->carry, true, &used);
+		ihp->carry = 0;
+		STAT_STOP(ihp, IHP_PHASE_TOTAL, t);
+	}
 
-		if(code > 5){
-			err = IHP_ERR_BAD_HEX;
+	/* Either way the end is reported here, so ihp_destroy makes no
+	 * further callback. */
+	ihp->state = IHP_ERR_OK == err ? ST_END : ST_ERROR;
+	ihp->err = err;
+	ihp->finished = true;
+
+	ihp_call(ihp, 0, NULL, err);
+	return err;
+}
+
+#ifdef IHP_STATS
+const struct ihp_stats* ihp_get_stats(const struct ihp_ctx* ctx){
+	return &((const struct IHP*)ctx)->stats;
+}
+
+void ihp_stats_total(struct ihp_stats* total){
+	pthread_mutex_lock(&stats_lock);
+	*total = stats_total;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void ihp_stats_print(const struct ihp_stats* stats, FILE* f){
+	static const char* phases[COUNT_IHP_PHASE] = {"io", "decode", "callback", "total"};
+
+	for(unsigned i = 0; i < 6; ++i)
+		fprintf(f, "records_%02u %zu\n", i, stats->records[i]);
+	fprintf(f, "bytes %zu\n", stats->bytes);
+	fprintf(f, "discontinuities %zu\n", stats->discontinuities);
+	fprintf(f, "callbacks %zu\n", stats->callbacks);
+	fprintf(f, "copied %zu\n", stats->copied);
+	for(unsigned i = 0; i < COUNT_IHP_PHASE; ++i)
+		fprintf(f, "ticks_%s %llu\n", phases[i], (unsigned long long)stats->ticks[i]);
+}
+#endif
+
+/* Internal functions. */
+
+static unsigned ihp_drive(struct IHP* ihp){
+	STAT_START(t);
+	ihp->state = ST_PARSING;
+
+	unsigned err;
+	size_t used;
+	if(ihp->in_mem){
+		err = ihp_parse(ihp, ihp->src + ihp->src_pos, ihp->src_len - ihp->src_pos, true, &used);
+		ihp->src_pos += used;
+	}
+	else{
+		/* Pull the stream in blocks filling the read buffer; a block always
+		 * holds at least one complete record unless the stream has ended. */
+		char* chunk = (char*)ihp->buffer + ihp->max;
+		size_t have = 0;
+		do{
+			size_t want = ihp->chunk - have;
+			STAT_START(t_io);
+			size_t got = fread(chunk + have, 1, want, ihp->f);
+			STAT_STOP(ihp, IHP_PHASE_IO, t_io);
+			have += got;
+
+			err = ihp_parse(ihp, chunk, have, got < want, &used);
+			have -= used;
+			memmove(chunk, chunk + used, have);
+			STAT_ADD(ihp, copied, have);
+		} while(IHP_MORE == err);
+	}
+
+	if(IHP_ERR_OK != err){
+		ihp->state = ST_ERROR;
+		ihp->err = err;
+	}
+	STAT_STOP(ihp, IHP_PHASE_TOTAL, t);
+
+	return err;
+}
+
+
+static unsigned ihp_parse(struct IHP* ihp, const char* in, size_t len, bool eof, size_t* used){
+	const char* begin = in;
+	const char* end = in + len;
+	unsigned err = IHP_ERR_OK;
+
+	while(ST_PARSING == ihp->state){
+		/* Skip the line terminator(s) of the previous record;
+		 * CRLF, LF and nothing at all are equally acceptable. */
+		while(in != end && ('\r' == *in || '\n' == *in))
+			++in;
+
+		/* Out of input at a record boundary; if the input has ended
+		 * without an EOF record, flush the data buffer anyway. */
+		if(in == end){
+			if(!eof)
+				err = IHP_MORE;
+			else if(!ihp_flush(ihp))
+				err = IHP_ERR_USER_ABORT;
 			break;
 		}
 
-		uint32_t ck = checksum(hbuff, 4, 0);
-		if(IHP_CODE_DATA == code){
-			/* Check the line address.
-			 * If this does not match next_address, then
-			 * flush the current data buffer. */
-			uint32_t addr = ihp->base_address + hdr_address;
-			if(addr != ihp->next_address){
-				if(!ihp_on_payload(ihp, NULL, 0)){
-					err = IHP_ERR_USER_ABORT;
-					break;
-				}
-
-				/* Reset the buffer address */
-				ihp->bufaddress = addr;
-				ihp->next_address = addr + byte_count;
-			}
-			else{
-				ihp->next_address += byte_count;
-			}
-
-			/* Read in remaining data + checksum */
-			unsigned data_left = byte_count * 2;
-
-			while(data_left){
-				/* Can only read in what is remaining in buffer. */
-				unsigned cur = data_left;
-				uint8_t* dest = ihp->buffer + ((ihp->bufpos + 1) & ~1);
-				if(cur > 2 * ihp->max - (dest - ihp->buffer))
-					cur = 2 * ihp->max - (dest - ihp->buffer);
-				ret = fread(dest, 1, cur, ihp->f);
-				if(ret < cur){
-					err = IHP_ERR_EARLY_ABORT;
-					break;
-				}
-
-				/* Convert ASCII hex to regular hex. */
-				if(ihp_hex_parse(dest, (char*)dest, cur) < 0){
-					err = IHP_ERR_BAD_HEX;
-					break;
-				}
-
-				/* Update checksum. */
-				ck = checksum(dest, cur / 2, ck);
-
-				if(!ihp_on_payload(ihp, dest, cur / 2)){
-					err = IHP_ERR_USER_ABORT;
-					break;
-				}
-
-				data_left -= cur;
-			}
-			if(err != IHP_ERR_OK)
-				break;
+		size_t rec;
+		err = ihp_record(ihp, in, end - in, &rec);
+		if(IHP_MORE == err && eof)
+			err = IHP_ERR_EARLY_ABORT;
+		if(IHP_ERR_OK != err)
+			break;
 
-		}
-		else if(IHP_CODE_EOF == code){
-			/* Byte count must be 0. */
-			if(byte_count){
-				err = IHP_ERR_BAD_BYTE_COUNT;
-				break;
-			}
-
-			/* Flush data buffer. */
-			if(!ihp_on_payload(ihp, NULL, 0))
-				err = IHP_ERR_USER_ABORT;
+		in += rec;
+	}
 
-			/* Address is a don't care. */
-			ihp->state = ST_END;
+	*used = in - begin;
+	return err;
+}
 
-			/* Nothing more to do, just break.  */
-			break;
+static unsigned ihp_record(struct IHP* ihp, const char* in, size_t len, size_t* used){
+	/* Check that line begins with ':' */
+	if(in[0] != ':')
+		return IHP_ERR_BAD_HEADER;
+
+	if(len < RECORD_HEADER)
+		return IHP_MORE;
+
+	uint8_t hbuff[4];
+	uint32_t ck = 0;
+	if(ihp_decode(ihp, hbuff, in + 1, 8, &ck) < 0)
+		return IHP_ERR_BAD_HEX;
+
+	uint8_t byte_count = hbuff[0];
+	uint16_t hdr_address;
+	memcpy(&hdr_address, hbuff + 1, 2);
+	hdr_address = be16toh(hdr_address);
+	uint8_t code = hbuff[3];
+
+	if(code > 5)
+		return IHP_ERR_BAD_HEX;
+
+	/* Nothing may change until the whole record is available. */
+	size_t rec_len = RECORD_HEADER + 2 * byte_count + 2;
+	if(len < rec_len)
+		return IHP_MORE;
+
+	const char* payload = in + RECORD_HEADER;
+	if(IHP_CODE_DATA == code && ihp->summary){
+		/* Validating: only check and sum the data. */
+		if(ihp_decode(ihp, NULL, payload, 2 * byte_count, &ck) < 0)
+			return IHP_ERR_BAD_HEX;
+	}
+	else if(IHP_CODE_DATA == code){
+		/* Check the line address.
+		 * If this does not match next_address, then
+		 * flush the current data buffer. */
+		uint32_t addr = ihp->base_address + hdr_address;
+		if(addr != ihp->next_address){
+			if(ihp->bufpos)
+				STAT_ADD(ihp, discontinuities, 1);
+			if(!ihp_flush(ihp))
+				return IHP_ERR_USER_ABORT;
+
+			/* Reset the buffer address */
+			ihp->bufaddress = addr;
+			ihp->next_address = addr + byte_count;
 		}
-		else if(IHP_CODE_EXT_SEG == code){
-			/* Byte count must be 2. */
-			if(byte_count != 2){
-				err = IHP_ERR_BAD_BYTE_COUNT;
-				break;
-			}
-
-			if(fread(ibuff, 1, 4, ihp->f) < 4){
-				err = IHP_ERR_EARLY_ABORT;
-				break;
-			}
-
-			if(ihp_hex_parse(hbuff, ibuff, 4) < 0){
-				err = IHP_ERR_BAD_HEX;
-				break;
-			}
-
-			ck = checksum(hbuff, 2, ck);
-
-			/* Copy payload address, scale as per spec */
-			memcpy(&hdr_address, hbuff, 2);
-			hdr_address = be16toh(hdr_address);
-			ihp->base_address = hdr_address;
-			ihp->base_address *= 16;
+		else{
+			ihp->next_address += byte_count;
 		}
-		else if(IHP_CODE_START_SEG == code){
-			/* Byte count must be 4. */
-			if(byte_count != 4){
-				err = IHP_ERR_BAD_BYTE_COUNT;
-				break;
-			}
 
-			if(fread(ibuff, 1, 8, ihp->f) < 8){
-				err = IHP_ERR_EARLY_ABORT;
-				break;
-			}
+		/* Decode straight into the free end of the buffer,
+		 * in pieces that fit. */
+		size_t data_left = byte_count;
+		while(data_left){
+			size_t cur = ihp->max - ihp->bufpos;
+			if(cur > data_left)
+				cur = data_left;
 
-			if(ihp_hex_parse(hbuff, ibuff, 8) < 0){
-				err = IHP_ERR_BAD_HEX;
-				break;
-			}
+			/* Convert ASCII hex to regular hex and update checksum. */
+			if(ihp_decode(ihp, ihp->buffer + ihp->bufpos, payload, 2 * cur, &ck) < 0)
+				return IHP_ERR_BAD_HEX;
 
-			ck = checksum(hbuff, 4, ck);
-
-			/* Do nothing....as per nrf-intel-hex behaviour */
+			if(!ihp_on_payload(ihp, cur))
+				return IHP_ERR_USER_ABORT;
 
+			payload += 2 * cur;
+			data_left -= cur;
 		}
-		else if(IHP_CODE_EXT_LIN == code){
-			/* Byte count must be 2. */
-			if(byte_count != 2){
-				err = IHP_ERR_BAD_BYTE_COUNT;
-				break;
-			}
-
-			if(fread(ibuff, 1, 4, ihp->f) < 4){
-				err = IHP_ERR_EARLY_ABORT;
-				break;
-			}
-
-			if(ihp_hex_parse(hbuff, ibuff, 4) < 0){
-				err = IHP_ERR_BAD_HEX;
-				break;
-			}
-
-			ck = checksum(hbuff, 2, ck);
-
-			/* Copy payload address, scale as per spec */
-			memcpy(&hdr_address, hbuff, 2);
+	}
+	else if(IHP_CODE_EOF == code){
+		/* Byte count must be 0. */
+		if(byte_count)
+			return IHP_ERR_BAD_BYTE_COUNT;
+	}
+	else{
+		/* Base and start address records: 2 or 4 bytes of payload */
+		uint8_t abuff[4];
+		bool base = IHP_CODE_EXT_SEG == code || IHP_CODE_EXT_LIN == code;
+		if(byte_count != (base ? 2 : 4))
+			return IHP_ERR_BAD_BYTE_COUNT;
+
+		if(ihp_decode(ihp, abuff, payload, 2 * byte_count, &ck) < 0)
+			return IHP_ERR_BAD_HEX;
+
+		/* Copy payload address, scale as per spec */
+		if(base){
+			memcpy(&hdr_address, abuff, 2);
 			hdr_address = be16toh(hdr_address);
 			ihp->base_address = hdr_address;
-			ihp->base_address <<= 16;
-		}
-		else if(IHP_CODE_START_LIN == code){
-			/* Byte count must be 4. */
-			if(byte_count != 4){
-				err = IHP_ERR_BAD_BYTE_COUNT;
-				break;
-			}
-
-			if(fread(ibuff, 1, 8, ihp->f) < 8){
-				err = IHP_ERR_EARLY_ABORT;
-				break;
-			}
-
-			if(ihp_hex_parse(hbuff, ibuff, 8) < 0){
-				err = IHP_ERR_BAD_HEX;
-				break;
-			}
-
-			ck = checksum(hbuff, 4, ck);
-
-			/* Do nothing....as per nrf-intel-hex behaviour */
+			if(IHP_CODE_EXT_SEG == code)
+				ihp->base_address *= 16;
+			else
+				ihp->base_address <<= 16;
 		}
 
-		/* Read last 2 checksum bytes and the \r\n,
-		 * parse the checksum
-		 * and verify checksum */
-		char ckbuff[4];
-		ret = fread(ckbuff, 1, 4, ihp->f);
-		if(ret < 4){
-			err = IHP_ERR_EARLY_ABORT;
-		}
-		else {
-			uint8_t c;
-			if(ihp_hex_parse(&c, ckbuff, 2) < 0){
-				err = IHP_ERR_BAD_HEX;
-			}
-			else if(c != fin(ck)){
-				err = IHP_ERR_CHECKSUM;
-			}
+		/* Start addresses: Do nothing....as per nrf-intel-hex behaviour */
+	}
+
+	/* The checksum byte brings the record sum to 0 mod 256. */
+	uint8_t c;
+	if(ihp_decode(ihp, &c, in + rec_len - 2, 2, &ck) < 0)
+		return IHP_ERR_BAD_HEX;
+	if(ck & 0xFF)
+		return IHP_ERR_CHECKSUM;
+
+	/* Only records that check out are summarized. */
+	if(ihp->summary){
+		++ihp->summary->records;
+
+		/* Empty data records hold no data, so they bound nothing. */
+		if(IHP_CODE_DATA == code && byte_count){
+			uint32_t addr = ihp->base_address + hdr_address;
+			uint64_t end = (uint64_t)addr + byte_count;
+			if(!ihp->summary->bytes || addr < ihp->summary->min_address)
+				ihp->summary->min_address = addr;
+			if(end > ihp->summary->end_address)
+				ihp->summary->end_address = end;
+			ihp->summary->bytes += byte_count;
 		}
 	}
+	STAT_ADD(ihp, records[code], 1);
+	if(IHP_CODE_DATA == code)
+		STAT_ADD(ihp, bytes, byte_count);
 
-	ihp->ctx.cb(&ihp->ctx, 0, NULL, err);
-	return err;
-}
+	if(IHP_CODE_EOF == code){
+		/* Flush data buffer. */
+		if(!ihp_flush(ihp))
+			return IHP_ERR_USER_ABORT;
 
-/* Internal functions. */
+		/* Address is a don't care. */
+		ihp->state = ST_END;
+	}
 
-static uint32_t checksum(const uint8_t* src, size_t len, unsigned checksum){
-	for(unsigned i = 0; i < len; ++i)
-		checksum += src[i];
-	return checksum;
+	*used = rec_len;
+	return IHP_ERR_OK;
 }
 
-static uint8_t fin(unsigned checksum){
-	checksum = ~checksum;
-	++checksum;
-	return checksum & 0xFF;
+static bool ihp_map(struct IHP* ihp, int fd, off_t offset){
+	struct stat st;
+	if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < offset)
+		return false;
+
+	/* Nothing to map, but an empty file is still a valid source. */
+	size_t len = st.st_size;
+	void* m = NULL;
+	if(len){
+		STAT_START(t);
+		m = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(MAP_FAILED == m)
+			return false;
+		madvise(m, len, MADV_SEQUENTIAL);
+		STAT_STOP(ihp, IHP_PHASE_IO, t);
+	}
+
+	ihp->map = m;
+	ihp->map_len = len;
+	ihp->in_mem = true;
+	ihp->src = (const char*)m + offset;
+	ihp->src_len = len - offset;
+	ihp->src_pos = 0;
+	return true;
 }
 
-static int ihp_hex_parse(uint8_t* dest, const char* src, size_t src_len){
-	/* Only even lengths are valid. */
-	if(src_len & 1)
-		return -1;
-
-	const char* begin = src;
-	const char* end = src + src_len;
-	while(src != end){
-		if(src[0] >= '0' && src[0] <= '9')
-			*dest = src[0] - '0';
-		else if(src[0] >= 'A' && src[0] <= 'F')
-			*dest = src[0] - 'A' + 0xA;
-		else
-			return -(src - begin);
-		*dest <<= 4;
-
-		if(src[1] >= '0' && src[1] <= '9')
-			*dest |= src[1] - '0';
-		else if(src[1] >= 'A' && src[1] <= 'F')
-			*dest |= src[1] - 'A' + 0xA;
-		else
-			return -(src - begin - 1);
-
-		++dest;
-		src += 2;
-	}
+/** @brief Let go of the source: unmap it, and close it if owned. Safe to
+ *  repeat, so a context may be reset after it was destroyed. */
+static void ihp_release(struct IHP* ihp){
+	if(ihp->map)
+		munmap(ihp->map, ihp->map_len);
+	ihp->map = NULL;
+	ihp->map_len = 0;
 
-	return end - begin;
+	if(ihp->f && ihp->own_f)
+		fclose(ihp->f);
+	ihp->f = NULL;
 }
 
+/** @brief Forget the source and all parse state; only the callback,
+ *  buffer size and statistics stay. */
+static void ihp_clear(struct IHP* ihp){
+	struct ihp_ctx ctx = ihp->ctx;
+	size_t max = ihp->max;
+	size_t chunk = ihp->chunk;
+#ifdef IHP_STATS
+	struct ihp_stats stats = ihp->stats;
+#endif
+
+	memset(ihp, 0, sizeof(*ihp));
+	ihp->ctx = ctx;
+	ihp->max = max;
+	ihp->chunk = chunk;
+#ifdef IHP_STATS
+	ihp->stats = stats;
+#endif
+}
 
-static bool ihp_on_payload(struct IHP* ihp, const uint8_t* src, size_t src_len){
-	/* If no data, then this is a flush, due to an address change. */
-	if(!src){
-		if(!ihp->ctx.cb || !ihp->bufpos)
-			return true;
+static bool ihp_on_payload(struct IHP* ihp, size_t len){
+	/* The data was decoded in place, so it is handed over where it lies
+	 * once the buffer is full. */
+	ihp->bufpos += len;
+	assert(ihp->bufpos <= ihp->max);
 
-		size_t len = ihp->bufpos;
+	if(ihp->bufpos == ihp->max){
+		if(!ihp_call(ihp, ihp->bufaddress, ihp->buffer, ihp->max))
+			return false;
+		ihp->bufaddress += ihp->max;
 		ihp->bufpos = 0;
-		return ihp->ctx.cb(&ihp->ctx, ihp->bufaddress, ihp->buffer, len);
 	}
 
-	while(src_len){
-		unsigned amt = src_len;
-		if(amt + ihp->bufpos > ihp->max)
-			amt = ihp->max - ihp->bufpos;
+	return true;
+}
+
+static bool ihp_flush(struct IHP* ihp){
+	/* Flush, due to an address change or the end of the data. */
+	if(!ihp->ctx.cb || !ihp->bufpos)
+		return true;
 
-		assert(amt);
+	size_t len = ihp->bufpos;
+	ihp->bufpos = 0;
+	return ihp_call(ihp, ihp->bufaddress, ihp->buffer, len);
+}
 
-		memmove(ihp->buffer + ihp->bufpos, src, amt);
-		ihp->bufpos += amt;
-		src_len -= amt;
-		src += amt;
+static inline bool ihp_call(struct IHP* ihp, uint32_t address, const uint8_t* data, size_t len){
+	STAT_START(t);
+	bool ret = ihp->ctx.cb(&ihp->ctx, address, data, len);
+	STAT_STOP(ihp, IHP_PHASE_CALLBACK, t);
+	STAT_ADD(ihp, callbacks, 1);
+	return ret;
+}
 
-		if(ihp->bufpos == ihp->max){
-			if(!ihp->ctx.cb(&ihp->ctx, ihp->bufaddress, ihp->buffer, ihp->max))
-				return false;
-			ihp->bufaddress += ihp->max;
-			ihp->bufpos = 0;
-		}
-	}
+static inline int ihp_decode(struct IHP* ihp, uint8_t* dest, const char* src, size_t len, uint32_t* sum){
+	STAT_START(t);
+	int ret = ihp_hex_decode(dest, src, len, sum);
+	STAT_STOP(ihp, IHP_PHASE_DECODE, t);
+	return ret;
+}
 
-	return true;
+#ifdef IHP_STATS
+static uint64_t ihp_ticks(void){
+#if defined(__x86_64__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
 }
+#endif
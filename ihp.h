@@ -46,6 +46,66 @@ enum {
 	,COUNT_IHP_ERR
 };
 
+/** @brief Summary of a validated input. */
+struct ihp_summary {
+	/** @brief Number of records of any type. */
+	size_t records;
+
+	/** @brief Number of data bytes in data records. */
+	size_t bytes;
+
+	/** @brief Lowest address holding data. */
+	uint32_t min_address;
+
+	/** @brief One past the highest address holding data. */
+	uint64_t end_address;
+};
+
+#ifdef IHP_STATS
+/** @brief Phases timed in struct ihp_stats. */
+enum {
+	/** @brief Reading or mapping input. */
+	IHP_PHASE_IO
+
+	/** @brief Hex decoding, which includes summing the checksum. */
+	,IHP_PHASE_DECODE
+
+	/** @brief User callbacks. */
+	,IHP_PHASE_CALLBACK
+
+	/** @brief All of parsing, including the phases above. */
+	,IHP_PHASE_TOTAL
+
+	/** @brief Number of phases. */
+	,COUNT_IHP_PHASE
+};
+
+/** @brief Counters kept by each context when built with IHP_STATS.
+ *  Without IHP_STATS none of this exists and nothing is counted. */
+struct ihp_stats {
+	/** @brief Valid records, by type code 00 to 05. */
+	size_t records[6];
+
+	/** @brief Data bytes decoded. */
+	size_t bytes;
+
+	/** @brief Buffer flushes caused by a data record not continuing
+	 *  from the previous one. */
+	size_t discontinuities;
+
+	/** @brief Callback invocations, including end and error reports. */
+	size_t callbacks;
+
+	/** @brief Input bytes copied to join records split across reads or
+	 *  ihp_feed calls. Data itself is decoded in place and never copied. */
+	size_t copied;
+
+	/** @brief Time spent per IHP_PHASE_*; TSC cycles on x86_64,
+	 *  nanoseconds elsewhere. */
+	uint64_t ticks[COUNT_IHP_PHASE];
+};
+#endif
+
 /** @brief Opaque type for parsing context;
  * ACTUAL SIZE OF THE STRUCT MUST BE CALCULATED at run time. */
 struct ihp_ctx {
@@ -53,22 +113,110 @@ struct ihp_ctx {
 	ihp_cb cb;
 };
 
-/** @brief Calculate RAM required for context parser instance. */
+/** @brief Calculate RAM required for context parser instance made by
+ *  ihp_file, ihp_mem, ihp_mmap or ihp_push. */
 size_t ihp_size(size_t max_buffer);
 
+/** @brief Calculate RAM required for context parser instance made by
+ *  ihp_file_buffered; it adds a 64K block buffer for streams that are not
+ *  mapped. */
+size_t ihp_file_size(size_t max_buffer);
+
 /** @brief Initialize a an ihp_ctx with an input file.
  *  @param mem Pointer to raw memory of at least size ihp_size(max_buffer)
  *  @param size_t max_buffer Maximum amount of data to pass in a callback call
  *  @param ifile File descriptor of source data.
+ *   If this is a regular file it is memory mapped from the current position
+ *   and parsed in place; otherwise it is read through stdio a record at a
+ *   time. NULL makes a context without a source, for use with ihp_reset.
  *  @return pointer to initialize mem containing context instance.
  *   returns NULL if there was an error opening the file. */
 struct ihp_ctx* ihp_file(uint8_t* mem, size_t max_buffer, FILE* f);
 
+/** @brief ihp_file, reading streams that are not mapped in 64K blocks.
+ *  @param mem Pointer to raw memory of at least size ihp_file_size(max_buffer) */
+struct ihp_ctx* ihp_file_buffered(uint8_t* mem, size_t max_buffer, FILE* f);
+
+/** @brief Initialize an ihp_ctx with an in-memory source.
+ *  Input is parsed directly out of src without copying it;
+ *  src must stay valid until the context is destroyed.
+ *  @param mem Pointer to raw memory of at least size ihp_size(max_buffer)
+ *  @param size_t max_buffer Maximum amount of data to pass in a callback call
+ *  @param src Intel hex text
+ *  @param len Length of src in bytes
+ *  @return pointer to initialize mem containing context instance. */
+struct ihp_ctx* ihp_mem(uint8_t* mem, size_t max_buffer, const void* src, size_t len);
+
+/** @brief Initialize an ihp_ctx with a memory mapped file.
+ *  @param mem Pointer to raw memory of at least size ihp_size(max_buffer)
+ *  @param size_t max_buffer Maximum amount of data to pass in a callback call
+ *  @param path Path of the source file; it is unmapped by ihp_destroy.
+ *  @return pointer to initialize mem containing context instance.
+ *   returns NULL if there was an error opening or mapping the file. */
+struct ihp_ctx* ihp_mmap(uint8_t* mem, size_t max_buffer, const char* path);
+
+/** @brief Check input without delivering any data.
+ *  Every record is checked as by ihp_run, including checksums, but data is
+ *  never decoded into the buffer and no callbacks are made.
+ *  @param summary Filled with statistics of the records checked; if there
+ *   is an error, they cover the records before it.
+ *  @return Error status IHP_ERR_* */
+unsigned ihp_validate(struct ihp_ctx* ctx, struct ihp_summary* summary);
+
+/** @brief Initialize an ihp_ctx that is fed input with ihp_feed.
+ *  @param mem Pointer to raw memory of at least size ihp_size(max_buffer)
+ *  @param size_t max_buffer Maximum amount of data to pass in a callback call
+ *  @return pointer to initialize mem containing context instance. */
+struct ihp_ctx* ihp_push(uint8_t* mem, size_t max_buffer);
+
 /** @brief Destroy an ihex context */
 void ihp_destroy(struct ihp_ctx* ctx);
 
+/** @brief Reuse a context for another input, keeping its memory, buffer
+ *  size, callback and user_data. The previous source is let go of as by
+ *  ihp_destroy, but no callback is made.
+ *  @param f Source stream, parsed from its current position like with
+ *   ihp_file; it is NOT closed by the context. A mapped stream is left
+ *   positioned at its end. A stream that is not mapped
+ *   is read in 64K blocks by a context made by ihp_file_buffered, and a
+ *   record at a time by any other. NULL makes a context to be fed with ihp_feed, like
+ *   ihp_push. */
+void ihp_reset(struct ihp_ctx* ctx, FILE* f);
+
+/** @brief Reuse a context for an in-memory source, as ihp_reset does.
+ *  @param src Intel hex text, used as by ihp_mem
+ *  @param len Length of src in bytes */
+void ihp_reset_mem(struct ihp_ctx* ctx, const void* src, size_t len);
+
 /** @brief Perform parsing operation.
  *  @return Error status IHP_ERR_* */
 unsigned ihp_run(struct ihp_ctx* ctx);
 
+/** @brief Parse the next piece of input of a context made by ihp_push.
+ *  Input may be split anywhere, even inside a record; callbacks are made
+ *  as soon as records complete. On error the callback receives the error
+ *  code right away. Input following the EOF record is ignored.
+ *  @return Error status IHP_ERR_*; once an error is returned, it is
+ *   returned for all further input. */
+unsigned ihp_feed(struct ihp_ctx* ctx, const void* bytes, size_t len);
+
+/** @brief Signal the end of input of a context made by ihp_push.
+ *  Makes the final callback, like the end of ihp_run; it is made only
+ *  once, so calling this again or ihp_destroy makes no further callback.
+ *  @return Error status IHP_ERR_*; IHP_ERR_EARLY_ABORT if the input
+ *   ended inside a record. */
+unsigned ihp_finish(struct ihp_ctx* ctx);
+
+#ifdef IHP_STATS
+/** @brief Counters of a context so far. */
+const struct ihp_stats* ihp_get_stats(const struct ihp_ctx* ctx);
+
+/** @brief Sum of the counters of every context destroyed so far,
+ *  including those used inside ihpa functions. */
+void ihp_stats_total(struct ihp_stats* total);
+
+/** @brief Print counters as "name value" lines. */
+void ihp_stats_print(const struct ihp_stats* stats, FILE* f);
+#endif
+
 #endif
@@ -0,0 +1,164 @@
+#ifndef __IHEX_PARSER_HPP__
+#define __IHEX_PARSER_HPP__
+
+/* Header only C++ front end over the C parser: calls are forwarded to a
+ * handler object of any callable type, and dispatch tests every range of a
+ * constexpr table with the ranges known at compile time.
+ * Needs C++17 and the library. */
+
+#include <cstdio>
+#include <iterator>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "ihp.h"
+}
+
+namespace ihp {
+
+/** @brief Parser context owning its memory, calling a handler object.
+ *  Behaves like a context made by ihp_mem or ihp_file_buffered, calling
+ *  handler(address, data, len) where the C parser calls cb(ctx, address,
+ *  data, len): data is passed in pieces of at most MaxBuffer bytes, a
+ *  piece ends at every address discontinuity, and the final call has
+ *  data NULL and len 0 or an IHP_ERR_* code. The final call is made once
+ *  per run.
+ *  @tparam Handler Callable as bool(uint32_t, const uint8_t*, size_t);
+ *   returning false aborts parsing.
+ *  @tparam MaxBuffer Maximum amount of data to pass in a call. */
+template<typename Handler, size_t MaxBuffer = 64>
+class parser {
+	static_assert(MaxBuffer > 0, "MaxBuffer must not be 0");
+
+public:
+	explicit parser(Handler handler)
+		: handler_(std::move(handler)), mem_(ihp_file_size(MaxBuffer)) {}
+
+	Handler& handler() { return handler_; }
+
+	/** @brief Parse in-memory text without copying it.
+	 *  @return Error status IHP_ERR_* */
+	unsigned run(const void* src, size_t len)
+	{
+		return drive(ihp_mem(mem_.data(), MaxBuffer, src, len));
+	}
+
+	/** @brief Parse a stream from its current position, mapped if it is a
+	 *  regular file and read in 64K blocks otherwise. The stream is not
+	 *  closed.
+	 *  @return Error status IHP_ERR_* */
+	unsigned run(FILE* f)
+	{
+		struct ihp_ctx* ctx = ihp_file_buffered(mem_.data(), MaxBuffer, nullptr);
+		ihp_reset(ctx, f);
+		return drive(ctx);
+	}
+
+private:
+	unsigned drive(struct ihp_ctx* ctx)
+	{
+		ctx->cb = forward;
+		ctx->user_data = &handler_;
+		unsigned err = ihp_run(ctx);
+
+		/* The end was reported by ihp_run. */
+		ctx->cb = nullptr;
+		ihp_destroy(ctx);
+		return err;
+	}
+
+	static bool forward(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len)
+	{
+		return (*static_cast<Handler*>(ctx->user_data))(address, data, len);
+	}
+
+	Handler handler_;
+
+	/** @brief Context memory, with the read buffer for streams. */
+	std::vector<uint8_t> mem_;
+};
+
+/** @brief One entry of a range table for dispatch. */
+struct range {
+	/** @brief Start of address range. */
+	uint32_t start;
+
+	/** @brief Address range length. */
+	size_t length;
+
+	/** @brief If true, call the handler with an address relative to the start. */
+	bool relative = false;
+};
+
+/** @brief True if the ranges of table are sorted by start and do not overlap. */
+template<size_t N>
+constexpr bool ranges_valid(const range (&table)[N])
+{
+	for(size_t i = 1; i < N; ++i){
+		if(uint64_t(table[i - 1].start) + table[i - 1].length > table[i].start)
+			return false;
+	}
+	return true;
+}
+
+/** @brief Handler for parser dispatching data to one handler per range of
+ *  a constexpr range table, like ihpa_range_run. The table is checked and
+ *  every range test is unrolled at compile time. Data is clipped to each
+ *  range but, unlike ihpa_range_run, pieces are not joined across parser
+ *  calls. Every handler gets the final call.
+ *  @tparam Table Range table with static storage, e.g.
+ *   static constexpr ihp::range table[] = {{0x1000, 0x40}, ...};
+ *  @tparam Handlers Handler of each range, in table order. */
+template<const auto& Table, typename... Handlers>
+class dispatch {
+	static_assert(std::size(Table) == sizeof...(Handlers), "one handler per range");
+	static_assert(ranges_valid(Table), "ranges must be sorted and not overlap");
+
+public:
+	explicit dispatch(Handlers... handlers) : handlers_(std::move(handlers)...) {}
+
+	/** @brief Handler of range I. */
+	template<size_t I>
+	auto& get() { return std::get<I>(handlers_); }
+
+	bool operator()(uint32_t address, const uint8_t* data, size_t len)
+	{
+		return call(address, data, len, std::index_sequence_for<Handlers...>{});
+	}
+
+private:
+	template<size_t... I>
+	bool call(uint32_t address, const uint8_t* data, size_t len, std::index_sequence<I...>)
+	{
+		if(data)
+			return (true && ... && deliver<I>(address, data, len));
+
+		bool ok = true;
+		((ok = std::get<I>(handlers_)(0, nullptr, len) && ok), ...);
+		return ok;
+	}
+
+	template<size_t I>
+	bool deliver(uint32_t address, const uint8_t* data, size_t len)
+	{
+		constexpr range r = Table[I];
+		constexpr uint64_t r_end = uint64_t(r.start) + r.length;
+
+		uint64_t end = uint64_t(address) + len;
+		uint64_t from = address > r.start ? address : r.start;
+		uint64_t to = end < r_end ? end : r_end;
+		if(from >= to)
+			return true;
+
+		uint32_t user_address = r.relative ? from - r.start : from;
+		return std::get<I>(handlers_)(user_address, data + (from - address), to - from);
+	}
+
+	std::tuple<Handlers...> handlers_;
+};
+
+}
+
+#endif
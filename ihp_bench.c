@@ -0,0 +1,616 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "ihp_hex.h"
+#include "ihpa.h"
+#include "ihp_emit.h"
+
+/* Decoder and checksum as they were before ihp_hex, kept as the baseline. */
+static int legacy_hex_parse(uint8_t* dest, const char* src, size_t src_len){
+	if(src_len & 1)
+		return -1;
+
+	const char* begin = src;
+	const char* end = src + src_len;
+	while(src != end){
+		if(src[0] >= '0' && src[0] <= '9')
+			*dest = src[0] - '0';
+		else if(src[0] >= 'A' && src[0] <= 'F')
+			*dest = src[0] - 'A' + 0xA;
+		else
+			return -(src - begin);
+		*dest <<= 4;
+
+		if(src[1] >= '0' && src[1] <= '9')
+			*dest |= src[1] - '0';
+		else if(src[1] >= 'A' && src[1] <= 'F')
+			*dest |= src[1] - 'A' + 0xA;
+		else
+			return -(src - begin - 1);
+
+		++dest;
+		src += 2;
+	}
+
+	return end - begin;
+}
+
+static uint32_t legacy_checksum(const uint8_t* src, size_t len, unsigned checksum){
+	for(unsigned i = 0; i < len; ++i)
+		checksum += src[i];
+	return checksum;
+}
+
+static double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** @brief Decode total characters of input in pieces of len characters.
+ *  @return Seconds elapsed. */
+static double run(int impl, uint8_t* dest, const char* src, size_t total, size_t len, uint32_t* sum){
+	double t = now();
+	for(size_t off = 0; off + len <= total; off += len){
+		if(impl < 0){
+			if(legacy_hex_parse(dest + off / 2, src + off, len) < 0)
+				abort();
+			*sum = legacy_checksum(dest + off / 2, len / 2, *sum);
+		}
+		else if(ihp_hex_decode(dest + off / 2, src + off, len, sum) < 0){
+			abort();
+		}
+	}
+	return now() - t;
+}
+
+/** @brief Write one record. */
+static void put_record(FILE* f, uint8_t count, uint16_t address, uint8_t code, const uint8_t* data){
+	unsigned sum = count + (address >> 8) + (address & 0xFF) + code;
+	fprintf(f, ":%02X%04X%02X", count, address, code);
+	for(unsigned i = 0; i < count; ++i){
+		fprintf(f, "%02X", data[i]);
+		sum += data[i];
+	}
+	fprintf(f, "%02X\r\n", -sum & 0xFF);
+}
+
+/** @brief Write len bytes of pseudo random data from address 0
+ *  in records of 32 bytes. */
+static void put_image(FILE* f, size_t len){
+	uint8_t data[32];
+	for(size_t addr = 0; addr < len; addr += sizeof(data)){
+		if(!(addr & 0xFFFF)){
+			uint8_t base[2] = {addr >> 24, addr >> 16};
+			put_record(f, 2, 0, 4, base);
+		}
+		for(unsigned i = 0; i < sizeof(data); ++i)
+			data[i] = rand();
+		put_record(f, sizeof(data), addr, 0, data);
+	}
+	put_record(f, 0, 0, 1, NULL);
+}
+
+static unsigned long range_calls;
+
+static bool range_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len){
+	if(data)
+		++range_calls;
+	return true;
+}
+
+/** @brief Dispatch an image of len bytes over range_count evenly spaced
+ *  ranges, each covering half of the space up to the next. */
+static int bench_range(size_t len, unsigned range_count, size_t max){
+	size_t stride = len / range_count;
+	FILE* f = tmpfile();
+	if(!f)
+		return 1;
+	put_image(f, len);
+
+	struct ihpa_range* ranges = calloc(range_count, sizeof(*ranges));
+	if(!ranges)
+		return 1;
+	for(unsigned i = 0; i < range_count; ++i){
+		ranges[i].start = i * stride;
+		ranges[i].length = stride / 2;
+		ranges[i].ctx.cb = range_cb;
+	}
+
+	range_calls = 0;
+	rewind(f);
+	double t = now();
+	unsigned err = ihpa_range_run(ranges, range_count, max, f);
+	t = now() - t;
+	free(ranges);
+	if(err){
+		fprintf(stderr, "range run failed %u\n", err);
+		return 1;
+	}
+
+	printf("%-8s %8u %10.1f %10.1f\n", "range", range_count, len / t / 1e6, range_calls / t / 1e6);
+	return 0;
+}
+
+/** @brief Write a len byte image as hex with ihp_emit, and with a
+ *  fprintf per record as a baseline. */
+static int bench_emit(size_t len){
+	uint8_t* img = malloc(len);
+	FILE* f = fopen("/dev/null", "w");
+	if(!img || !f)
+		return 1;
+	for(size_t i = 0; i < len; ++i)
+		img[i] = rand();
+
+	static const unsigned lens[] = {16, 32, 255};
+	for(unsigned l = 0; l < sizeof(lens) / sizeof(lens[0]); ++l){
+		double t = now();
+		for(size_t addr = 0; addr < len; addr += lens[l]){
+			size_t cur = len - addr < lens[l] ? len - addr : lens[l];
+			if(!(addr & 0xFFFF) || (addr & 0xFFFF) + cur > 0x10000){
+				uint8_t base[2] = {addr >> 24, addr >> 16};
+				put_record(f, 2, 0, 4, base);
+			}
+			put_record(f, cur, addr, 0, img + addr);
+		}
+		put_record(f, 0, 0, 1, NULL);
+		fflush(f);
+		printf("%-8s %8u %10.1f\n", "fprintf", lens[l], len / (now() - t) / 1e6);
+
+		uint8_t mem[ihp_emit_size(1 << 20)];
+		struct ihp_emit* e = ihp_emit_file(mem, 1 << 20, f, lens[l], IHP_EMIT_LINEAR);
+		t = now();
+		if(!ihp_emit_data(e, 0, img, len) || !ihp_emit_finish(e))
+			return 1;
+		printf("%-8s %8u %10.1f\n", "emit", lens[l], len / (now() - t) / 1e6);
+	}
+
+	fclose(f);
+	free(img);
+	return 0;
+}
+
+static bool noop_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len){
+	return true;
+}
+
+/** @brief Parse a len byte image from memory with a no-op callback,
+ *  and validate it. */
+static int bench_validate(size_t len){
+	char* text;
+	size_t text_len;
+	FILE* f = open_memstream(&text, &text_len);
+	if(!f)
+		return 1;
+	put_image(f, len);
+	fclose(f);
+
+	uint8_t mem[ihp_size(4096)];
+	struct ihp_ctx* ic = ihp_mem(mem, 4096, text, text_len);
+	ic->cb = noop_cb;
+	double t = now();
+	unsigned err = ihp_run(ic);
+	t = now() - t;
+	ihp_destroy(ic);
+	if(err)
+		return 1;
+	printf("%-8s %10.1f\n", "run", text_len / t / 1e6);
+
+	struct ihp_summary sum;
+	ic = ihp_mem(mem, 4096, text, text_len);
+	t = now();
+	err = ihp_validate(ic, &sum);
+	t = now() - t;
+	ihp_destroy(ic);
+	if(err || sum.bytes != len)
+		return 1;
+	printf("%-8s %10.1f\n", "validate", text_len / t / 1e6);
+
+	free(text);
+	return 0;
+}
+
+/** @brief Populate a len byte image with and without digests, against
+ *  digesting the finished image in a second pass. */
+static int bench_digest(size_t len){
+	char* text;
+	size_t text_len;
+	FILE* f = open_memstream(&text, &text_len);
+	if(!f)
+		return 1;
+	put_image(f, len);
+	fclose(f);
+
+	uint8_t* img = malloc(len);
+	if(!img)
+		return 1;
+
+	static const struct {
+		const char* name;
+		unsigned kinds;
+	} cases[] = {
+		{"none", 0}
+		,{"crc32", IHPA_DIGEST_CRC32}
+		,{"sha256", IHPA_DIGEST_SHA256}
+		,{"both", IHPA_DIGEST_CRC32 | IHPA_DIGEST_SHA256}
+	};
+	for(unsigned i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i){
+		struct ihpa_digest d;
+		ihpa_digest_init(&d, cases[i].kinds, 0, len, 0xFF);
+		double t = now();
+		unsigned err = ihpa_populate_digest(len, img, 0xFF, fmemopen(text, text_len, "r"), &d);
+		t = now() - t;
+		if(err)
+			return 1;
+
+		/* The same digest over the image once populated. */
+		double t2 = now();
+		err = ihpa_populate(len, img, 0xFF, fmemopen(text, text_len, "r"));
+		ihpa_digest_init(&d, cases[i].kinds, 0, len, 0xFF);
+		ihpa_digest_add(&d, 0, img, len);
+		ihpa_digest_final(&d);
+		t2 = now() - t2;
+		if(err)
+			return 1;
+
+		printf("%-8s %10.1f %10.1f\n", cases[i].name, text_len / t / 1e6, text_len / t2 / 1e6);
+	}
+
+	free(img);
+	free(text);
+	return 0;
+}
+
+static int bench_hex(size_t total){
+	char* src = malloc(total);
+	uint8_t* dest = malloc(total / 2);
+	if(!src || !dest)
+		return 1;
+
+	static const char digits[] = "0123456789ABCDEF";
+	srand(1);
+	for(size_t i = 0; i < total; ++i)
+		src[i] = digits[rand() & 0xF];
+
+	static const char* names[COUNT_IHP_HEX] = {"scalar", "sse2", "avx2"};
+	static const size_t lens[] = {8, 32, 64, 510, 1 << 20};
+
+	printf("%-8s %8s %10s\n", "impl", "chars", "MB/s");
+	for(unsigned l = 0; l < sizeof(lens) / sizeof(lens[0]); ++l){
+		uint32_t ref = 0;
+		double t = run(-1, dest, src, total, lens[l], &ref);
+		printf("%-8s %8zu %10.1f\n", "legacy", lens[l], total / t / 1e6);
+
+		for(unsigned impl = 0; impl < COUNT_IHP_HEX; ++impl){
+			if(ihp_hex_select(impl) != impl)
+				continue;
+
+			uint32_t sum = 0;
+			t = run(impl, dest, src, total, lens[l], &sum);
+			if(sum != ref){
+				fprintf(stderr, "%s checksum mismatch\n", names[impl]);
+				return 1;
+			}
+			printf("%-8s %8zu %10.1f\n", names[impl], lens[l], total / t / 1e6);
+		}
+	}
+	ihp_hex_select(COUNT_IHP_HEX);
+
+	free(src);
+	free(dest);
+	return 0;
+}
+
+/* Corpus suite: generated hex files of various shapes, parsed through
+ * the public entry points, reported as CSV for comparison across builds. */
+
+/** @brief Unit of generated data; gaps and reordering work on blocks. */
+#define CORPUS_BLOCK 4096
+
+/** @brief Shape of a generated hex file. */
+struct corpus {
+	/** @brief Address span in bytes, starting at address 0. */
+	size_t span;
+
+	/** @brief Data bytes per record. */
+	unsigned record_len;
+
+	/** @brief IHP_EMIT_LINEAR for type 04 or IHP_EMIT_SEGMENT for type 02 bases. */
+	unsigned mode;
+
+	/** @brief Leave out every gap-th block; 0 for none. */
+	unsigned gap;
+
+	/** @brief Write the blocks in shuffled order. */
+	bool shuffle;
+};
+
+/** @brief Deterministic generator, so every build parses the same input. */
+static uint32_t xorshift(uint32_t* state){
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+/** @brief Write the hex file described by c to path.
+ *  @return Size of the file, or 0 on error. */
+static size_t corpus_write(const char* path, const struct corpus* c){
+	size_t blocks = (c->span + CORPUS_BLOCK - 1) / CORPUS_BLOCK;
+	size_t* order = malloc(blocks * sizeof(*order));
+	FILE* f = fopen(path, "w");
+	if(!order || !f)
+		return 0;
+
+	uint32_t state = 0x12345678;
+	for(size_t i = 0; i < blocks; ++i)
+		order[i] = i;
+	if(c->shuffle){
+		for(size_t i = blocks - 1; i > 0; --i){
+			size_t j = xorshift(&state) % (i + 1);
+			size_t t = order[i];
+			order[i] = order[j];
+			order[j] = t;
+		}
+	}
+
+	uint8_t mem[ihp_emit_size(1 << 16)];
+	struct ihp_emit* e = ihp_emit_file(mem, 1 << 16, f, c->record_len, c->mode);
+	bool ok = e;
+	uint32_t data[CORPUS_BLOCK / 4];
+	for(size_t i = 0; ok && i < blocks; ++i){
+		if(c->gap && order[i] % c->gap == c->gap - 1)
+			continue;
+
+		size_t addr = order[i] * CORPUS_BLOCK;
+		size_t len = c->span - addr < CORPUS_BLOCK ? c->span - addr : CORPUS_BLOCK;
+		for(unsigned j = 0; j < CORPUS_BLOCK / 4; ++j)
+			data[j] = xorshift(&state);
+		ok = ihp_emit_data(e, addr, (const uint8_t*)data, len);
+	}
+	ok = ok && ihp_emit_finish(e);
+
+	long size = ftell(f);
+	fclose(f);
+	free(order);
+	return ok && size > 0 ? size : 0;
+}
+
+static unsigned long suite_calls;
+
+static bool suite_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len){
+	if(!data)
+		return !len;
+	++suite_calls;
+	return true;
+}
+
+static unsigned suite_run(const char* path, const struct corpus* c, uint8_t* img){
+	FILE* f = fopen(path, "r");
+	if(!f)
+		return COUNT_IHP_ERR;
+
+	uint8_t mem[ihp_file_size(4096)];
+	struct ihp_ctx* ic = ihp_file_buffered(mem, 4096, f);
+	ic->cb = suite_cb;
+	unsigned err = ihp_run(ic);
+	ihp_destroy(ic);
+	return err;
+}
+
+static unsigned suite_populate(const char* path, const struct corpus* c, uint8_t* img){
+	FILE* f = fopen(path, "r");
+	if(!f)
+		return COUNT_IHP_ERR;
+	return ihpa_populate(c->span, img, 0xFF, f);
+}
+
+/** @brief Dispatch over 64 ranges, each covering half of its share. */
+static unsigned suite_range(const char* path, const struct corpus* c, uint8_t* img){
+	FILE* f = fopen(path, "r");
+	if(!f)
+		return COUNT_IHP_ERR;
+
+	struct ihpa_range ranges[64];
+	size_t stride = c->span / 64 ? c->span / 64 : 1;
+	memset(ranges, 0, sizeof(ranges));
+	for(unsigned i = 0; i < 64; ++i){
+		ranges[i].start = i * stride;
+		ranges[i].length = stride / 2 ? stride / 2 : 1;
+		ranges[i].ctx.cb = suite_cb;
+	}
+	return ihpa_range_run(ranges, 64, 256, f);
+}
+
+typedef unsigned (*suite_fn)(const char* path, const struct corpus* c, uint8_t* img);
+
+/** @brief Time fn on the corpus in path, repeating until at least
+ *  0.2s have elapsed, and print one CSV row. */
+static int suite_time(const char* name, suite_fn fn, const char* path,
+	const struct corpus* c, size_t file_len, size_t records, uint8_t* img)
+{
+	unsigned reps = 0;
+	suite_calls = 0;
+	double t = now();
+	double elapsed;
+	do{
+		unsigned err = fn(path, c, img);
+		if(err){
+			fprintf(stderr, "%s failed %u\n", name, err);
+			return 1;
+		}
+		++reps;
+		elapsed = now() - t;
+	}while(elapsed < 0.2);
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+	double per = elapsed / reps;
+	printf("%s,%zu,%u,%s,%s,%u,%zu,%zu,%u,%.1f,%.0f,%.0f,%ld\n"
+		,name, c->span, c->record_len, IHP_EMIT_SEGMENT == c->mode ? "02" : "04"
+		,c->shuffle ? "shuffled" : "ordered", c->gap, file_len, records, reps
+		,file_len / per / 1e6, records / per, suite_calls / elapsed, ru.ru_maxrss);
+	return 0;
+}
+
+/** @brief Generate each corpus shape for spans from 1K up to max_span,
+ *  and time ihp_run, ihpa_populate and ihpa_range_run on it.
+ *  Rates are per second; MB/s counts hex text, peak_rss_kb is the
+ *  high water mark of the process so far. */
+static int bench_suite(size_t max_span){
+	static const struct corpus shapes[] = {
+		{.record_len = 16, .mode = IHP_EMIT_LINEAR}
+		,{.record_len = 32, .mode = IHP_EMIT_LINEAR}
+		,{.record_len = 255, .mode = IHP_EMIT_LINEAR}
+		,{.record_len = 32, .mode = IHP_EMIT_LINEAR, .gap = 4}
+		,{.record_len = 32, .mode = IHP_EMIT_LINEAR, .shuffle = true}
+		,{.record_len = 32, .mode = IHP_EMIT_SEGMENT}
+		,{.record_len = 32, .mode = IHP_EMIT_SEGMENT, .gap = 4, .shuffle = true}
+	};
+
+	const char* dir = getenv("TMPDIR");
+	char path[256];
+	snprintf(path, sizeof(path), "%s/ihp_bench.XXXXXX", dir ? dir : "/tmp");
+	int fd = mkstemp(path);
+	if(fd < 0)
+		return 1;
+	close(fd);
+
+	printf("bench,span,record_len,base,order,gap,file_bytes,records,reps"
+		",mb_s,records_s,callbacks_s,peak_rss_kb\n");
+
+	int ret = 0;
+	for(size_t span = 1 << 10; !ret && span <= max_span; span <<= 4){
+		uint8_t* img = malloc(span);
+		if(!img){
+			ret = 1;
+			break;
+		}
+
+		for(unsigned s = 0; !ret && s < sizeof(shapes) / sizeof(shapes[0]); ++s){
+			struct corpus c = shapes[s];
+			c.span = span;
+
+			/* Segment addressing reaches only the first 1M. */
+			if(IHP_EMIT_SEGMENT == c.mode && span > 0x100000)
+				continue;
+
+			size_t file_len = corpus_write(path, &c);
+			struct ihp_summary sum;
+			FILE* f = file_len ? fopen(path, "r") : NULL;
+			uint8_t mem[ihp_file_size(64)];
+			struct ihp_ctx* ic = f ? ihp_file_buffered(mem, 64, f) : NULL;
+			unsigned err = ic ? ihp_validate(ic, &sum) : COUNT_IHP_ERR;
+			if(ic)
+				ihp_destroy(ic);
+			if(err){
+				fprintf(stderr, "corpus generation failed\n");
+				ret = 1;
+				break;
+			}
+
+			ret = suite_time("run", suite_run, path, &c, file_len, sum.records, img)
+				|| suite_time("populate", suite_populate, path, &c, file_len, sum.records, img)
+				|| suite_time("range", suite_range, path, &c, file_len, sum.records, img);
+		}
+		free(img);
+	}
+
+	unlink(path);
+	return ret;
+}
+
+/** @brief Range callback waiting as if writing to a device. */
+static bool device_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len){
+	if(data){
+		struct timespec ts = {0, 20000};
+		nanosleep(&ts, NULL);
+	}
+	return true;
+}
+
+/** @brief Dispatch a len byte image over 4 ranges with device_cb, in the
+ *  parser thread and with 1 and 4 consumer threads. */
+static int bench_async(size_t len, size_t max){
+	char* text;
+	size_t text_len;
+	FILE* f = open_memstream(&text, &text_len);
+	if(!f)
+		return 1;
+	put_image(f, len);
+	fclose(f);
+
+	struct ihpa_range ranges[4];
+	memset(ranges, 0, sizeof(ranges));
+	for(unsigned i = 0; i < 4; ++i){
+		ranges[i].start = i * (len / 4);
+		ranges[i].length = len / 4;
+		ranges[i].ctx.cb = device_cb;
+	}
+
+	static const unsigned consumers[] = {0, 1, 4};
+	for(unsigned i = 0; i < sizeof(consumers) / sizeof(consumers[0]); ++i){
+		FILE* in = fmemopen(text, text_len, "r");
+		double t = now();
+		unsigned err = consumers[i]
+			? ihpa_range_run_async(ranges, 4, max, in, 0, consumers[i])
+			: ihpa_range_run(ranges, 4, max, in);
+		t = now() - t;
+		if(err){
+			fprintf(stderr, "async run failed %u\n", err);
+			return 1;
+		}
+		printf("%-8s %8u %10.1f\n", consumers[i] ? "async" : "sync", consumers[i], text_len / t / 1e6);
+	}
+
+	free(text);
+	return 0;
+}
+
+int main(int argc, const char* argv[]){
+	/* ihp_bench suite [MB]: CSV corpus suite over spans up to MB. */
+	if(argc > 1 && !strcmp(argv[1], "suite")){
+		size_t max_span = 16 << 20;
+		if(argc > 2)
+			max_span = strtoul(argv[2], NULL, 10) << 20;
+		return bench_suite(max_span);
+	}
+
+	/* Total characters decoded per measurement. */
+	size_t total = 64 << 20;
+	if(argc > 1)
+		total = strtoul(argv[1], NULL, 10) << 20;
+
+	if(bench_hex(total))
+		return 1;
+
+	printf("\n%-8s %8s %10s %10s\n", "dispatch", "ranges", "MB/s", "Mcalls/s");
+	static const unsigned counts[] = {10, 1000, 10000};
+	for(unsigned i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i){
+		if(bench_range(8 << 20, counts[i], 64))
+			return 1;
+	}
+
+	printf("\n%-8s %10s\n", "parse", "MB/s");
+	if(bench_validate(total / 4))
+		return 1;
+
+	printf("\n%-8s %10s %10s\n", "digest", "MB/s", "2 pass");
+	if(bench_digest(total / 4))
+		return 1;
+
+	printf("\n%-8s %8s %10s\n", "device", "threads", "MB/s");
+	if(bench_async(1 << 20, 256))
+		return 1;
+
+	printf("\n%-8s %8s %10s\n", "writer", "record", "MB/s");
+	if(bench_emit(total))
+		return 1;
+
+	return 0;
+}
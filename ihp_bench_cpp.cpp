@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include "ihp.hpp"
+
+extern "C" {
+#include "ihpa.h"
+#include "ihp_emit.h"
+}
+
+/* The C callback path against ihp::parser and ihp::dispatch on the same
+ * text, with handlers that do the same trivial work. */
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** @brief Hex text of len bytes of pseudo random data from address 0. */
+static char* make_image(size_t len, size_t* text_len)
+{
+	char* text;
+	FILE* f = open_memstream(&text, text_len);
+	if(!f)
+		return nullptr;
+
+	std::vector<uint8_t> mem(ihp_emit_size(1 << 16));
+	struct ihp_emit* e = ihp_emit_file(mem.data(), 1 << 16, f, 32, IHP_EMIT_LINEAR);
+	std::vector<uint8_t> data(len);
+	for(auto& b : data)
+		b = rand();
+	bool ok = ihp_emit_data(e, 0, data.data(), len) && ihp_emit_finish(e);
+	fclose(f);
+	if(!ok){
+		free(text);
+		return nullptr;
+	}
+	return text;
+}
+
+struct tally {
+	unsigned long calls;
+	unsigned long bytes;
+};
+
+static bool c_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len)
+{
+	auto t = static_cast<tally*>(ctx->user_data);
+	if(data){
+		++t->calls;
+		t->bytes += len;
+	}
+	return true;
+}
+
+/** @brief Rounds of each measurement; the best is kept. */
+#define ROUNDS 3
+
+template<size_t Max>
+static int bench_parse(const char* text, size_t text_len)
+{
+	std::vector<uint8_t> mem(ihp_size(Max));
+	double t = 1e9;
+	double t2 = 1e9;
+	for(unsigned r = 0; r < ROUNDS; ++r){
+		tally tc = {};
+		struct ihp_ctx* ic = ihp_mem(mem.data(), Max, text, text_len);
+		ic->cb = c_cb;
+		ic->user_data = &tc;
+		double start = now();
+		unsigned err = ihp_run(ic);
+		t = std::min(t, now() - start);
+		ihp_destroy(ic);
+
+		tally tp = {};
+		auto h = [&tp](uint32_t address, const uint8_t* data, size_t len){
+			if(data){
+				++tp.calls;
+				tp.bytes += len;
+			}
+			return true;
+		};
+		ihp::parser<decltype(h), Max> parser(h);
+		start = now();
+		unsigned err2 = parser.run(text, text_len);
+		t2 = std::min(t2, now() - start);
+
+		if(err || err2 || tc.calls != tp.calls || tc.bytes != tp.bytes){
+			fprintf(stderr, "parse mismatch %u %u\n", err, err2);
+			return 1;
+		}
+	}
+
+	printf("%-8s %8zu %10.1f %10.1f\n", "parse", Max, text_len / t / 1e6, text_len / t2 / 1e6);
+	return 0;
+}
+
+/** @brief Handler of a range of the C++ table. */
+struct range_handler {
+	tally* t;
+
+	bool operator()(uint32_t address, const uint8_t* data, size_t len)
+	{
+		if(data){
+			++t->calls;
+			t->bytes += len;
+		}
+		return true;
+	}
+};
+
+/* Ranges like those of a small MCU: information segments, code and vectors. */
+static constexpr ihp::range table[] = {
+	{0x1000, 0x40}
+	,{0x1040, 0x40}
+	,{0xC000, 0x3FE0}
+	,{0xFFE0, 0x20}
+};
+
+static int bench_dispatch(const char* text, size_t text_len)
+{
+	double t = 1e9;
+	double t2 = 1e9;
+	for(unsigned r = 0; r < ROUNDS; ++r){
+		struct ihpa_range ranges[4] = {};
+		tally tc[4] = {};
+		for(unsigned i = 0; i < 4; ++i){
+			ranges[i].start = table[i].start;
+			ranges[i].length = table[i].length;
+			ranges[i].ctx.cb = c_cb;
+			ranges[i].ctx.user_data = tc + i;
+		}
+
+		FILE* f = fmemopen((void*)text, text_len, "r");
+		double start = now();
+		unsigned err = ihpa_range_run(ranges, 4, 64, f);
+		t = std::min(t, now() - start);
+
+		tally tp[4] = {};
+		ihp::dispatch<table, range_handler, range_handler, range_handler, range_handler>
+			d({tp}, {tp + 1}, {tp + 2}, {tp + 3});
+		ihp::parser<decltype(d), 64> parser(d);
+		f = fmemopen((void*)text, text_len, "r");
+		start = now();
+		unsigned err2 = parser.run(f);
+		t2 = std::min(t2, now() - start);
+		fclose(f);
+
+		bool same = true;
+		for(unsigned i = 0; i < 4; ++i)
+			same = same && tc[i].bytes == tp[i].bytes;
+		if(err || err2 || !same){
+			fprintf(stderr, "dispatch mismatch %u %u\n", err, err2);
+			return 1;
+		}
+	}
+
+	printf("%-8s %8u %10.1f %10.1f\n", "range", 4u, text_len / t / 1e6, text_len / t2 / 1e6);
+	return 0;
+}
+
+int main(int argc, const char* argv[])
+{
+	size_t len = 16 << 20;
+	if(argc > 1)
+		len = strtoul(argv[1], nullptr, 10) << 20;
+
+	size_t text_len;
+	char* text = make_image(len, &text_len);
+	if(!text)
+		return 1;
+
+	printf("%-8s %8s %10s %10s\n", "path", "max", "C MB/s", "C++ MB/s");
+	if(bench_parse<16>(text, text_len) || bench_parse<64>(text, text_len)
+		|| bench_parse<4096>(text, text_len))
+	{
+		return 1;
+	}
+
+	if(bench_dispatch(text, text_len))
+		return 1;
+
+	free(text);
+	return 0;
+}
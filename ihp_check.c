@@ -0,0 +1,1758 @@
+/* The checks are asserts; keep them in any build. */
+#undef NDEBUG
+#include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "ihpa.h"
+#include "ihp_hex.h"
+#include "ihp_emit.h"
+
+/* Behaviour checks of the library, run by make check. Inputs are generated
+ * with ihp_emit from lists of blocks, and what each entry point passes on
+ * is compared with the image the blocks describe. */
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+/** @brief Bytes of address space the inputs use. */
+#define SPAN 0x20000
+
+/** @brief Most calls one check records. */
+#define PIECES 512
+
+/** @brief Block of generated data. */
+struct block {
+	uint32_t address;
+	size_t len;
+
+	/** @brief Pattern of the data; 0 for all 0xFF, as erased flash. */
+	uint8_t seed;
+};
+
+/** @brief Input used by most checks: gaps, blocks not aligned to records
+ *  and a block crossing 64K, which needs a second base record. */
+static const struct block layout[] = {
+	{0x0000, 300, 1}
+	,{0x1003, 50, 2}
+	,{0xFFE0, 0x40, 3}
+	,{0x12345, 100, 4}
+};
+
+/** @brief Data call seen by a struct collect. */
+struct piece {
+	uint32_t address;
+	size_t len;
+};
+
+/** @brief Everything passed to collect_cb. */
+struct collect {
+	/** @brief Data by address, SPAN bytes. */
+	uint8_t* img;
+
+	/** @brief Addresses data was passed for. */
+	bool* mask;
+
+	struct piece pieces[PIECES];
+	unsigned count;
+
+	/** @brief Number of final callbacks, and the code of the last one. */
+	unsigned ends;
+	size_t err;
+
+	/** @brief If not 0, return false from data call number stop. */
+	unsigned stop;
+};
+
+static char temp_dir[] = "/tmp/ihp_check.XXXXXX";
+static char* temp_paths[64];
+static unsigned temp_count;
+
+/* Internal functions. */
+
+static void* alloc(size_t len)
+{
+	void* ret = malloc(len ? len : 1);
+	assert(ret);
+	return ret;
+}
+
+/** @brief Byte i of a block. */
+static uint8_t block_byte(const struct block* b, size_t i)
+{
+	return b->seed ? (uint8_t)(b->seed * 31 + i * 7 + (i >> 8)) : 0xFF;
+}
+
+/** @brief Lay blocks over an image of pad, later ones winning, and mark
+ *  their addresses in mask if it is not NULL. */
+static void block_image(uint8_t* img, bool* mask, uint8_t pad,
+	const struct block* blocks, unsigned count)
+{
+	memset(img, pad, SPAN);
+	if(mask)
+		memset(mask, 0, SPAN);
+
+	for(unsigned b = 0; b < count; ++b){
+		for(size_t i = 0; i < blocks[b].len; ++i){
+			img[blocks[b].address + i] = block_byte(blocks + b, i);
+			if(mask)
+				mask[blocks[b].address + i] = true;
+		}
+	}
+}
+
+/** @brief Hex text of blocks, in order, with records of record_len bytes.
+ *  @return NUL terminated text to free. */
+static char* hex_text(const struct block* blocks, unsigned count, unsigned record_len, size_t* len)
+{
+	char* text;
+	FILE* f = open_memstream(&text, len);
+	uint8_t* mem = alloc(ihp_emit_size(4096));
+	struct ihp_emit* e = f ? ihp_emit_file(mem, 4096, f, record_len, IHP_EMIT_LINEAR) : NULL;
+	assert(e);
+
+	for(unsigned b = 0; b < count; ++b){
+		uint8_t* data = alloc(blocks[b].len);
+		for(size_t i = 0; i < blocks[b].len; ++i)
+			data[i] = block_byte(blocks + b, i);
+		assert(ihp_emit_data(e, blocks[b].address, data, blocks[b].len));
+		free(data);
+	}
+
+	assert(ihp_emit_finish(e));
+	fclose(f);
+	free(mem);
+	return text;
+}
+
+/** @brief Number of records in text. */
+static unsigned hex_records(const char* text)
+{
+	unsigned ret = 0;
+	for(; *text; ++text)
+		ret += ':' == *text;
+	return ret;
+}
+
+/** @brief Copy of text with the checksum of record number record broken. */
+static char* hex_corrupt(const char* text, size_t len, unsigned record)
+{
+	char* ret = alloc(len + 1);
+	memcpy(ret, text, len + 1);
+
+	char* p = ret;
+	for(unsigned i = 0; i <= record; ++i){
+		p = strchr(p + !!i, ':');
+		assert(p);
+	}
+	p += strcspn(p, "\r\n") - 1;
+	*p = '0' == *p ? '1' : '0';
+	return ret;
+}
+
+/** @brief Regular file holding text, at its start, which ihp_file maps. */
+static FILE* text_file(const char* text, size_t len)
+{
+	FILE* f = tmpfile();
+	assert(f && len == fwrite(text, 1, len, f));
+	rewind(f);
+	return f;
+}
+
+/** @brief Stream holding text that cannot be mapped. */
+static FILE* text_stream(const char* text, size_t len)
+{
+	FILE* f = fmemopen((void*)text, len, "r");
+	assert(f);
+	return f;
+}
+
+/** @brief Path of a file in the temporary directory, removed at exit. */
+static const char* temp_path(const char* name)
+{
+	assert(temp_count < COUNT(temp_paths));
+	char* path = alloc(strlen(temp_dir) + strlen(name) + 2);
+	sprintf(path, "%s/%s", temp_dir, name);
+	temp_paths[temp_count++] = path;
+	return path;
+}
+
+static const char* temp_write(const char* name, const char* text, size_t len)
+{
+	const char* path = temp_path(name);
+	FILE* f = fopen(path, "w");
+	assert(f && len == fwrite(text, 1, len, f));
+	fclose(f);
+	return path;
+}
+
+static void temp_remove(void)
+{
+	for(unsigned i = 0; i < temp_count; ++i){
+		unlink(temp_paths[i]);
+		free(temp_paths[i]);
+	}
+	rmdir(temp_dir);
+}
+
+static void collect_init(struct collect* c, uint8_t pad)
+{
+	memset(c, 0, sizeof(*c));
+	c->img = alloc(SPAN);
+	c->mask = alloc(SPAN * sizeof(bool));
+	memset(c->img, pad, SPAN);
+	memset(c->mask, 0, SPAN * sizeof(bool));
+}
+
+static void collect_free(struct collect* c)
+{
+	free(c->img);
+	free(c->mask);
+}
+
+static bool collect_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len)
+{
+	struct collect* c = ctx->user_data;
+	if(!data){
+		++c->ends;
+		c->err = len;
+		return true;
+	}
+
+	/* No data after the end, none out of bounds and never empty calls. */
+	assert(!c->ends && len && (uint64_t)address + len <= SPAN);
+	assert(c->count < PIECES);
+	c->pieces[c->count++] = (struct piece){address, len};
+	memcpy(c->img + address, data, len);
+	memset(c->mask + address, true, len * sizeof(bool));
+	return c->count != c->stop;
+}
+
+/** @brief Run a parser context into c. */
+static unsigned collect_run(struct ihp_ctx* ic, struct collect* c)
+{
+	ic->cb = collect_cb;
+	ic->user_data = c;
+	return ihp_run(ic);
+}
+
+/** @brief True if count pieces are the same; they may have padding. */
+static bool pieces_same(const struct piece* a, const struct piece* b, unsigned count)
+{
+	for(unsigned i = 0; i < count; ++i){
+		if(a[i].address != b[i].address || a[i].len != b[i].len)
+			return false;
+	}
+	return true;
+}
+
+/** @brief Assert that two collections saw exactly the same calls. */
+static void collect_same(const struct collect* a, const struct collect* b)
+{
+	assert(a->count == b->count && pieces_same(a->pieces, b->pieces, a->count));
+	assert(a->ends == b->ends && a->err == b->err);
+	assert(!memcmp(a->img, b->img, SPAN));
+}
+
+/** @brief Assert that c passed exactly the data of blocks, padded with pad. */
+static void collect_blocks(const struct collect* c, uint8_t pad,
+	const struct block* blocks, unsigned count)
+{
+	uint8_t* img = alloc(SPAN);
+	bool* mask = alloc(SPAN * sizeof(bool));
+	block_image(img, mask, pad, blocks, count);
+	assert(!memcmp(c->img, img, SPAN));
+	assert(!memcmp(c->mask, mask, SPAN * sizeof(bool)));
+	free(img);
+	free(mask);
+}
+
+/** @brief Every source of a context delivers the same calls, and errors
+ *  and aborts end the run with one final callback holding the code. */
+static void check_sources(void)
+{
+	const size_t max = 40;
+	size_t len;
+	char* text = hex_text(layout, COUNT(layout), 16, &len);
+	const char* path = temp_write("sources.hex", text, len);
+	uint8_t* mem = alloc(ihp_size(max));
+
+	struct collect ref;
+	collect_init(&ref, 0xFF);
+	assert(IHP_ERR_OK == collect_run(ihp_mem(mem, max, text, len), &ref));
+	ihp_destroy((struct ihp_ctx*)mem);
+	assert(1 == ref.ends && IHP_ERR_OK == ref.err);
+	collect_blocks(&ref, 0xFF, layout, COUNT(layout));
+	for(unsigned i = 0; i < ref.count; ++i)
+		assert(ref.pieces[i].len <= max);
+
+	/* Mapped path, mapped and streamed FILE in ihp_size memory, and a
+	 * stream read in blocks. */
+	uint8_t* buffered = alloc(ihp_file_size(max));
+	for(unsigned s = 0; s < 4; ++s){
+		struct collect c;
+		collect_init(&c, 0xFF);
+		struct ihp_ctx* ic;
+		if(0 == s)
+			ic = ihp_mmap(mem, max, path);
+		else if(3 == s)
+			ic = ihp_file_buffered(buffered, max, text_stream(text, len));
+		else
+			ic = ihp_file(mem, max, 1 == s ? text_file(text, len) : text_stream(text, len));
+		assert(ic);
+		assert(IHP_ERR_OK == collect_run(ic, &c));
+		ihp_destroy(ic);
+		collect_same(&c, &ref);
+		collect_free(&c);
+	}
+
+	/* A bad checksum ends the run after the data before it. */
+	struct collect c;
+	char* bad = hex_corrupt(text, len, 3);
+	for(unsigned s = 0; s < 2; ++s){
+		collect_init(&c, 0xFF);
+		struct ihp_ctx* ic = s ? ihp_file(mem, max, text_stream(bad, len)) : ihp_mem(mem, max, bad, len);
+		assert(IHP_ERR_CHECKSUM == collect_run(ic, &c));
+		ihp_destroy(ic);
+		assert(1 == c.ends && IHP_ERR_CHECKSUM == c.err);
+		assert(c.count && !memcmp(c.img, ref.img, 2 * 16));
+		collect_free(&c);
+	}
+	free(bad);
+
+	/* Other malformed input. */
+	collect_init(&c, 0xFF);
+	assert(IHP_ERR_BAD_HEADER == collect_run(ihp_mem(mem, max, "x", 1), &c));
+	ihp_destroy((struct ihp_ctx*)mem);
+	assert(1 == c.ends && IHP_ERR_BAD_HEADER == c.err && !c.count);
+	collect_free(&c);
+
+	size_t cut = strchr(text + 1, ':') - text + 5;
+	collect_init(&c, 0xFF);
+	assert(IHP_ERR_EARLY_ABORT == collect_run(ihp_mem(mem, max, text, cut), &c));
+	ihp_destroy((struct ihp_ctx*)mem);
+	assert(1 == c.ends && IHP_ERR_EARLY_ABORT == c.err);
+	collect_free(&c);
+
+	/* The callback aborting. */
+	collect_init(&c, 0xFF);
+	c.stop = 2;
+	assert(IHP_ERR_USER_ABORT == collect_run(ihp_mem(mem, max, text, len), &c));
+	ihp_destroy((struct ihp_ctx*)mem);
+	assert(2 == c.count && 1 == c.ends && IHP_ERR_USER_ABORT == c.err);
+	collect_free(&c);
+
+	assert(!ihp_mmap(mem, max, temp_path("missing.hex")));
+
+	collect_free(&ref);
+	free(buffered);
+	free(mem);
+	free(text);
+}
+
+/** @brief Every decoder converts and sums the same, at every length, and
+ *  rejects the same input. */
+static void check_hex(void)
+{
+	static const char text[] = "00fF7a80A5c3e10123456789abcdefABCDEF00112233445566778899aAbBcCdDeEfF";
+	const size_t len = sizeof(text) - 1;
+	uint8_t ref[sizeof(text) / 2];
+	for(size_t i = 0; i < len / 2; ++i)
+		sscanf(text + 2 * i, "%2hhx", ref + i);
+
+	for(unsigned impl = 0; impl < COUNT_IHP_HEX; ++impl){
+		assert(ihp_hex_select(impl) <= impl);
+
+		/* Every length, so that each tail of the wide decoders runs. */
+		uint32_t want = 7;
+		for(size_t n = 0; n <= len; n += 2){
+			uint8_t dest[sizeof(text) / 2];
+			uint32_t sum = 7;
+			assert((int)n == ihp_hex_decode(dest, text, n, &sum));
+			assert(!memcmp(dest, ref, n / 2) && want == sum);
+
+			sum = 7;
+			assert((int)n == ihp_hex_decode(NULL, text, n, &sum) && want == sum);
+			if(n < len)
+				want += ref[n / 2];
+		}
+
+		/* In place. */
+		char buf[sizeof(text)];
+		memcpy(buf, text, sizeof(text));
+		uint32_t sum = 7;
+		assert((int)len == ihp_hex_decode((uint8_t*)buf, buf, len, &sum));
+		assert(!memcmp(buf, ref, len / 2) && want == sum);
+
+		/* Characters next to the digits in ASCII, anywhere, and odd lengths. */
+		for(size_t at = 0; at < len; ++at){
+			memcpy(buf, text, sizeof(text));
+			buf[at] = "/:@G`g"[at % 6];
+			sum = 7;
+			assert(ihp_hex_decode(NULL, buf, len, &sum) < 0 && 7 == sum);
+		}
+		assert(ihp_hex_decode(NULL, text, 3, &sum) < 0);
+	}
+
+	ihp_hex_select(COUNT_IHP_HEX - 1);
+}
+
+/** @brief Input pushed in pieces makes the calls ihp_run does, and an
+ *  error sticks to the context. */
+static void check_push(void)
+{
+	const size_t max = 40;
+	size_t len;
+	char* text = hex_text(layout, COUNT(layout), 16, &len);
+	uint8_t* mem = alloc(ihp_size(max));
+
+	struct collect ref;
+	collect_init(&ref, 0xFF);
+	assert(IHP_ERR_OK == collect_run(ihp_mem(mem, max, text, len), &ref));
+	ihp_destroy((struct ihp_ctx*)mem);
+
+	/* Pieces of every size from 1 to 13 bytes. */
+	struct collect c;
+	collect_init(&c, 0xFF);
+	struct ihp_ctx* ic = ihp_push(mem, max);
+	ic->cb = collect_cb;
+	ic->user_data = &c;
+	for(size_t at = 0, n = 1; at < len; at += n, n = n % 13 + 1)
+		assert(IHP_ERR_OK == ihp_feed(ic, text + at, at + n < len ? n : len - at));
+	assert(IHP_ERR_OK == ihp_finish(ic));
+	ihp_destroy(ic);
+	collect_same(&c, &ref);
+	collect_free(&c);
+
+	/* A bad checksum, then good input. */
+	char* bad = hex_corrupt(text, len, 3);
+	collect_init(&c, 0xFF);
+	ic = ihp_push(mem, max);
+	ic->cb = collect_cb;
+	ic->user_data = &c;
+	assert(IHP_ERR_CHECKSUM == ihp_feed(ic, bad, len));
+	assert(1 == c.ends && IHP_ERR_CHECKSUM == c.err);
+	assert(IHP_ERR_CHECKSUM == ihp_feed(ic, text, len));
+	ihp_destroy(ic);
+	collect_free(&c);
+	free(bad);
+
+	/* Input ending inside a record. */
+	size_t cut = strchr(text + 1, ':') - text + 5;
+	collect_init(&c, 0xFF);
+	ic = ihp_push(mem, max);
+	ic->cb = collect_cb;
+	ic->user_data = &c;
+	assert(IHP_ERR_OK == ihp_feed(ic, text, cut));
+	assert(IHP_ERR_EARLY_ABORT == ihp_finish(ic));
+	ihp_destroy(ic);
+	assert(1 == c.ends && IHP_ERR_EARLY_ABORT == c.err);
+	collect_free(&c);
+
+	/* One final call however the input ends, with finish repeated, and
+	 * none more from destroy: all input, none, and no EOF record. */
+	size_t last = strrchr(text, ':') - text;
+	const size_t lens[] = {len, 0, last};
+	for(unsigned i = 0; i < COUNT(lens); ++i){
+		collect_init(&c, 0xFF);
+		ic = ihp_push(mem, max);
+		ic->cb = collect_cb;
+		ic->user_data = &c;
+		if(lens[i])
+			assert(IHP_ERR_OK == ihp_feed(ic, text, lens[i]));
+		assert(IHP_ERR_OK == ihp_finish(ic));
+		assert(IHP_ERR_OK == ihp_finish(ic));
+		ihp_destroy(ic);
+		assert(1 == c.ends && IHP_ERR_OK == c.err);
+		collect_free(&c);
+	}
+
+	collect_free(&ref);
+	free(mem);
+	free(text);
+}
+
+/** @brief Every flat image entry point makes the image ihpa_populate does. */
+static void check_populate(void)
+{
+	size_t len;
+	char* text = hex_text(layout, COUNT(layout), 32, &len);
+	uint8_t* ref = alloc(SPAN);
+	block_image(ref, NULL, 0xA5, layout, COUNT(layout));
+
+	uint8_t* img = alloc(SPAN);
+	assert(IHP_ERR_OK == ihpa_populate(SPAN, img, 0xA5, text_file(text, len)));
+	assert(!memcmp(img, ref, SPAN));
+
+	memset(img, 0, SPAN);
+	assert(IHP_ERR_OK == ihpa_populate(SPAN, img, 0xA5, text_stream(text, len)));
+	assert(!memcmp(img, ref, SPAN));
+
+	for(unsigned threads = 1; threads <= 3; ++threads){
+		memset(img, 0, SPAN);
+		assert(IHP_ERR_OK == ihpa_populate_mt(SPAN, img, 0xA5, text_file(text, len), threads));
+		assert(!memcmp(img, ref, SPAN));
+	}
+
+	/* Input long enough to be split, as given and with the records run
+	 * together, which cannot be split safely. */
+	static const struct block big[] = {{0x0000, 0x18000, 5}};
+	size_t big_len;
+	char* big_text = hex_text(big, COUNT(big), 1, &big_len);
+	char* joined = alloc(big_len);
+	size_t joined_len = 0;
+	for(size_t i = 0; i < big_len; ++i){
+		if('\r' != big_text[i] && '\n' != big_text[i])
+			joined[joined_len++] = big_text[i];
+	}
+	block_image(ref, NULL, 0xA5, big, COUNT(big));
+	for(unsigned threads = 2; threads <= 3; ++threads){
+		memset(img, 0, SPAN);
+		assert(IHP_ERR_OK == ihpa_populate_mt(SPAN, img, 0xA5, text_file(big_text, big_len), threads));
+		assert(!memcmp(img, ref, SPAN));
+
+		memset(img, 0, SPAN);
+		assert(IHP_ERR_OK == ihpa_populate_mt(SPAN, img, 0xA5, text_file(joined, joined_len), threads));
+		assert(!memcmp(img, ref, SPAN));
+	}
+
+	/* A ':' inside a record where two threads cut the input fails as a
+	 * serial parse does. */
+	size_t at = big_len / 2;
+	while(!isxdigit(big_text[at - 1]) || !isxdigit(big_text[at]))
+		assert(':' != big_text[at++]);
+	big_text[at] = ':';
+	unsigned err = ihpa_populate(SPAN, img, 0xA5, text_file(big_text, big_len));
+	assert(IHP_ERR_OK != err);
+	assert(err == ihpa_populate_mt(SPAN, img, 0xA5, text_file(big_text, big_len), 2));
+	free(joined);
+	free(big_text);
+
+	/* Data past the image. */
+	assert(IHP_ERR_USER_ABORT == ihpa_populate(0x12345, img, 0xA5, text_file(text, len)));
+
+	free(img);
+	free(ref);
+	free(text);
+}
+
+/** @brief Sparse images hold the blocks, merged where they meet. */
+static void check_sparse(void)
+{
+	static const struct block blocks[] = {
+		{0x0000, 300, 1}
+		,{0x1003, 50, 2}
+		,{0xFFE0, 0x40, 3}
+		,{0x12345, 100, 4}
+		,{0x1020, 40, 5}
+		,{0x0100, 4, 6}
+		,{0x012C, 4, 7}
+	};
+	size_t len;
+	char* text = hex_text(blocks, COUNT(blocks), 16, &len);
+	uint8_t* ref = alloc(SPAN);
+	block_image(ref, NULL, 0, blocks, COUNT(blocks));
+
+	struct ihpa_sparse img;
+	ihpa_sparse_init(&img);
+	assert(IHP_ERR_OK == ihpa_sparse_populate(&img, text_file(text, len)));
+	assert(4 == img.count);
+	for(size_t i = 1; i < img.count; ++i)
+		assert((uint64_t)img.extents[i - 1].start + img.extents[i - 1].length < img.extents[i].start);
+	assert(0 == img.extents[0].start && 304 == img.extents[0].length);
+	assert(0x1003 == img.extents[1].start && 0x45 == img.extents[1].length);
+
+	uint8_t* flat = alloc(SPAN);
+	assert(304 + 0x45 + 0x40 + 100 == ihpa_sparse_flatten(&img, 0, SPAN, flat, 0));
+	assert(!memcmp(flat, ref, SPAN));
+
+	assert(img.extents + 1 == ihpa_sparse_find(&img, 0x1047));
+	assert(!ihpa_sparse_find(&img, 0x1048) && !ihpa_sparse_find(&img, 0x0FFF));
+
+	uint8_t buf[8];
+	assert(5 == ihpa_sparse_read(&img, 0x1043, buf, sizeof(buf), 0x11));
+	assert(!memcmp(buf, ref + 0x1043, 5) && 0x11 == buf[5] && 0x11 == buf[7]);
+
+	/* Iterating passes each extent whole, in order; and can be aborted. */
+	struct collect c;
+	collect_init(&c, 0);
+	struct ihp_ctx ctx = {.cb = collect_cb, .user_data = &c};
+	assert(ihpa_sparse_iterate(&img, &ctx));
+	assert(img.count == c.count && !memcmp(c.img, ref, SPAN));
+	for(size_t i = 0; i < img.count; ++i)
+		assert(img.extents[i].start == c.pieces[i].address && img.extents[i].length == c.pieces[i].len);
+	c.stop = c.count + 1;
+	assert(!ihpa_sparse_iterate(&img, &ctx));
+	collect_free(&c);
+
+	/* Blocks that touch or overlap are joined, the newest data winning. */
+	ihpa_sparse_free(&img);
+	assert(!img.count);
+	assert(ihpa_sparse_add(&img, 20, ref, 10) && ihpa_sparse_add(&img, 10, ref + 100, 10));
+	assert(ihpa_sparse_add(&img, 15, ref + 200, 10));
+	assert(1 == img.count && 10 == img.extents[0].start && 20 == img.extents[0].length);
+	assert(!memcmp(img.extents[0].data + 5, ref + 200, 10));
+	ihpa_sparse_free(&img);
+
+	char* bad = hex_corrupt(text, len, 2);
+	assert(IHP_ERR_CHECKSUM == ihpa_sparse_populate(&img, text_file(bad, len)));
+	ihpa_sparse_free(&img);
+	free(bad);
+
+	free(flat);
+	free(ref);
+	free(text);
+}
+
+/** @brief Ranges over layout, one of them relative. */
+static void range_init(struct ihpa_range* ranges, struct collect* c)
+{
+	const struct ihpa_range init[] = {
+		{.start = 0x0000, .length = 0x100}
+		,{.start = 0x0100, .length = 0x1000, .relative = true}
+		,{.start = 0xFFF0, .length = 0x2400}
+	};
+	for(unsigned i = 0; i < COUNT(init); ++i){
+		collect_init(c + i, 0xFF);
+		ranges[i] = init[i];
+		ranges[i].ctx = (struct ihp_ctx){.cb = collect_cb, .user_data = c + i};
+	}
+}
+
+static void range_free(struct collect* c)
+{
+	for(unsigned i = 0; i < 3; ++i)
+		collect_free(c + i);
+}
+
+/** @brief Assert that each range got exactly its part of the blocks. */
+static void range_blocks(const struct ihpa_range* ranges, const struct collect* c,
+	const struct block* blocks, unsigned count)
+{
+	uint8_t* ref = alloc(SPAN);
+	bool* mask = alloc(SPAN * sizeof(bool));
+	block_image(ref, mask, 0xFF, blocks, count);
+	for(unsigned i = 0; i < 3; ++i){
+		uint32_t offset = ranges[i].relative ? ranges[i].start : 0;
+		for(uint32_t a = 0; a < SPAN; ++a){
+			bool in = a >= ranges[i].start && a - ranges[i].start < ranges[i].length;
+			assert(in ? mask[a] == c[i].mask[a - offset] : offset || !c[i].mask[a]);
+			assert(!in || !mask[a] || ref[a] == c[i].img[a - offset]);
+		}
+
+		/* Range callbacks only ever get data. */
+		assert(!c[i].ends);
+	}
+	free(ref);
+	free(mask);
+}
+
+/** @brief Each range gets exactly its part of the data, and the run
+ *  stops when one of them aborts. */
+static void check_range(void)
+{
+	const size_t max = 24;
+	size_t len;
+	char* text = hex_text(layout, COUNT(layout), 16, &len);
+
+	struct ihpa_range ranges[3];
+	struct collect c[3];
+	range_init(ranges, c);
+	assert(IHP_ERR_OK == ihpa_range_run(ranges, 3, max, text_file(text, len)));
+	for(unsigned i = 0; i < 3; ++i){
+		for(unsigned p = 0; p < c[i].count; ++p)
+			assert(c[i].pieces[p].len <= max);
+	}
+	range_blocks(ranges, c, layout, COUNT(layout));
+	range_free(c);
+
+	/* Aborting. */
+	range_init(ranges, c);
+	c[2].stop = 1;
+	assert(IHP_ERR_USER_ABORT == ihpa_range_run(ranges, 3, max, text_file(text, len)));
+	assert(1 == c[2].count);
+	range_free(c);
+
+	/* Ranges out of order or overlapping. */
+	range_init(ranges, c);
+	ranges[1].start = 0x80;
+	assert(COUNT_IHP_ERR == ihpa_range_run(ranges, 3, max, text_file(text, len)));
+	range_free(c);
+
+	free(text);
+}
+
+/** @brief Written records parse back to the data, in either address mode
+ *  and at any record length, and parsed data written again is the same
+ *  text. */
+static void check_emit(void)
+{
+	uint8_t* mem = alloc(ihp_emit_size(4096));
+	uint8_t* ctx_mem = alloc(ihp_size(255));
+	static const unsigned record_lens[] = {1, 16, 255};
+	for(unsigned mode = IHP_EMIT_LINEAR; mode <= IHP_EMIT_SEGMENT; ++mode){
+		for(unsigned r = 0; r < COUNT(record_lens); ++r){
+			char* text;
+			size_t len;
+			FILE* f = open_memstream(&text, &len);
+			struct ihp_emit* e = f ? ihp_emit_file(mem, 4096, f, record_lens[r], mode) : NULL;
+			assert(e);
+			for(unsigned b = 0; b < COUNT(layout); ++b){
+				uint8_t data[300];
+				assert(layout[b].len <= sizeof(data));
+				for(size_t i = 0; i < layout[b].len; ++i)
+					data[i] = block_byte(layout + b, i);
+				assert(ihp_emit_data(e, layout[b].address, data, layout[b].len));
+			}
+			assert(ihp_emit_start(e, 0x12345678));
+			assert(ihp_emit_finish(e));
+			fclose(f);
+
+			struct collect c;
+			collect_init(&c, 0xFF);
+			assert(IHP_ERR_OK == collect_run(ihp_mem(ctx_mem, 255, text, len), &c));
+			ihp_destroy((struct ihp_ctx*)ctx_mem);
+			collect_blocks(&c, 0xFF, layout, COUNT(layout));
+			collect_free(&c);
+			for(const char* at = text; (at = strchr(at, ':')); ++at){
+				unsigned record_len, type;
+				assert(2 == sscanf(at + 1, "%2x%*4x%2x", &record_len, &type));
+				assert(type || record_len <= record_lens[r]);
+			}
+
+			/* Parsed straight into a writer, in pieces that end where
+			 * records do, as the writer does not join pieces. */
+			char* again;
+			size_t again_len;
+			f = open_memstream(&again, &again_len);
+			e = f ? ihp_emit_file(mem, 4096, f, record_lens[r], mode) : NULL;
+			assert(e);
+			struct ihp_ctx* ic = ihp_mem(ctx_mem, 255 / record_lens[r] * record_lens[r], text, len);
+			ic->cb = ihp_emit_cb;
+			ic->user_data = e;
+			assert(IHP_ERR_OK == ihp_run(ic));
+			ihp_destroy(ic);
+			assert(ihp_emit_finish(e));
+			fclose(f);
+
+			/* All but the start record. */
+			char* start = strstr(text, 0 == mode ? ":04000005" : ":04000003");
+			assert(start);
+			assert(again_len == len - (strchr(start + 1, ':') - start));
+			assert(!memcmp(again, text, start - text));
+			free(again);
+			free(text);
+		}
+	}
+
+	/* Invalid arguments, and addresses past the first 1M in segment mode. */
+	assert(!ihp_emit_file(mem, 4096, stdout, 0, IHP_EMIT_LINEAR));
+	assert(!ihp_emit_file(mem, 4096, stdout, 256, IHP_EMIT_LINEAR));
+	assert(!ihp_emit_file(mem, 4096, stdout, 16, IHP_EMIT_SEGMENT + 1));
+	FILE* f = fopen("/dev/null", "w");
+	struct ihp_emit* e = f ? ihp_emit_file(mem, 4096, f, 16, IHP_EMIT_SEGMENT) : NULL;
+	assert(e);
+	const uint8_t byte = 0;
+	assert(!ihp_emit_data(e, 0x100000, &byte, 1));
+	fclose(f);
+
+	free(ctx_mem);
+	free(mem);
+}
+
+/** @brief ihp_validate counts without calling back, up to any error. */
+static void check_validate(void)
+{
+	size_t len;
+	char* text = hex_text(layout, COUNT(layout), 16, &len);
+	uint8_t* mem = alloc(ihp_size(16));
+
+	struct collect c;
+	collect_init(&c, 0xFF);
+	struct ihp_summary sum;
+	struct ihp_ctx* ic = ihp_mem(mem, 16, text, len);
+	ic->cb = collect_cb;
+	ic->user_data = &c;
+	assert(IHP_ERR_OK == ihp_validate(ic, &sum));
+	ihp_destroy(ic);
+	assert(!c.count && !c.ends);
+	collect_free(&c);
+
+	size_t bytes = 0;
+	for(unsigned b = 0; b < COUNT(layout); ++b)
+		bytes += layout[b].len;
+	assert(hex_records(text) == sum.records && bytes == sum.bytes);
+	assert(0 == sum.min_address && 0x12345 + 100 == sum.end_address);
+
+	/* The same through a mapped stream. */
+	struct ihp_summary file_sum;
+	ic = ihp_file(mem, 16, text_file(text, len));
+	assert(IHP_ERR_OK == ihp_validate(ic, &file_sum));
+	ihp_destroy(ic);
+	assert(sum.records == file_sum.records && sum.bytes == file_sum.bytes);
+	assert(sum.min_address == file_sum.min_address && sum.end_address == file_sum.end_address);
+
+	/* Empty data records, wherever they are, bound nothing. */
+	static const char empty[] = ":00FFF00011\r\n:0100100042AD\r\n:00FFFF0002\r\n:00000001FF\r\n";
+	assert(IHP_ERR_OK == ihp_validate(ihp_mem(mem, 16, empty, sizeof(empty) - 1), &sum));
+	ihp_destroy((struct ihp_ctx*)mem);
+	assert(4 == sum.records && 1 == sum.bytes);
+	assert(0x10 == sum.min_address && 0x11 == sum.end_address);
+
+	/* Records before an error are summarized. */
+	char* bad = hex_corrupt(text, len, 5);
+	assert(IHP_ERR_CHECKSUM == ihp_validate(ihp_mem(mem, 16, bad, len), &sum));
+	ihp_destroy((struct ihp_ctx*)mem);
+	assert(5 == sum.records && 4 * 16 == sum.bytes);
+	free(bad);
+
+	free(mem);
+	free(text);
+}
+
+/** @brief Two inputs that disagree on some runs of bytes: the second has
+ *  the blocks of the first, overwritten in places, and data of its own. */
+static const struct block merge_first[] = {
+	{0x0000, 0x200, 1}
+	,{0x1000, 0x40, 2}
+};
+
+static const struct block merge_second[] = {
+	{0x0000, 0x200, 1}
+	,{0x1000, 0x40, 2}
+	,{0x0064, 2, 9}
+	,{0x0150, 3, 9}
+	,{0x103F, 1, 9}
+	,{0x0300, 0x10, 3}
+};
+
+/** @brief Runs where both a and b have data that differs. */
+static size_t merge_runs(const uint8_t* a, const bool* a_mask, const uint8_t* b, const bool* b_mask,
+	struct ihpa_overlap* runs, size_t max)
+{
+	size_t count = 0;
+	for(uint32_t i = 0; i < SPAN; ++i){
+		if(!a_mask[i] || !b_mask[i] || a[i] == b[i])
+			continue;
+		if(count && runs[count - 1].start + runs[count - 1].length == i){
+			++runs[count - 1].length;
+			continue;
+		}
+		assert(count < max);
+		runs[count++] = (struct ihpa_overlap){.start = i, .length = 1, .first = 0, .second = 1};
+	}
+	return count;
+}
+
+static bool overlaps_same(const struct ihpa_overlap* a, const struct ihpa_overlap* b, size_t count)
+{
+	for(size_t i = 0; i < count; ++i){
+		if(a[i].start != b[i].start || a[i].length != b[i].length
+			|| a[i].first != b[i].first || a[i].second != b[i].second)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/** @brief Merges report each differing run and resolve it by policy. */
+static void check_merge(void)
+{
+	size_t first_len, second_len;
+	char* first = hex_text(merge_first, COUNT(merge_first), 16, &first_len);
+	char* second = hex_text(merge_second, COUNT(merge_second), 16, &second_len);
+
+	uint8_t* a = alloc(SPAN);
+	uint8_t* b = alloc(SPAN);
+	bool* a_mask = alloc(SPAN * sizeof(bool));
+	bool* b_mask = alloc(SPAN * sizeof(bool));
+	block_image(a, a_mask, 0xFF, merge_first, COUNT(merge_first));
+	block_image(b, b_mask, 0xFF, merge_second, COUNT(merge_second));
+
+	struct ihpa_overlap runs[16];
+	size_t run_count = merge_runs(a, a_mask, b, b_mask, runs, COUNT(runs));
+	assert(run_count >= 3);
+
+	/* Flat images, by policy. */
+	uint8_t* img = alloc(SPAN);
+	for(unsigned policy = IHPA_MERGE_ERROR; policy <= IHPA_MERGE_LAST_WINS; ++policy){
+		struct ihpa_overlap overlaps[16];
+		struct ihpa_merge m = {.policy = policy, .overlaps = overlaps, .overlap_max = COUNT(overlaps)};
+		FILE* inputs[] = {text_file(first, first_len), text_stream(second, second_len)};
+		unsigned err = ihpa_merge_populate(SPAN, img, 0xFF, inputs, 2, &m);
+		assert(run_count == m.overlap_count && 2 == m.failed);
+		assert(overlaps_same(overlaps, runs, run_count));
+		if(IHPA_MERGE_ERROR == policy){
+			assert(IHPA_ERR_OVERLAP == err);
+			continue;
+		}
+		assert(IHP_ERR_OK == err);
+		for(uint32_t i = 0; i < SPAN; ++i){
+			bool a_wins = a_mask[i] && (!b_mask[i] || IHPA_MERGE_FIRST_WINS == policy);
+			assert(img[i] == (a_wins ? a[i] : b[i]));
+		}
+	}
+
+	/* Sparse, keeping fewer conflicts than there are. */
+	struct ihpa_overlap overlap;
+	struct ihpa_merge m = {.policy = IHPA_MERGE_LAST_WINS, .overlaps = &overlap, .overlap_max = 1};
+	FILE* inputs[] = {text_file(first, first_len), text_file(second, second_len)};
+	struct ihpa_sparse sparse;
+	ihpa_sparse_init(&sparse);
+	assert(IHP_ERR_OK == ihpa_merge_sparse(&sparse, inputs, 2, &m));
+	assert(run_count == m.overlap_count && overlaps_same(&overlap, runs, 1));
+	ihpa_sparse_flatten(&sparse, 0, SPAN, img, 0xFF);
+	for(uint32_t i = 0; i < SPAN; ++i)
+		assert(img[i] == (b_mask[i] ? b[i] : a[i]));
+	ihpa_sparse_free(&sparse);
+
+	/* An input failing to parse. */
+	char* bad = hex_corrupt(second, second_len, 4);
+	inputs[0] = text_file(first, first_len);
+	inputs[1] = text_file(bad, second_len);
+	m = (struct ihpa_merge){.policy = IHPA_MERGE_LAST_WINS};
+	assert(IHP_ERR_CHECKSUM == ihpa_merge_populate(SPAN, img, 0xFF, inputs, 2, &m));
+	assert(1 == m.failed);
+	free(bad);
+
+	free(img);
+	free(a);
+	free(b);
+	free(a_mask);
+	free(b_mask);
+	free(first);
+	free(second);
+}
+
+/** @brief Diffs pass what changed, exactly or as whole pages. */
+static void check_diff(void)
+{
+	size_t old_len, new_len;
+	char* old_text = hex_text(merge_first, COUNT(merge_first), 16, &old_len);
+	char* new_text = hex_text(merge_second, COUNT(merge_second), 16, &new_len);
+
+	uint8_t* old_img = alloc(SPAN);
+	uint8_t* new_img = alloc(SPAN);
+	bool* new_mask = alloc(SPAN * sizeof(bool));
+	block_image(old_img, NULL, 0xFF, merge_first, COUNT(merge_first));
+	block_image(new_img, new_mask, 0xFF, merge_second, COUNT(merge_second));
+
+	/* Exact: the new bytes that differ from the old, or from pad. Against
+	 * a readback of the old image the result is the same. */
+	for(unsigned binary = 0; binary < 2; ++binary){
+		struct collect c;
+		collect_init(&c, 0xFF);
+		struct ihp_ctx ctx = {.cb = collect_cb, .user_data = &c};
+		FILE* new_input = text_file(new_text, new_len);
+		unsigned err = binary
+			? ihpa_diff_binary(old_img, 0x2000, 0, new_input, 0, 0xFF, &ctx)
+			: ihpa_diff(text_file(old_text, old_len), new_input, 0, 0xFF, &ctx);
+		assert(IHP_ERR_OK == err && 1 == c.ends && IHP_ERR_OK == c.err);
+		for(uint32_t i = 0; i < SPAN; ++i){
+			assert(c.mask[i] == (new_mask[i] && new_img[i] != old_img[i]));
+			assert(!c.mask[i] || c.img[i] == new_img[i]);
+		}
+		collect_free(&c);
+	}
+
+	/* Pages: every page holding a change, whole, new data over old. */
+	const size_t page = 64;
+	struct collect c;
+	collect_init(&c, 0xFF);
+	struct ihp_ctx ctx = {.cb = collect_cb, .user_data = &c};
+	assert(IHP_ERR_OK == ihpa_diff(text_file(old_text, old_len), text_file(new_text, new_len),
+		page, 0xFF, &ctx));
+	for(unsigned i = 0; i < c.count; ++i)
+		assert(!(c.pieces[i].address % page) && page == c.pieces[i].len);
+	for(uint32_t p = 0; p < SPAN; p += page){
+		bool changed = false;
+		for(uint32_t i = p; i < p + page; ++i)
+			changed |= new_mask[i] && new_img[i] != old_img[i];
+		assert(c.mask[p] == changed);
+		for(uint32_t i = p; changed && i < p + page; ++i)
+			assert(c.img[i] == (new_mask[i] ? new_img[i] : old_img[i]));
+	}
+	collect_free(&c);
+
+	/* Aborting, and an input failing to parse. */
+	collect_init(&c, 0xFF);
+	c.stop = 1;
+	assert(IHP_ERR_USER_ABORT == ihpa_diff(text_file(old_text, old_len),
+		text_file(new_text, new_len), 0, 0xFF, &ctx));
+	assert(1 == c.count);
+	collect_free(&c);
+
+	char* bad = hex_corrupt(old_text, old_len, 1);
+	collect_init(&c, 0xFF);
+	assert(IHP_ERR_CHECKSUM == ihpa_diff(text_file(bad, old_len),
+		text_file(new_text, new_len), 0, 0xFF, &ctx));
+	assert(IHP_ERR_CHECKSUM == c.err);
+	collect_free(&c);
+	free(bad);
+
+	free(old_img);
+	free(new_img);
+	free(new_mask);
+	free(old_text);
+	free(new_text);
+}
+
+/** @brief Out of order input for the stages: blocks reversed, split and
+ *  overlapping, with a page of nothing but fill. */
+static const struct block scrambled[] = {
+	{0x12345, 100, 4}
+	,{0x0080, 0x40, 7}
+	,{0x0000, 0x40, 5}
+	,{0x2000, 0x40, 0}
+	,{0x1003, 50, 2}
+	,{0x0040, 0x40, 6}
+	,{0x0010, 8, 8}
+};
+
+/** @brief The page stage passes whole aligned pages that are not all fill. */
+static void check_pages(void)
+{
+	const size_t page = 64;
+	size_t len;
+	char* text = hex_text(scrambled, COUNT(scrambled), 16, &len);
+	uint8_t* ref = alloc(SPAN);
+	block_image(ref, NULL, 0xFF, scrambled, COUNT(scrambled));
+
+	/* Run directly, and installed as the callback of a parser. */
+	for(unsigned direct = 0; direct < 2; ++direct){
+		struct collect c;
+		collect_init(&c, 0xFF);
+		struct ihp_ctx out = {.cb = collect_cb, .user_data = &c};
+		if(direct){
+			assert(IHP_ERR_OK == ihpa_pages_run(page, 16, 0xFF, &out, text_file(text, len)));
+		}
+		else{
+			uint8_t* mem = alloc(ihpa_pages_size(page, 16));
+			uint8_t* parser = alloc(ihp_size(16));
+			struct ihp_ctx* ic = ihp_mem(parser, 16, text, len);
+			ic->cb = ihpa_pages_cb;
+			ic->user_data = ihpa_pages_init(mem, page, 16, 0xFF, &out);
+			assert(ic->user_data);
+			assert(IHP_ERR_OK == ihp_run(ic));
+			ihp_destroy(ic);
+			free(parser);
+			free(mem);
+		}
+		assert(1 == c.ends && IHP_ERR_OK == c.err);
+
+		for(unsigned i = 0; i < c.count; ++i){
+			assert(!(c.pieces[i].address % page) && page == c.pieces[i].len);
+			for(unsigned j = 0; j < i; ++j)
+				assert(c.pieces[i].address != c.pieces[j].address);
+		}
+		for(uint32_t p = 0; p < SPAN; p += page){
+			bool data = false;
+			for(uint32_t i = p; i < p + page; ++i)
+				data |= 0xFF != ref[i];
+			assert(c.mask[p] == data);
+		}
+		assert(!c.mask[0x2000] && !memcmp(c.img, ref, SPAN));
+		collect_free(&c);
+	}
+
+	uint8_t* mem = alloc(ihpa_pages_size(page, 1));
+	struct ihp_ctx out = {.cb = collect_cb};
+	assert(!ihpa_pages_init(mem, 0, 1, 0xFF, &out) && !ihpa_pages_init(mem, page, 0, 0xFF, &out));
+	free(mem);
+
+	/* Aborting, also when passing on the pages held at the end. */
+	for(unsigned stop = 1; stop <= 3; ++stop){
+		struct collect c;
+		collect_init(&c, 0xFF);
+		c.stop = stop;
+		out.user_data = &c;
+		assert(IHP_ERR_USER_ABORT == ihpa_pages_run(page, 8, 0xFF, &out, text_file(text, len)));
+		assert(stop == c.count);
+		collect_free(&c);
+	}
+
+	free(ref);
+	free(text);
+}
+
+/** @brief The cache is used while the source is unchanged, however it was
+ *  touched, and rebuilt when it changes. */
+static void check_cache(void)
+{
+	static const struct block changed[] = {
+		{0x0000, 300, 11}
+		,{0x1003, 50, 12}
+		,{0xFFE0, 0x40, 13}
+		,{0x12345, 100, 14}
+	};
+	size_t len, changed_len;
+	char* text = hex_text(layout, COUNT(layout), 16, &len);
+	char* changed_text = hex_text(changed, COUNT(changed), 16, &changed_len);
+	assert(len == changed_len);
+	const char* hex_path = temp_write("cached.hex", text, len);
+	const char* cache_path = temp_path("cached.cache");
+
+	uint8_t* ref = alloc(SPAN);
+	uint8_t* img = alloc(SPAN);
+	block_image(ref, NULL, 0xFF, layout, COUNT(layout));
+
+	/* Miss, then hit. */
+	struct ihpa_cache c;
+	for(unsigned i = 0; i < 2; ++i){
+		assert(IHP_ERR_OK == ihpa_cache_open(&c, hex_path, cache_path));
+		assert(c.map && !access(cache_path, R_OK));
+		ihpa_sparse_flatten(&c.img, 0, SPAN, img, 0xFF);
+		assert(!memcmp(img, ref, SPAN));
+		ihpa_cache_close(&c);
+	}
+
+	/* Touched: still a hit, and the new time is recorded in a new file,
+	 * leaving the one already open as it was. */
+	struct stat st;
+	assert(!stat(cache_path, &st));
+	uint8_t* before = alloc(st.st_size);
+	uint8_t* after = alloc(st.st_size);
+	FILE* old = fopen(cache_path, "r");
+	assert(old && (size_t)st.st_size == fread(before, 1, st.st_size, old));
+
+	struct timespec times[2] = {{1000, 0}, {1000, 0}};
+	assert(!utimensat(AT_FDCWD, hex_path, times, 0));
+	assert(IHP_ERR_OK == ihpa_cache_open(&c, hex_path, cache_path));
+	assert(c.map);
+	ihpa_cache_close(&c);
+
+	FILE* f = fopen(cache_path, "r");
+	assert(f && (size_t)st.st_size == fread(after, 1, st.st_size, f));
+	fclose(f);
+	assert(memcmp(before, after, st.st_size));
+	assert(st.st_size == pread(fileno(old), after, st.st_size, 0));
+	assert(!memcmp(before, after, st.st_size));
+	fclose(old);
+	free(before);
+	free(after);
+
+	/* Changed with the same size. */
+	temp_write("cached.hex", changed_text, changed_len);
+	block_image(ref, NULL, 0xFF, changed, COUNT(changed));
+	assert(IHP_ERR_OK == ihpa_cache_open(&c, hex_path, cache_path));
+	ihpa_sparse_flatten(&c.img, 0, SPAN, img, 0xFF);
+	assert(!memcmp(img, ref, SPAN));
+	ihpa_cache_close(&c);
+
+	/* A cache that cannot be written serves the image from memory. */
+	assert(IHP_ERR_OK == ihpa_cache_open(&c, hex_path, temp_path("none/cached.cache")));
+	assert(!c.map);
+	ihpa_sparse_flatten(&c.img, 0, SPAN, img, 0xFF);
+	assert(!memcmp(img, ref, SPAN));
+	ihpa_cache_close(&c);
+
+	/* Errors. */
+	assert(COUNT_IHP_ERR == ihpa_cache_open(&c, temp_path("missing.hex"), cache_path));
+	char* bad = hex_corrupt(text, len, 3);
+	temp_write("cached.hex", bad, len);
+	assert(IHP_ERR_CHECKSUM == ihpa_cache_open(&c, hex_path, cache_path));
+	assert(!c.map && !c.img.count);
+	free(bad);
+
+	free(ref);
+	free(img);
+	free(text);
+	free(changed_text);
+}
+
+/** @brief Files that make up a batch or a set of jobs: good ones,
+ *  a bad one and a missing one. */
+struct file_set {
+	const char* paths[6];
+	struct block blocks[6][COUNT(layout)];
+	unsigned err[6];
+};
+
+static void file_set_init(struct file_set* s, const char* prefix)
+{
+	for(unsigned i = 0; i < COUNT(s->paths); ++i){
+		char name[32];
+		snprintf(name, sizeof(name), "%s%u.hex", prefix, i);
+		memcpy(s->blocks[i], layout, sizeof(layout));
+		for(unsigned b = 0; b < COUNT(layout); ++b)
+			s->blocks[i][b].seed += 10 * i;
+
+		size_t len;
+		char* text = hex_text(s->blocks[i], COUNT(layout), 16, &len);
+		s->err[i] = IHP_ERR_OK;
+		if(3 == i){
+			char* bad = hex_corrupt(text, len, 7);
+			s->paths[i] = temp_write(name, bad, len);
+			s->err[i] = IHP_ERR_CHECKSUM;
+			free(bad);
+		}
+		else if(5 == i){
+			s->paths[i] = temp_path(name);
+			s->err[i] = COUNT_IHP_ERR;
+		}
+		else{
+			s->paths[i] = temp_write(name, text, len);
+		}
+		free(text);
+	}
+}
+
+/** @brief Batches report per file and keep the calls of a file in order. */
+static void check_batch(void)
+{
+	const size_t max = 32;
+	struct file_set s;
+	file_set_init(&s, "batch");
+
+	for(unsigned threads = 1; threads <= 3; threads += 2){
+		struct ihpa_batch_job jobs[COUNT(s.paths)];
+		struct collect c[COUNT(s.paths)];
+		for(unsigned i = 0; i < COUNT(jobs); ++i){
+			collect_init(c + i, 0xFF);
+			jobs[i] = (struct ihpa_batch_job){
+				.path = s.paths[i]
+				,.ctx = {.cb = collect_cb, .user_data = c + i}
+			};
+		}
+		assert(2 == ihpa_batch_run(jobs, COUNT(jobs), max, threads, 2));
+
+		uint8_t* mem = alloc(ihp_size(max));
+		for(unsigned i = 0; i < COUNT(jobs); ++i){
+			assert(s.err[i] == jobs[i].err);
+			if(COUNT_IHP_ERR == s.err[i])
+				continue;
+
+			struct collect serial;
+			collect_init(&serial, 0xFF);
+			FILE* f = fopen(s.paths[i], "r");
+			assert(s.err[i] == collect_run(ihp_file(mem, max, f), &serial));
+			ihp_destroy((struct ihp_ctx*)mem);
+			collect_same(c + i, &serial);
+			collect_free(&serial);
+		}
+		free(mem);
+
+		for(unsigned i = 0; i < COUNT(jobs); ++i)
+			collect_free(c + i);
+	}
+}
+
+/** @brief Jobs report per job, on any number of workers. */
+static void check_jobs(void)
+{
+	struct file_set s;
+	file_set_init(&s, "jobs");
+
+	uint8_t* ref = alloc(SPAN);
+	for(unsigned threads = 1; threads <= 3; ++threads){
+		struct ihpa_job jobs[COUNT(s.paths) + 1];
+		uint8_t* imgs[COUNT(s.paths)];
+		for(unsigned i = 0; i < COUNT(s.paths); ++i){
+			imgs[i] = alloc(SPAN);
+			jobs[i] = (struct ihpa_job){
+				.type = IHPA_JOB_POPULATE
+				,.path = s.paths[i]
+				,.img_len = SPAN
+				,.img_mem = imgs[i]
+				,.pad = 0xFF
+			};
+		}
+
+		struct ihpa_range ranges[3];
+		struct collect c[3];
+		range_init(ranges, c);
+		jobs[COUNT(s.paths)] = (struct ihpa_job){
+			.type = IHPA_JOB_RANGE
+			,.path = s.paths[0]
+			,.ranges = ranges
+			,.range_count = 3
+			,.max = 32
+		};
+
+		unsigned status[COUNT(jobs)];
+		assert(2 == ihpa_jobs_run(jobs, COUNT(jobs), status, threads));
+		for(unsigned i = 0; i < COUNT(s.paths); ++i){
+			assert(s.err[i] == status[i]);
+			block_image(ref, NULL, 0xFF, s.blocks[i], COUNT(layout));
+			assert(s.err[i] || !memcmp(imgs[i], ref, SPAN));
+			free(imgs[i]);
+		}
+
+		assert(IHP_ERR_OK == status[COUNT(s.paths)]);
+		range_blocks(ranges, c, s.blocks[0], COUNT(layout));
+		range_free(c);
+	}
+	free(ref);
+}
+
+/** @brief Contexts and scratch memory reused from input to input make the
+ *  calls fresh ones do, and leave the inputs open. */
+static void check_reuse(void)
+{
+	const size_t max = 24;
+	size_t len;
+	char* text = hex_text(layout, COUNT(layout), 16, &len);
+	uint8_t* mem = alloc(ihp_size(max));
+
+	struct collect ref;
+	collect_init(&ref, 0xFF);
+	assert(IHP_ERR_OK == collect_run(ihp_mem(mem, max, text, len), &ref));
+	ihp_destroy((struct ihp_ctx*)mem);
+
+	/* One context, after an error, for memory, a mapped and a streamed FILE. */
+	struct collect c;
+	collect_init(&c, 0xFF);
+	char* bad = hex_corrupt(text, len, 2);
+	struct ihp_ctx* ic = ihp_file(mem, max, NULL);
+	ihp_reset_mem(ic, bad, len);
+	assert(IHP_ERR_CHECKSUM == collect_run(ic, &c));
+	collect_free(&c);
+	free(bad);
+	for(unsigned s = 0; s < 3; ++s){
+		collect_init(&c, 0xFF);
+		FILE* f = NULL;
+		if(0 == s)
+			ihp_reset_mem(ic, text, len);
+		else
+			ihp_reset(ic, f = 1 == s ? text_file(text, len) : text_stream(text, len));
+		assert(IHP_ERR_OK == collect_run(ic, &c));
+		collect_same(&c, &ref);
+		collect_free(&c);
+
+		/* A mapped stream is left at its end; none is closed. */
+		if(1 == s)
+			assert(ftello(f) == (off_t)len);
+		if(f)
+			fclose(f);
+	}
+	ihp_destroy(ic);
+
+	/* Reset after destroy, and twice in a row, of a context that owns a
+	 * mapped FILE. */
+	for(unsigned s = 0; s < 2; ++s){
+		ic = ihp_file(mem, max, text_file(text, len));
+		collect_init(&c, 0xFF);
+		assert(IHP_ERR_OK == collect_run(ic, &c));
+		collect_free(&c);
+		if(s)
+			ihp_reset_mem(ic, text, len);
+		else
+			ihp_destroy(ic);
+		ihp_reset_mem(ic, text, len);
+		collect_init(&c, 0xFF);
+		assert(IHP_ERR_OK == collect_run(ic, &c));
+		ihp_destroy(ic);
+		collect_same(&c, &ref);
+		collect_free(&c);
+	}
+	collect_free(&ref);
+	free(mem);
+
+	/* One scratch area for several images, which stay open. */
+	uint8_t* img = alloc(SPAN);
+	uint8_t* img_ref = alloc(SPAN);
+	block_image(img_ref, NULL, 0xA5, layout, COUNT(layout));
+	uint8_t* scratch = alloc(ihpa_scratch_size(max));
+	for(unsigned i = 0; i < 2; ++i){
+		FILE* f = i ? text_stream(text, len) : text_file(text, len);
+		memset(img, 0, SPAN);
+		assert(IHP_ERR_OK == ihpa_populate_with(SPAN, img, 0xA5, f, scratch));
+		assert(!memcmp(img, img_ref, SPAN));
+		fclose(f);
+	}
+	free(img_ref);
+	free(img);
+
+	/* And for range runs. */
+	struct ihpa_range ranges[3];
+	struct collect rc[3];
+	range_init(ranges, rc);
+	assert(IHP_ERR_OK == ihpa_range_run(ranges, 3, max, text_file(text, len)));
+	for(unsigned i = 0; i < 2; ++i){
+		struct ihpa_range other[3];
+		struct collect oc[3];
+		range_init(other, oc);
+		FILE* f = i ? text_stream(text, len) : text_file(text, len);
+		assert(IHP_ERR_OK == ihpa_range_run_with(other, 3, max, f, scratch));
+		fclose(f);
+		for(unsigned r = 0; r < 3; ++r)
+			collect_same(oc + r, rc + r);
+		range_free(oc);
+	}
+	range_free(rc);
+	free(scratch);
+
+	free(text);
+}
+
+/** @brief CRC-32 one bit at a time, to check the table driven one. */
+static uint32_t crc32_bitwise(const uint8_t* data, size_t len)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	for(size_t i = 0; i < len; ++i){
+		crc ^= data[i];
+		for(unsigned b = 0; b < 8; ++b)
+			crc = crc >> 1 ^ (crc & 1 ? 0xEDB88320 : 0);
+	}
+	return ~crc;
+}
+
+static void hex_bytes(uint8_t* dest, const char* hex)
+{
+	for(size_t i = 0; hex[2 * i]; ++i)
+		sscanf(hex + 2 * i, "%2hhx", dest + i);
+}
+
+/** @brief Digest of len bytes of data from address 0. */
+static void digest_flat(struct ihpa_digest* d, const void* data, size_t len)
+{
+	ihpa_digest_init(d, IHPA_DIGEST_CRC32 | IHPA_DIGEST_SHA256, 0, len, 0);
+	assert(ihpa_digest_add(d, 0, data, len));
+	ihpa_digest_final(d);
+	assert(d->valid);
+}
+
+/** @brief Digests match known vectors and a padded image, however the
+ *  data arrives. */
+static void check_digest(void)
+{
+	static const struct {
+		const char* text;
+		const char* sha256;
+	} vectors[] = {
+		{"", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"}
+		,{"abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"}
+		,{"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"
+			,"248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"}
+	};
+	struct ihpa_digest d;
+	uint8_t sha[32];
+	for(unsigned i = 0; i < COUNT(vectors); ++i){
+		digest_flat(&d, vectors[i].text, strlen(vectors[i].text));
+		hex_bytes(sha, vectors[i].sha256);
+		assert(!memcmp(d.sha256, sha, 32));
+	}
+
+	digest_flat(&d, "123456789", 9);
+	assert(0xCBF43926 == d.crc32);
+
+	/* A million 'a', all of it gap. */
+	ihpa_digest_init(&d, IHPA_DIGEST_SHA256, 0x1000, 1000000, 'a');
+	ihpa_digest_final(&d);
+	hex_bytes(sha, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+	assert(d.valid && !memcmp(d.sha256, sha, 32));
+
+	/* Data going back cannot be digested in one pass. */
+	ihpa_digest_init(&d, IHPA_DIGEST_CRC32, 0, 16, 0);
+	assert(ihpa_digest_add(&d, 8, (const uint8_t*)"abcd", 4));
+	assert(!ihpa_digest_add(&d, 4, (const uint8_t*)"abcd", 4));
+	ihpa_digest_final(&d);
+	assert(!d.valid);
+
+	/* A span of an image, with data outside it and gaps. */
+	const uint32_t start = 0x0F00;
+	const size_t span = 0x1200;
+	size_t len;
+	char* text = hex_text(layout, COUNT(layout), 16, &len);
+	uint8_t* ref = alloc(SPAN);
+	block_image(ref, NULL, 0xFF, layout, COUNT(layout));
+	struct ihpa_digest want;
+	digest_flat(&want, ref + start, span);
+	assert(crc32_bitwise(ref + start, span) == want.crc32);
+
+	ihpa_digest_init(&d, IHPA_DIGEST_CRC32 | IHPA_DIGEST_SHA256, start, span, 0xFF);
+	uint8_t* mem = alloc(ihp_size(16));
+	struct ihp_ctx* ic = ihp_mem(mem, 16, text, len);
+	ic->cb = ihpa_digest_cb;
+	ic->user_data = &d;
+	assert(IHP_ERR_OK == ihp_run(ic));
+	ihp_destroy(ic);
+	assert(d.valid && want.crc32 == d.crc32 && !memcmp(want.sha256, d.sha256, 32));
+
+	uint8_t* img = alloc(SPAN);
+	ihpa_digest_init(&d, IHPA_DIGEST_CRC32 | IHPA_DIGEST_SHA256, start, span, 0xFF);
+	assert(IHP_ERR_OK == ihpa_populate_digest(SPAN, img, 0xFF, text_file(text, len), &d));
+	assert(d.valid && want.crc32 == d.crc32 && !memcmp(want.sha256, d.sha256, 32));
+	assert(!memcmp(img, ref, SPAN));
+
+	/* Per range. */
+	struct collect c;
+	collect_init(&c, 0xFF);
+	ihpa_digest_init(&d, IHPA_DIGEST_CRC32 | IHPA_DIGEST_SHA256, start, span, 0xFF);
+	struct ihpa_range range = {
+		.ctx = {.cb = collect_cb, .user_data = &c}
+		,.start = start
+		,.length = span
+		,.digest = &d
+	};
+	assert(IHP_ERR_OK == ihpa_range_run(&range, 1, 32, text_file(text, len)));
+	assert(d.valid && want.crc32 == d.crc32 && !memcmp(want.sha256, d.sha256, 32));
+	collect_free(&c);
+	free(text);
+
+	/* Out of order input is digested from the finished image. */
+	text = hex_text(scrambled, COUNT(scrambled), 16, &len);
+	block_image(ref, NULL, 0xFF, scrambled, COUNT(scrambled));
+	digest_flat(&want, ref, 0x2000);
+	ihpa_digest_init(&d, IHPA_DIGEST_CRC32 | IHPA_DIGEST_SHA256, 0, 0x2000, 0xFF);
+	assert(IHP_ERR_OK == ihpa_populate_digest(SPAN, img, 0xFF, text_file(text, len), &d));
+	assert(d.valid && want.crc32 == d.crc32 && !memcmp(want.sha256, d.sha256, 32));
+
+	ihpa_digest_init(&d, IHPA_DIGEST_CRC32, 0, 0x2000, 0xFF);
+	ic = ihp_mem(mem, 16, text, len);
+	ic->cb = ihpa_digest_cb;
+	ic->user_data = &d;
+	ihp_run(ic);
+	ihp_destroy(ic);
+	assert(!d.valid);
+
+	free(mem);
+	free(img);
+	free(ref);
+	free(text);
+}
+
+/** @brief The coalescing stage passes maximal segments in address order. */
+static void check_coalesce(void)
+{
+	size_t len;
+	char* text = hex_text(scrambled, COUNT(scrambled), 16, &len);
+	uint8_t* ref = alloc(SPAN);
+	bool* mask = alloc(SPAN * sizeof(bool));
+	block_image(ref, mask, 0xFF, scrambled, COUNT(scrambled));
+
+	struct piece runs[8];
+	unsigned run_count = 0;
+	for(uint32_t i = 0; i < SPAN; ++i){
+		if(!mask[i])
+			continue;
+		if(run_count && runs[run_count - 1].address + runs[run_count - 1].len == i)
+			++runs[run_count - 1].len;
+		else
+			runs[run_count++] = (struct piece){i, 1};
+	}
+	assert(4 == run_count);
+
+	/* Run directly, and installed as the callback of a parser. */
+	for(unsigned direct = 0; direct < 2; ++direct){
+		struct collect c;
+		collect_init(&c, 0xFF);
+		struct ihp_ctx out = {.cb = collect_cb, .user_data = &c};
+		if(direct){
+			assert(IHP_ERR_OK == ihpa_coalesce_run(4096, &out, text_stream(text, len)));
+		}
+		else{
+			uint8_t* mem = alloc(ihpa_coalesce_size(4096));
+			uint8_t* parser = alloc(ihp_size(16));
+			struct ihp_ctx* ic = ihp_mem(parser, 16, text, len);
+			ic->cb = ihpa_coalesce_cb;
+			ic->user_data = ihpa_coalesce_init(mem, 4096, &out);
+			assert(ic->user_data);
+			assert(IHP_ERR_OK == ihp_run(ic));
+			ihp_destroy(ic);
+			free(parser);
+			free(mem);
+		}
+		assert(1 == c.ends && IHP_ERR_OK == c.err);
+		assert(run_count == c.count && pieces_same(c.pieces, runs, run_count));
+		assert(!memcmp(c.img, ref, SPAN));
+		collect_free(&c);
+	}
+
+	/* A limit smaller than the data still passes all of it, in order
+	 * within each batch. */
+	struct collect c;
+	collect_init(&c, 0xFF);
+	struct ihp_ctx out = {.cb = collect_cb, .user_data = &c};
+	assert(IHP_ERR_OK == ihpa_coalesce_run(128, &out, text_file(text, len)));
+	assert(c.count > run_count && !memcmp(c.img, ref, SPAN) && !memcmp(c.mask, mask, SPAN));
+	collect_free(&c);
+
+	uint8_t* mem = alloc(ihpa_coalesce_size(0));
+	assert(!ihpa_coalesce_init(mem, 0, &out));
+	free(mem);
+
+	/* Segments held when an error is found are dropped. */
+	char* bad = hex_corrupt(text, len, hex_records(text) - 2);
+	collect_init(&c, 0xFF);
+	assert(IHP_ERR_CHECKSUM == ihpa_coalesce_run(4096, &out, text_file(bad, len)));
+	assert(!c.count && 1 == c.ends && IHP_ERR_CHECKSUM == c.err);
+	collect_free(&c);
+	free(bad);
+
+	/* Aborting, also when passing on the segments held at the end. */
+	for(unsigned stop = 1; stop <= 2; ++stop){
+		collect_init(&c, 0xFF);
+		c.stop = stop;
+		assert(IHP_ERR_USER_ABORT == ihpa_coalesce_run(4096, &out, text_file(text, len)));
+		assert(stop == c.count);
+		collect_free(&c);
+	}
+
+	free(ref);
+	free(mask);
+	free(text);
+}
+
+/** @brief ihpa_populate_file writes the image ihpa_populate makes into a
+ *  window of a file. */
+static void check_populate_file(void)
+{
+	size_t len;
+	char* text = hex_text(layout, COUNT(layout), 32, &len);
+	uint8_t* ref = alloc(SPAN);
+	uint8_t* img = alloc(SPAN);
+
+	/* A file longer than the image, which is cut to it, with either pad. */
+	for(unsigned p = 0; p < 2; ++p){
+		uint8_t pad = p ? 0xA5 : 0;
+		block_image(ref, NULL, pad, layout, COUNT(layout));
+		FILE* out = tmpfile();
+		assert(out);
+		memset(img, 0x5A, SPAN);
+		assert(SPAN == pwrite(fileno(out), img, SPAN, SPAN / 2));
+		assert(IHP_ERR_OK == ihpa_populate_file(0, SPAN, pad, text_file(text, len), fileno(out)));
+		struct stat st;
+		assert(!fstat(fileno(out), &st) && SPAN == st.st_size);
+		assert(SPAN == pread(fileno(out), img, SPAN, 0));
+		assert(!memcmp(img, ref, SPAN));
+		fclose(out);
+	}
+
+	/* A window starting above 0, of the blocks above it. */
+	size_t high_len;
+	char* high = hex_text(layout + 1, COUNT(layout) - 1, 32, &high_len);
+	block_image(ref, NULL, 0xFF, layout + 1, COUNT(layout) - 1);
+	FILE* out = tmpfile();
+	assert(out);
+	assert(IHP_ERR_OK == ihpa_populate_file(0x1000, SPAN - 0x1000, 0xFF,
+		text_file(high, high_len), fileno(out)));
+	assert(SPAN - 0x1000 == pread(fileno(out), img, SPAN, 0));
+	assert(!memcmp(img, ref + 0x1000, SPAN - 0x1000));
+	free(high);
+
+	/* A file that cannot grow keeps its contents. */
+	struct rlimit old_limit;
+	assert(!getrlimit(RLIMIT_FSIZE, &old_limit));
+	struct rlimit limit = {SPAN / 2, old_limit.rlim_max};
+	void (*old_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+	assert(!setrlimit(RLIMIT_FSIZE, &limit));
+	assert(COUNT_IHP_ERR == ihpa_populate_file(0, SPAN, 0xA5, text_file(text, len), fileno(out)));
+	assert(!setrlimit(RLIMIT_FSIZE, &old_limit));
+	signal(SIGXFSZ, old_handler);
+	assert(SPAN - 0x1000 == pread(fileno(out), img, SPAN, 0));
+	assert(!memcmp(img, ref + 0x1000, SPAN - 0x1000));
+
+	/* Data outside the window. */
+	assert(IHP_ERR_USER_ABORT == ihpa_populate_file(0x1000, 0x1000, 0xA5,
+		text_file(text, len), fileno(out)));
+	fclose(out);
+
+	/* A file that cannot be mapped. */
+	int fds[2];
+	assert(!pipe(fds));
+	assert(COUNT_IHP_ERR == ihpa_populate_file(0, SPAN, 0xA5, text_file(text, len), fds[1]));
+	close(fds[0]);
+	close(fds[1]);
+
+	free(img);
+	free(ref);
+	free(text);
+}
+
+/** @brief Range callbacks on consumer threads get the calls a synchronous
+ *  run makes, in order per range. */
+static void check_async(void)
+{
+	const size_t max = 24;
+	size_t len;
+	char* text = hex_text(layout, COUNT(layout), 16, &len);
+
+	struct ihpa_range ranges[3];
+	struct collect c[3];
+	range_init(ranges, c);
+	assert(IHP_ERR_OK == ihpa_range_run(ranges, 3, max, text_file(text, len)));
+
+	/* Rings of 1 to 3 buffers, for as many consumers. */
+	for(unsigned how = 1; how <= 3; ++how){
+		struct ihpa_range other[3];
+		struct collect oc[3];
+		range_init(other, oc);
+		FILE* f = how & 1 ? text_stream(text, len) : text_file(text, len);
+		assert(IHP_ERR_OK == ihpa_range_run_async(other, 3, max, f, how, how));
+		for(unsigned i = 0; i < 3; ++i)
+			collect_same(oc + i, c + i);
+		range_free(oc);
+	}
+	range_free(c);
+
+	/* Aborting on a consumer. */
+	range_init(ranges, c);
+	c[2].stop = 1;
+	assert(IHP_ERR_USER_ABORT == ihpa_range_run_async(ranges, 3, max, text_file(text, len), 1, 3));
+	assert(1 == c[2].count);
+	range_free(c);
+
+	/* Ranges out of order or overlapping. */
+	range_init(ranges, c);
+	ranges[1].start = 0x80;
+	assert(COUNT_IHP_ERR == ihpa_range_run_async(ranges, 3, max, text_file(text, len), 0, 0));
+	range_free(c);
+
+	/* A bad record. */
+	char* bad = hex_corrupt(text, len, 2);
+	range_init(ranges, c);
+	assert(IHP_ERR_CHECKSUM == ihpa_range_run_async(ranges, 3, max, text_file(bad, len), 2, 2));
+	range_free(c);
+	free(bad);
+
+	free(text);
+}
+
+int main(int argc, const char* argv[]){
+	assert(mkdtemp(temp_dir));
+	atexit(temp_remove);
+
+	static const struct {
+		const char* name;
+		void (*fn)(void);
+	} checks[] = {
+		{"sources", check_sources}
+		,{"hex", check_hex}
+		,{"push", check_push}
+		,{"populate", check_populate}
+		,{"sparse", check_sparse}
+		,{"range", check_range}
+		,{"emit", check_emit}
+		,{"validate", check_validate}
+		,{"merge", check_merge}
+		,{"diff", check_diff}
+		,{"pages", check_pages}
+		,{"cache", check_cache}
+		,{"batch", check_batch}
+		,{"jobs", check_jobs}
+		,{"reuse", check_reuse}
+		,{"digest", check_digest}
+		,{"coalesce", check_coalesce}
+		,{"populate_file", check_populate_file}
+		,{"async", check_async}
+	};
+	for(unsigned i = 0; i < COUNT(checks); ++i){
+		/* Run only the checks named, if any. */
+		bool run = argc < 2;
+		for(int a = 1; a < argc; ++a)
+			run |= !strcmp(argv[a], checks[i].name);
+		if(!run)
+			continue;
+
+		checks[i].fn();
+		printf("%s ok\n", checks[i].name);
+	}
+
+	return 0;
+}
@@ -0,0 +1,213 @@
+/* The checks are asserts; keep them in any build. */
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "ihp.hpp"
+
+extern "C" {
+#include "ihpa.h"
+#include "ihp_emit.h"
+}
+
+/* ihp.hpp against the C parser, run by make check: the same input must
+ * produce the same calls and result, however it is malformed or aborted. */
+
+/** @brief Text of one call, so whole runs compare as strings. */
+static void log_call(std::string& log, uint32_t address, const uint8_t* data, size_t len)
+{
+	char buf[32];
+	if(!data){
+		snprintf(buf, sizeof(buf), "end %zu\n", len);
+		log += buf;
+		return;
+	}
+
+	snprintf(buf, sizeof(buf), "%08x %zu:", address, len);
+	log += buf;
+	for(size_t i = 0; i < len; ++i){
+		snprintf(buf, sizeof(buf), " %02x", data[i]);
+		log += buf;
+	}
+	log += '\n';
+}
+
+/** @brief Handler logging calls, which returns false from data call
+ *  number stop if that is not 0. */
+struct recorder {
+	std::string log;
+	unsigned stop = 0;
+	unsigned calls = 0;
+
+	bool operator()(uint32_t address, const uint8_t* data, size_t len)
+	{
+		log_call(log, address, data, len);
+		return !data || ++calls != stop;
+	}
+};
+
+static bool c_record(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len)
+{
+	return (*static_cast<recorder*>(ctx->user_data))(address, data, len);
+}
+
+/** @brief Hex text of pseudo random blocks at addresses, written in mode. */
+static std::string make_text(const std::vector<std::pair<uint32_t, size_t>>& blocks,
+	unsigned record_len, unsigned mode)
+{
+	char* text;
+	size_t text_len;
+	FILE* f = open_memstream(&text, &text_len);
+	assert(f);
+
+	std::vector<uint8_t> mem(ihp_emit_size(4096));
+	struct ihp_emit* e = ihp_emit_file(mem.data(), 4096, f, record_len, mode);
+	assert(e);
+	for(auto& b : blocks){
+		std::vector<uint8_t> data(b.second);
+		for(auto& d : data)
+			d = rand();
+		assert(ihp_emit_data(e, b.first, data.data(), data.size()));
+	}
+	assert(ihp_emit_finish(e));
+	fclose(f);
+
+	std::string ret(text, text_len);
+	free(text);
+	return ret;
+}
+
+/** @brief Parse text with both parsers, from memory and from a stream,
+ *  and assert that every run is the same. ihp_destroy of a C context
+ *  reports input without an EOF record once more, which ihp::parser does
+ *  not, so runs are compared up to the end of ihp_run. */
+template<size_t Max>
+static void check_same(const std::string& text, unsigned stop)
+{
+	recorder c;
+	c.stop = stop;
+	std::vector<uint8_t> mem(ihp_size(Max));
+	struct ihp_ctx* ic = ihp_mem(mem.data(), Max, text.data(), text.size());
+	ic->cb = c_record;
+	ic->user_data = &c;
+	unsigned err = ihp_run(ic);
+	std::string log = c.log;
+	ihp_destroy(ic);
+
+	recorder cs;
+	cs.stop = stop;
+	ic = ihp_file(mem.data(), Max, fmemopen((void*)text.data(), text.size(), "r"));
+	assert(ic);
+	ic->cb = c_record;
+	ic->user_data = &cs;
+	assert(err == ihp_run(ic) && log == cs.log);
+	ihp_destroy(ic);
+
+	ihp::parser<recorder, Max> p(recorder{});
+	p.handler().stop = stop;
+	assert(err == p.run(text.data(), text.size()));
+	assert(log == p.handler().log);
+
+	ihp::parser<recorder, Max> ps(recorder{});
+	ps.handler().stop = stop;
+	FILE* f = fmemopen((void*)text.data(), text.size(), "r");
+	assert(err == ps.run(f));
+	fclose(f);
+	assert(log == ps.handler().log);
+}
+
+static void check_text(const std::string& text)
+{
+	for(unsigned stop = 0; stop < 4; ++stop){
+		check_same<1>(text, stop);
+		check_same<16>(text, stop);
+		check_same<40>(text, stop);
+		check_same<255>(text, stop);
+	}
+}
+
+/** @brief Handler of a range of the C++ table, filling an image. */
+struct range_image {
+	std::vector<uint8_t>* img;
+
+	bool operator()(uint32_t address, const uint8_t* data, size_t len)
+	{
+		if(data){
+			assert(address + len <= img->size());
+			std::copy(data, data + len, img->begin() + address);
+		}
+		return true;
+	}
+};
+
+static constexpr ihp::range table[] = {
+	{0x0000, 0x100}
+	,{0x0100, 0x1000, true}
+	,{0xFFF0, 0x2400}
+};
+
+static bool c_image(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len)
+{
+	return range_image{static_cast<std::vector<uint8_t>*>(ctx->user_data)}(address, data, len);
+}
+
+/** @brief ihp::dispatch passes each range the data ihpa_range_run does. */
+static void check_dispatch(const std::string& text)
+{
+	std::vector<uint8_t> c[3];
+	std::vector<uint8_t> p[3];
+	struct ihpa_range ranges[3] = {};
+	for(unsigned i = 0; i < 3; ++i){
+		c[i].assign(0x20000, 0xFF);
+		p[i].assign(0x20000, 0xFF);
+		ranges[i].start = table[i].start;
+		ranges[i].length = table[i].length;
+		ranges[i].relative = table[i].relative;
+		ranges[i].ctx.cb = c_image;
+		ranges[i].ctx.user_data = c + i;
+	}
+
+	FILE* f = fmemopen((void*)text.data(), text.size(), "r");
+	assert(IHP_ERR_OK == ihpa_range_run(ranges, 3, 64, f));
+
+	ihp::dispatch<table, range_image, range_image, range_image> d({p}, {p + 1}, {p + 2});
+	ihp::parser<decltype(d), 64> parser(d);
+	assert(IHP_ERR_OK == parser.run(text.data(), text.size()));
+	for(unsigned i = 0; i < 3; ++i)
+		assert(c[i] == p[i]);
+}
+
+int main(int argc, const char* argv[])
+{
+	std::string layout = make_text({{0x0000, 300}, {0x1003, 50}, {0xFFE0, 0x40}, {0x12345, 100}},
+		16, IHP_EMIT_LINEAR);
+	check_text(layout);
+	check_text(make_text({{0x0000, 1000}, {0x54321, 600}}, 255, IHP_EMIT_SEGMENT));
+	check_dispatch(layout);
+	printf("parse ok\n");
+
+	/* Malformed input of every kind, and input without an EOF record. */
+	static const char* const bad[] = {
+		""
+		,"x"
+		,":0100000001FF\r\n"
+		,":0100000001\r\n:00000001FF\r\n"
+		,":0100000001fe\n:00000001ff\n"
+		,":0100000001FE\r\n:0100010002FC"
+		,":0100000001FE\r\n:0100010002FC\r\n"
+		,":0100000001FE\r\n:00000006FA\r\n"
+		,":0100000001FE\r\n:01000001FFFF\r\n"
+		,":0100000001FE\r\n:0300000400000FF\r\n"
+		,":0100000001FE\r\n:020000040001F9\r\n:0100000002FD\r\n:00000001FF\r\n"
+		,":0100000001FE\r\n:0G000001FF\r\n"
+		,":0100000001FE\r\n\r\n\n:0100010002FC\r\n:00000001FF\r\n"
+		,":0100000001FE\r\n:00000001FF\r\ngarbage after the end"
+	};
+	for(auto text : bad)
+		check_text(text);
+	printf("malformed ok\n");
+
+	return 0;
+}
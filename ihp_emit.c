@@ -0,0 +1,173 @@
+#include <string.h>
+
+#include "ihp_emit.h"
+
+/** @brief Longest record: ':', header, 255 data bytes, checksum, CRLF. */
+#define MAX_RECORD (1 + 8 + 2 * 255 + 2 + 2)
+
+enum {
+	IHP_CODE_DATA
+	,IHP_CODE_EOF
+	,IHP_CODE_EXT_SEG
+	,IHP_CODE_START_SEG
+	,IHP_CODE_EXT_LIN
+	,IHP_CODE_START_LIN
+};
+
+struct ihp_emit {
+	FILE* f;
+	unsigned record_len;
+	unsigned mode;
+
+	/** @brief Upper address bits set by the last base record. */
+	uint32_t base;
+	bool have_base;
+
+	/** @brief Set once a write has failed. */
+	bool failed;
+
+	size_t pos;
+	size_t max;
+	char buffer[];
+};
+
+/* Two ASCII characters per byte value, so each byte is one 16 bit copy. */
+#define HEX(n) "0123456789ABCDEF"[(n) & 0xF]
+#define P1(n) HEX((n) >> 4), HEX(n)
+#define P4(n) P1(n), P1((n) + 1), P1((n) + 2), P1((n) + 3)
+#define P16(n) P4(n), P4((n) + 4), P4((n) + 8), P4((n) + 12)
+#define P64(n) P16(n), P16((n) + 16), P16((n) + 32), P16((n) + 48)
+
+static const char hex_pairs[2 * 256] = {
+	P64(0), P64(64), P64(128), P64(192)
+};
+
+static bool ihp_emit_record(struct ihp_emit* e, uint8_t code, uint16_t address,
+	const uint8_t* data, size_t len);
+static bool ihp_emit_flush(struct ihp_emit* e);
+
+size_t ihp_emit_size(size_t out_buffer){
+	if(out_buffer < MAX_RECORD)
+		out_buffer = MAX_RECORD;
+	return sizeof(struct ihp_emit) + out_buffer;
+}
+
+struct ihp_emit* ihp_emit_file(uint8_t* mem, size_t out_buffer, FILE* f,
+	unsigned record_len, unsigned mode)
+{
+	if(!record_len || record_len > 255 || mode > IHP_EMIT_SEGMENT)
+		return NULL;
+
+	memset(mem, 0, sizeof(struct ihp_emit));
+	__auto_type ret = (struct ihp_emit*)mem;
+	ret->f = f;
+	ret->record_len = record_len;
+	ret->mode = mode;
+	ret->max = ihp_emit_size(out_buffer) - sizeof(struct ihp_emit);
+	return ret;
+}
+
+bool ihp_emit_data(struct ihp_emit* e, uint32_t address, const uint8_t* data, size_t len){
+	while(len){
+		/* Emit a base record if the upper address bits changed. */
+		uint32_t base = address & 0xFFFF0000;
+		if(!e->have_base || base != e->base){
+			uint8_t b[2];
+			uint8_t code = IHP_CODE_EXT_LIN;
+			if(IHP_EMIT_SEGMENT == e->mode){
+				if(address >= 0x100000)
+					return false;
+				code = IHP_CODE_EXT_SEG;
+				base >>= 4;
+				b[0] = base >> 8;
+				b[1] = base;
+			}
+			else{
+				b[0] = base >> 24;
+				b[1] = base >> 16;
+			}
+
+			if(!ihp_emit_record(e, code, 0, b, 2))
+				return false;
+			e->base = address & 0xFFFF0000;
+			e->have_base = true;
+		}
+
+		/* Cut at the next multiple of the record length, which never
+		 * straddles a 64K boundary unless the length is not a power of
+		 * two; cut there too. */
+		size_t cur = e->record_len - address % e->record_len;
+		if(cur > 0x10000 - (address & 0xFFFF))
+			cur = 0x10000 - (address & 0xFFFF);
+		if(cur > len)
+			cur = len;
+
+		if(!ihp_emit_record(e, IHP_CODE_DATA, address, data, cur))
+			return false;
+
+		address += cur;
+		data += cur;
+		len -= cur;
+	}
+
+	return true;
+}
+
+bool ihp_emit_start(struct ihp_emit* e, uint32_t address){
+	uint8_t b[4] = {address >> 24, address >> 16, address >> 8, address};
+	uint8_t code = IHP_EMIT_SEGMENT == e->mode ? IHP_CODE_START_SEG : IHP_CODE_START_LIN;
+	return ihp_emit_record(e, code, 0, b, 4);
+}
+
+bool ihp_emit_finish(struct ihp_emit* e){
+	if(!ihp_emit_record(e, IHP_CODE_EOF, 0, NULL, 0))
+		return false;
+	return ihp_emit_flush(e) && !fflush(e->f);
+}
+
+bool ihp_emit_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len){
+	if(!data)
+		return len ? true : false;
+
+	return ihp_emit_data((struct ihp_emit*)ctx->user_data, address, data, len);
+}
+
+/* Internal functions. */
+
+static bool ihp_emit_record(struct ihp_emit* e, uint8_t code, uint16_t address,
+	const uint8_t* data, size_t len)
+{
+	if(e->max - e->pos < MAX_RECORD && !ihp_emit_flush(e))
+		return false;
+
+	char* out = e->buffer + e->pos;
+	uint8_t hdr[4] = {len, address >> 8, address, code};
+	unsigned sum = 0;
+
+	*out++ = ':';
+	for(unsigned i = 0; i < 4; ++i, out += 2){
+		memcpy(out, hex_pairs + 2 * hdr[i], 2);
+		sum += hdr[i];
+	}
+	for(size_t i = 0; i < len; ++i, out += 2){
+		memcpy(out, hex_pairs + 2 * data[i], 2);
+		sum += data[i];
+	}
+	memcpy(out, hex_pairs + 2 * (-sum & 0xFF), 2);
+	out += 2;
+	*out++ = '\r';
+	*out++ = '\n';
+
+	e->pos = out - e->buffer;
+	return true;
+}
+
+static bool ihp_emit_flush(struct ihp_emit* e){
+	if(e->failed)
+		return false;
+
+	if(e->pos && fwrite(e->buffer, 1, e->pos, e->f) != e->pos)
+		e->failed = true;
+	e->pos = 0;
+	return !e->failed;
+}
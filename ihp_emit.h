@@ -0,0 +1,54 @@
+#ifndef __IHEX_PARSER_EMIT_H__
+#define __IHEX_PARSER_EMIT_H__
+
+#include "ihp.h"
+
+/** @brief How addresses above 64K are expressed. */
+enum {
+	/** @brief Type 04 extended linear address records; full 32 bit range. */
+	IHP_EMIT_LINEAR
+
+	/** @brief Type 02 extended segment address records; first 1M only. */
+	,IHP_EMIT_SEGMENT
+};
+
+/** @brief Opaque type for writer context;
+ * ACTUAL SIZE OF THE STRUCT MUST BE CALCULATED at run time. */
+struct ihp_emit;
+
+/** @brief Calculate RAM required for a writer with out_buffer bytes of
+ *  output buffering. */
+size_t ihp_emit_size(size_t out_buffer);
+
+/** @brief Initialize a writer.
+ *  @param mem Pointer to raw memory of at least size ihp_emit_size(out_buffer)
+ *  @param out_buffer Bytes of text to collect before writing to f;
+ *   at least one maximum length record is always buffered.
+ *  @param f Destination of the hex text.
+ *  @param record_len Data bytes per record, 1 to 255. Records are cut at
+ *   address multiples of record_len.
+ *  @param mode IHP_EMIT_LINEAR or IHP_EMIT_SEGMENT
+ *  @return pointer to initialized mem, or NULL if an argument is invalid. */
+struct ihp_emit* ihp_emit_file(uint8_t* mem, size_t out_buffer, FILE* f,
+	unsigned record_len, unsigned mode);
+
+/** @brief Write a block of data as data records, preceded by base address
+ *  records where needed.
+ *  @return false on write error or if address does not fit the mode. */
+bool ihp_emit_data(struct ihp_emit* e, uint32_t address, const uint8_t* data, size_t len);
+
+/** @brief Write a start address record; type 05 in linear mode, or type 03
+ *  with CS in the upper and IP in the lower 16 bits in segment mode.
+ *  @return false on write error. */
+bool ihp_emit_start(struct ihp_emit* e, uint32_t address);
+
+/** @brief Write the EOF record and flush all buffered text to the file.
+ *  The file is not closed.
+ *  @return false on write error. */
+bool ihp_emit_finish(struct ihp_emit* e);
+
+/** @brief ihp_cb that writes data to the writer in ctx->user_data,
+ *  so parsed or generated data can be fed straight to a writer. */
+bool ihp_emit_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len);
+
+#endif
@@ -1,10 +1,13 @@
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "ihpa.h"
 
 int main(int argc, const char* argv[]){
 	if(argc < 3){
-		fprintf(stderr, "Usage: %s IMG_SIZE FILL_BYTE\n", argv[0]);
+		fprintf(stderr, "Usage: %s IMG_SIZE FILL_BYTE [BASE_ADDRESS [OUTPUT]]\n", argv[0]);
 		return 1;
 	}
 
@@ -14,17 +17,59 @@ int main(int argc, const char* argv[]){
 	/* Parse fille byte command line */
 	uint8_t b = strtoul(argv[2], NULL, 16);
 
-	/* Initialize initial image. */
-	uint8_t mem[img_size];
+	/* Parse the address of the first byte of the image, in hex. */
+	uint32_t base = argc > 3 ? strtoul(argv[3], NULL, 16) : 0;
+
+	/* The image is written straight into the output file. Without one,
+	 * stdout is used if it is a regular file open for reading and writing;
+	 * otherwise the image goes through a temporary file. */
+	int fd;
+	bool copy = false;
+	struct stat st;
+	if(argc > 4){
+		fd = open(argv[4], O_RDWR | O_CREAT, 0644);
+	}
+	else if(!fstat(STDOUT_FILENO, &st) && S_ISREG(st.st_mode)
+		&& O_RDWR == (fcntl(STDOUT_FILENO, F_GETFL) & O_ACCMODE))
+	{
+		fd = STDOUT_FILENO;
+	}
+	else{
+		FILE* tmp = tmpfile();
+		fd = tmp ? dup(fileno(tmp)) : -1;
+		if(tmp)
+			fclose(tmp);
+		copy = true;
+	}
+	if(fd < 0){
+		fprintf(stderr, "Cannot open output\n");
+		return 1;
+	}
+
+	unsigned err = ihpa_populate_file(base, img_size, b, stdin, fd);
+
+#ifdef IHP_STATS
+	struct ihp_stats stats;
+	ihp_stats_total(&stats);
+	ihp_stats_print(&stats, stderr);
+#endif
 
-	unsigned err = ihpa_populate(img_size, mem, b, stdin);
 	if(err){
 		fprintf(stderr, "Encountered error %u\n", err);
 		return 1;
 	}
 
 	/* Write binary data to stdout. */
-	fwrite(mem, 1, img_size, stdout);
+	if(copy){
+		char buf[1 << 16];
+		ssize_t got;
+		lseek(fd, 0, SEEK_SET);
+		while((got = read(fd, buf, sizeof(buf))) > 0){
+			if(fwrite(buf, 1, got, stdout) != (size_t)got)
+				return 1;
+		}
+	}
 
+	close(fd);
 	return 0;
 }
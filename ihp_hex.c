@@ -0,0 +1,231 @@
+#include <stdbool.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "ihp_hex.h"
+
+/* Nibble value of each character, tagged with 0x10 if the character is
+ * a valid hex digit. ANDing the tags of a whole run tells whether every
+ * character was valid without branching per character. */
+#define HEX_VALID 0x10
+
+static const uint8_t hex_table[256] = {
+	['0'] = HEX_VALID | 0x0, ['1'] = HEX_VALID | 0x1
+	,['2'] = HEX_VALID | 0x2, ['3'] = HEX_VALID | 0x3
+	,['4'] = HEX_VALID | 0x4, ['5'] = HEX_VALID | 0x5
+	,['6'] = HEX_VALID | 0x6, ['7'] = HEX_VALID | 0x7
+	,['8'] = HEX_VALID | 0x8, ['9'] = HEX_VALID | 0x9
+	,['A'] = HEX_VALID | 0xA, ['B'] = HEX_VALID | 0xB
+	,['C'] = HEX_VALID | 0xC, ['D'] = HEX_VALID | 0xD
+	,['E'] = HEX_VALID | 0xE, ['F'] = HEX_VALID | 0xF
+	,['a'] = HEX_VALID | 0xA, ['b'] = HEX_VALID | 0xB
+	,['c'] = HEX_VALID | 0xC, ['d'] = HEX_VALID | 0xD
+	,['e'] = HEX_VALID | 0xE, ['f'] = HEX_VALID | 0xF
+};
+
+typedef int (*hex_decoder)(uint8_t* dest, const char* src, size_t src_len, uint32_t* sum);
+
+static int decode_scalar(uint8_t* dest, const char* src, size_t src_len, uint32_t* sum);
+static int decode_resolve(uint8_t* dest, const char* src, size_t src_len, uint32_t* sum);
+static void decoder_init(void);
+static unsigned decoder_set(unsigned impl);
+static bool supported(unsigned impl);
+
+#if defined(__x86_64__)
+static int decode_sse2(uint8_t* dest, const char* src, size_t src_len, uint32_t* sum);
+static int decode_avx2(uint8_t* dest, const char* src, size_t src_len, uint32_t* sum);
+#else
+#define decode_sse2 NULL
+#define decode_avx2 NULL
+#endif
+
+static const hex_decoder decoders[COUNT_IHP_HEX] = {
+	[IHP_HEX_SCALAR] = decode_scalar
+	,[IHP_HEX_SSE2] = decode_sse2
+	,[IHP_HEX_AVX2] = decode_avx2
+};
+
+/** @brief Decoder in use; resolved once, by the first call or selection.
+ *  Always accessed atomically, as parser threads read it concurrently. */
+static hex_decoder decoder = decode_resolve;
+static pthread_once_t decoder_once = PTHREAD_ONCE_INIT;
+
+int ihp_hex_decode(uint8_t* dest, const char* src, size_t src_len, uint32_t* sum){
+	/* Only even lengths are valid. */
+	if(src_len & 1)
+		return -1;
+
+	return __atomic_load_n(&decoder, __ATOMIC_RELAXED)(dest, src, src_len, sum);
+}
+
+unsigned ihp_hex_select(unsigned impl){
+	/* Resolve first, so a later first call cannot undo the selection. */
+	pthread_once(&decoder_once, decoder_init);
+	return decoder_set(impl);
+}
+
+/* Internal functions. */
+
+static int decode_resolve(uint8_t* dest, const char* src, size_t src_len, uint32_t* sum){
+	pthread_once(&decoder_once, decoder_init);
+	return __atomic_load_n(&decoder, __ATOMIC_RELAXED)(dest, src, src_len, sum);
+}
+
+static void decoder_init(void){
+	decoder_set(COUNT_IHP_HEX);
+}
+
+static unsigned decoder_set(unsigned impl){
+	if(impl >= COUNT_IHP_HEX)
+		impl = COUNT_IHP_HEX - 1;
+
+	while(impl != IHP_HEX_SCALAR && !supported(impl))
+		--impl;
+
+	__atomic_store_n(&decoder, decoders[impl], __ATOMIC_RELAXED);
+	return impl;
+}
+
+static bool supported(unsigned impl){
+	if(!decoders[impl])
+		return false;
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if(IHP_HEX_AVX2 == impl)
+		return __builtin_cpu_supports("avx2");
+#endif
+
+	return true;
+}
+
+static int decode_scalar(uint8_t* dest, const char* src, size_t src_len, uint32_t* sum){
+	const uint8_t* s = (const uint8_t*)src;
+	unsigned valid = HEX_VALID;
+	uint32_t acc = 0;
+
+	/* Reads of a pair always happen before the (lower) write,
+	 * so decoding in place is safe. */
+	for(size_t i = 0; i < src_len / 2; ++i){
+		unsigned hi = hex_table[s[2 * i]];
+		unsigned lo = hex_table[s[2 * i + 1]];
+		valid &= hi & lo;
+
+		uint8_t b = (hi << 4) | (lo & 0xF);
+		if(dest)
+			dest[i] = b;
+		acc += b;
+	}
+
+	if(!valid)
+		return -1;
+
+	*sum += acc;
+	return src_len;
+}
+
+#if defined(__x86_64__)
+
+/* The vector kernels classify each character as a digit ('0'..'9')
+ * or a letter ('a'..'f' after folding case with | 0x20), map it to its
+ * nibble, then merge each pair of nibbles in a 16 bit lane:
+ *
+ *   lane = odd << 8 | even  ->  (lane << 4 & 0xF0) | lane >> 8
+ *
+ * and pack the lanes down to bytes. The bytes are summed with SAD.
+ * Each step reads 2N characters at src + 2i before writing N bytes at
+ * dest + i, so decoding in place is safe. */
+
+static inline __m128i nibbles_sse2(__m128i c, __m128i* valid){
+	__m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i a = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i dv = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+	__m128i av = _mm_cmpeq_epi8(_mm_min_epu8(a, _mm_set1_epi8(5)), a);
+	*valid = _mm_and_si128(*valid, _mm_or_si128(dv, av));
+	return _mm_or_si128(_mm_and_si128(dv, d),
+		_mm_and_si128(av, _mm_add_epi8(a, _mm_set1_epi8(10))));
+}
+
+static inline __m128i merge_sse2(__m128i n){
+	return _mm_or_si128(_mm_and_si128(_mm_slli_epi16(n, 4), _mm_set1_epi16(0xF0)),
+		_mm_srli_epi16(n, 8));
+}
+
+static int decode_sse2(uint8_t* dest, const char* src, size_t src_len, uint32_t* sum){
+	__m128i valid = _mm_set1_epi8(-1);
+	__m128i acc = _mm_setzero_si128();
+
+	size_t i = 0;
+	for(; i + 32 <= src_len; i += 32){
+		__m128i lo = nibbles_sse2(_mm_loadu_si128((const __m128i*)(src + i)), &valid);
+		__m128i hi = nibbles_sse2(_mm_loadu_si128((const __m128i*)(src + i + 16)), &valid);
+		__m128i b = _mm_packus_epi16(merge_sse2(lo), merge_sse2(hi));
+		if(dest)
+			_mm_storeu_si128((__m128i*)(dest + i / 2), b);
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(b, _mm_setzero_si128()));
+	}
+
+	if(_mm_movemask_epi8(valid) != 0xFFFF)
+		return -1;
+
+	uint32_t total = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+	if(decode_scalar(dest ? dest + i / 2 : NULL, src + i, src_len - i, &total) < 0)
+		return -1;
+
+	*sum += total;
+	return src_len;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i nibbles_avx2(__m256i c, __m256i* valid){
+	__m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+	__m256i a = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+	__m256i dv = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+	__m256i av = _mm256_cmpeq_epi8(_mm256_min_epu8(a, _mm256_set1_epi8(5)), a);
+	*valid = _mm256_and_si256(*valid, _mm256_or_si256(dv, av));
+	return _mm256_or_si256(_mm256_and_si256(dv, d),
+		_mm256_and_si256(av, _mm256_add_epi8(a, _mm256_set1_epi8(10))));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i merge_avx2(__m256i n){
+	return _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(n, 4), _mm256_set1_epi16(0xF0)),
+		_mm256_srli_epi16(n, 8));
+}
+
+__attribute__((target("avx2")))
+static int decode_avx2(uint8_t* dest, const char* src, size_t src_len, uint32_t* sum){
+	__m256i valid = _mm256_set1_epi8(-1);
+	__m256i acc = _mm256_setzero_si256();
+
+	size_t i = 0;
+	for(; i + 64 <= src_len; i += 64){
+		__m256i lo = nibbles_avx2(_mm256_loadu_si256((const __m256i*)(src + i)), &valid);
+		__m256i hi = nibbles_avx2(_mm256_loadu_si256((const __m256i*)(src + i + 32)), &valid);
+
+		/* Packing works per 128 bit lane, so restore the quadword order. */
+		__m256i b = _mm256_packus_epi16(merge_avx2(lo), merge_avx2(hi));
+		b = _mm256_permute4x64_epi64(b, 0xD8);
+		if(dest)
+			_mm256_storeu_si256((__m256i*)(dest + i / 2), b);
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(b, _mm256_setzero_si256()));
+	}
+
+	if((unsigned)_mm256_movemask_epi8(valid) != 0xFFFFFFFF)
+		return -1;
+
+	__m128i a = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	uint32_t total = _mm_cvtsi128_si32(a) + _mm_cvtsi128_si32(_mm_srli_si128(a, 8));
+
+	/* Finish the remainder with the narrower kernel. */
+	if(decode_sse2(dest ? dest + i / 2 : NULL, src + i, src_len - i, &total) < 0)
+		return -1;
+
+	*sum += total;
+	return src_len;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef __IHEX_PARSER_HEX_H__
+#define __IHEX_PARSER_HEX_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** @brief Hex decoder implementations, in order of preference. */
+enum {
+	/** @brief Portable table driven decoder. */
+	IHP_HEX_SCALAR
+
+	/** @brief 16 characters per step. */
+	,IHP_HEX_SSE2
+
+	/** @brief 32 characters per step. */
+	,IHP_HEX_AVX2
+
+	/** @brief Number of implementations. */
+	,COUNT_IHP_HEX
+};
+
+/** @brief Convert ASCII hex to bytes and sum the decoded bytes in one pass.
+ *  Both upper and lower case digits are accepted.
+ *  @param dest Destination of src_len / 2 bytes; may be the same as src.
+ *   If NULL, src is only validated and summed.
+ *  @param src ASCII hex characters
+ *  @param src_len Number of characters; must be even
+ *  @param sum Running byte sum; only updated on success.
+ *  @return src_len on success, negative if src contains a non hex character
+ *   or src_len is odd. */
+int ihp_hex_decode(uint8_t* dest, const char* src, size_t src_len, uint32_t* sum);
+
+/** @brief Select the decoder used by ihp_hex_decode.
+ *  By default the best implementation supported by the CPU is used.
+ *  The selection is process wide; call this before starting threads that
+ *  parse, as parsing already under way may use either decoder.
+ *  @param impl IHP_HEX_* implementation to prefer.
+ *  @return The implementation actually selected, which is the best one
+ *   supported by the CPU that is not better than impl. */
+unsigned ihp_hex_select(unsigned impl);
+
+#endif
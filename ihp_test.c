@@ -230,6 +230,13 @@ int main(int argc, const char* argv[]){
 
 	unsigned err = ihpa_range_run(
 		msp430_ranges, sizeof(msp430_ranges) / sizeof(msp430_ranges[0]), 64, stdin);
+
+#ifdef IHP_STATS
+	struct ihp_stats stats;
+	ihp_stats_total(&stats);
+	ihp_stats_print(&stats, stderr);
+#endif
+
 	if(err){
 		fprintf(stderr, "Encountered error %u\n", err);
 		return 1;
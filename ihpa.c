@@ -1,9 +1,35 @@
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "ihpa.h"
+#include "ihp_hex.h"
+
+/** @brief Callback buffer size of populate. */
+#define IHPA_POPULATE_BUFFER 64
+
+/** @brief Callback buffer size of parallel populate workers. */
+#define IHPA_MT_BUFFER 4096
+
+/** @brief Smallest input span worth a thread of its own. */
+#define IHPA_MT_MIN_SPAN (256 * 1024)
+
+/** @brief Populate jobs of larger files are split into pieces. */
+#define IHPA_JOBS_SPLIT (4 * 1024 * 1024)
+
+/** @brief Most pieces per worker a populate job is split into. */
+#define IHPA_JOBS_PIECES 4
 
 struct ihpa_fillbuf {
 	size_t max;
 	uint8_t* mem;
+
+	/** @brief Digest fed the data as it is copied, if any. */
+	struct ihpa_digest* digest;
 };
 
 struct ihpa_range_data {
@@ -14,6 +40,10 @@ struct ihpa_range_data {
 	/** @brief Current range being buffered. */
 	unsigned cur_range;
 
+	/** @brief Range following the last one used; where in-order input
+	 *  looks first. */
+	unsigned next_range;
+
 	/** @brief Current offset in the range. */
 	unsigned cur_offset;
 
@@ -23,36 +53,432 @@ struct ihpa_range_data {
 	/** @brief Length of following buffer. */
 	size_t maxbuff;
 
+	/** @brief If set, range data is queued to consumer threads instead of
+	 *  being passed to the range callbacks. */
+	struct ihpa_pipe* pipe;
+
 	/** @brief Where to buffer RAM so as to meet max user spec. */
 	uint8_t buffer[];
 };
 
+/** @brief Slice of the input parsed by one parallel populate worker. */
+struct ihpa_chunk {
+	/** @brief All chunks, in input order. */
+	struct ihpa_chunk* chunks;
+
+	/** @brief Input span; begins at a record. */
+	const char* begin;
+	const char* end;
+
+	/** @brief Last base address record in the span, if any. */
+	const char* base;
+	size_t base_len;
+
+	/** @brief True if the span holds the EOF record. */
+	bool eof;
+
+	/** @brief Slice of the image to pad. */
+	struct ihpa_fillbuf* fill;
+	size_t pad_begin;
+	size_t pad_end;
+	uint8_t pad;
+
+	/** @brief Parse result. */
+	unsigned err;
+};
+
+/** @brief A populate job split into pieces. */
+struct ihpa_split {
+	FILE* input;
+	void* map;
+	size_t map_len;
+	struct ihpa_fillbuf fill;
+
+	/** @brief Pieces of the current phase still running. */
+	unsigned pending;
+
+	unsigned n;
+	struct ihpa_chunk chunks[];
+};
+
+enum {
+	/** @brief A whole job. */
+	IHPA_TASK_JOB
+
+	/** @brief Padding and prescan of one piece of a split job. */
+	,IHPA_TASK_PRESCAN
+
+	/** @brief Parse of one piece of a split job. */
+	,IHPA_TASK_PARSE
+};
+
+struct ihpa_task {
+	unsigned kind;
+	size_t job;
+
+	/** @brief For pieces: the split job and the piece. */
+	struct ihpa_split* split;
+	unsigned piece;
+};
+
+/** @brief Task queue of one worker; the owner works at the tail,
+ *  thieves take from the head. */
+struct ihpa_deque {
+	pthread_mutex_t lock;
+	struct ihpa_task* tasks;
+	size_t head;
+	size_t tail;
+	size_t capacity;
+};
+
+struct ihpa_pool {
+	const struct ihpa_job* jobs;
+	unsigned* status;
+
+	unsigned n;
+	struct ihpa_deque* queues;
+
+	/** @brief Tasks queued or running; a task that adds tasks counts
+	 *  them before it finishes, so 0 means all work is done. */
+	size_t outstanding;
+
+	size_t failed;
+
+	/** @brief Idle workers wait on cond until wakeups changes, which it
+	 *  does when a task is queued or outstanding reaches 0. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t wakeups;
+};
+
+struct ihpa_worker {
+	struct ihpa_pool* pool;
+	unsigned id;
+
+	/** @brief Parser contexts of whole jobs live here. */
+	uint8_t* scratch;
+	size_t scratch_len;
+};
+
+/** @brief Data for one range callback, queued by ihpa_range_run_async. */
+struct ihpa_slot {
+	/** @brief Index of the range; range_count marks the end of input. */
+	unsigned range;
+	uint32_t address;
+	size_t len;
+	uint8_t* data;
+};
+
+/** @brief Single producer, single consumer ring of slots. The parser only
+ *  moves tail and the consumer only moves head, publishing slots to each
+ *  other through those indices alone. A side finding the ring full or
+ *  empty raises its flag and sleeps on its semaphore, which the other
+ *  side posts only when it finds the flag raised. */
+struct ihpa_ring {
+	struct ihpa_pipe* pipe;
+	struct ihpa_slot* slots;
+	unsigned head;
+	unsigned tail;
+
+	/** @brief Parser waiting for a free slot, on free. */
+	bool full;
+	sem_t free;
+
+	/** @brief Consumer waiting for a used slot, on used. */
+	bool empty;
+	sem_t used;
+
+	pthread_t tid;
+};
+
+struct ihpa_pipe {
+	struct ihpa_range* ranges;
+	unsigned range_count;
+
+	/** @brief Slots per ring, a power of 2 so that the free running
+	 *  indices wrap cleanly. */
+	unsigned depth;
+
+	/** @brief One ring and consumer thread per consumer. */
+	unsigned n;
+	struct ihpa_ring* rings;
+
+	/** @brief Set once a range callback has returned false. */
+	bool abort;
+};
+
 static bool ihpa_fill_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len);
 
+static unsigned ihpa_populate_run(size_t img_len, uint8_t* img_mem, uint8_t pad, FILE* input,
+	uint8_t* scratch, struct ihpa_digest* d);
+
+static bool ihpa_split(const char* src, size_t len, struct ihpa_fillbuf* f, uint8_t pad,
+	struct ihpa_chunk* chunks, unsigned n);
+
+static void ihpa_spawn(void* (*fn)(void*), struct ihpa_chunk* chunks, unsigned n);
+
+static void* ihpa_prescan_worker(void* arg);
+
+static void* ihpa_populate_worker(void* arg);
+
+static bool ihpa_range_check(const struct ihpa_range* ranges, unsigned range_count);
+
+static unsigned ihpa_range_exec(struct ihpa_range* ranges, unsigned range_count, size_t max,
+	FILE* input, uint8_t* scratch, struct ihpa_pipe* pipe);
+
+static bool ihpa_pipe_put(struct ihpa_pipe* pipe, unsigned range, uint32_t address,
+	const uint8_t* data, size_t len);
+
+static struct ihpa_slot* ihpa_ring_claim(struct ihpa_ring* r);
+
+static void ihpa_ring_publish(struct ihpa_ring* r);
+
+static void ihpa_ring_sleep(bool* flag, sem_t* sem, const unsigned* index, unsigned value);
+
+static void ihpa_ring_wake(bool* flag, sem_t* sem);
+
+static void* ihpa_pipe_consumer(void* arg);
+
+static size_t ihpa_range_offset(size_t max_buffer);
+
 static size_t ihpa_range_size(size_t max_buffer);
 
 static bool ihpa_range_cb(struct ihp_ctx* ctx, uint32_t address,
 	const uint8_t* data, size_t len);
 
+static bool ihpa_range_emit(struct ihpa_range_data* ird, const uint8_t* data, size_t len);
+
+static bool ihpa_range_flush(struct ihpa_range_data* ird);
+
+static unsigned ihpa_range_find(struct ihpa_range_data* ird, uint32_t address);
+
+static void* ihpa_jobs_worker(void* arg);
+
+static void ihpa_jobs_task(struct ihpa_worker* w, const struct ihpa_task* t);
+
+static void ihpa_jobs_push(struct ihpa_pool* pool, unsigned id, const struct ihpa_task* t);
+
+static bool ihpa_jobs_take(struct ihpa_pool* pool, unsigned id, struct ihpa_task* t);
+
+static void ihpa_jobs_done(struct ihpa_pool* pool);
+
+static void ihpa_jobs_wake(struct ihpa_pool* pool);
+
+static uint8_t* ihpa_jobs_scratch(struct ihpa_worker* w, size_t len);
+
 unsigned ihpa_populate(size_t img_len, uint8_t* img_mem, uint8_t pad, FILE* input)
 {
-	/* Initialize the callback data and the initial image. */
+	uint8_t* mem = malloc(ihpa_scratch_size(0));
+	unsigned err = mem ? ihpa_populate_run(img_len, img_mem, pad, input, mem, NULL) : COUNT_IHP_ERR;
+	free(mem);
+	fclose(input);
+	return err;
+}
+
+unsigned ihpa_populate_with(size_t img_len, uint8_t* img_mem, uint8_t pad, FILE* input,
+	uint8_t* scratch)
+{
+	return ihpa_populate_run(img_len, img_mem, pad, input, scratch, NULL);
+}
+
+unsigned ihpa_populate_digest(size_t img_len, uint8_t* img_mem, uint8_t pad, FILE* input,
+	struct ihpa_digest* d)
+{
+	uint8_t* mem = malloc(ihpa_scratch_size(0));
+	unsigned err = mem ? ihpa_populate_run(img_len, img_mem, pad, input, mem, d) : COUNT_IHP_ERR;
+	free(mem);
+	fclose(input);
+	if(IHP_ERR_OK != err)
+		return err;
+
+	/* Out of order data needs a second pass over the image after all. */
+	if(!d->valid){
+		ihpa_digest_init(d, d->kinds, d->start, d->end - d->start, d->pad);
+		if(d->start < img_len){
+			size_t end = d->end < img_len ? d->end : img_len;
+			ihpa_digest_add(d, d->start, img_mem + d->start, end - d->start);
+		}
+	}
+
+	ihpa_digest_final(d);
+	return err;
+}
+
+unsigned ihpa_populate_mt(size_t img_len, uint8_t* img_mem, uint8_t pad, FILE* input, unsigned threads)
+{
+	/* Only a mapped file can be split up front;
+	 * anything else is parsed sequentially. */
+	struct stat st;
+	void* m = MAP_FAILED;
+	long pos = ftell(input);
+	if(pos >= 0 && !fstat(fileno(input), &st) && S_ISREG(st.st_mode) && st.st_size > pos)
+		m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(input), 0);
+	if(MAP_FAILED == m)
+		return ihpa_populate(img_len, img_mem, pad, input);
+
+	const char* src = (const char*)m + pos;
+	size_t len = st.st_size - pos;
+
+	if(!threads)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned n = len / IHPA_MT_MIN_SPAN + 1;
+	if(n > threads)
+		n = threads;
+
 	struct ihpa_fillbuf f = {
 		.max = img_len
 		,.mem = img_mem
 	};
-	memset(img_mem, pad, img_len);
+	struct ihpa_chunk chunks[n];
+	if(!ihpa_split(src, len, &f, pad, chunks, n)){
+		munmap(m, st.st_size);
+		return ihpa_populate(img_len, img_mem, pad, input);
+	}
 
-	/* Initialize the ihp context */
-	size_t isize = ihp_size(64);
-	uint8_t ihp_mem[isize];
-	struct ihp_ctx* ic = ihp_file(ihp_mem, 64, input);
-	ic->user_data = &f;
+	/* Nobody writes data until all the padding is done. */
+	ihpa_spawn(ihpa_prescan_worker, chunks, n);
+	ihpa_spawn(ihpa_populate_worker, chunks, n);
+
+	unsigned err = IHP_ERR_OK;
+	for(unsigned i = 0; i < n && IHP_ERR_OK == err; ++i)
+		err = chunks[i].err;
+
+	munmap(m, st.st_size);
+	fclose(input);
+	return err;
+}
+
+/** @brief Split the input evenly into n chunks, each padding an even share
+ *  of the image.
+ *  @return false if a cut cannot be told to be at the start of a record;
+ *   the input must be parsed in one piece then. */
+static bool ihpa_split(const char* src, size_t len, struct ihpa_fillbuf* f, uint8_t pad,
+	struct ihpa_chunk* chunks, unsigned n)
+{
+	/* Move each cut forward to the next ':'. In valid records that only
+	 * starts a record, but in malformed input it may not, and records need
+	 * not be on lines of their own; only trust a ':' after a line ending,
+	 * so each piece reports what a serial parse would. */
+	size_t img_len = f->max;
+	const char* cut = src;
+	for(unsigned i = 0; i < n; ++i){
+		const char* next = src + len;
+		if(i + 1 < n){
+			next = src + len / n * (i + 1);
+			if(next < cut)
+				next = cut;
+			next = memchr(next, ':', src + len - next);
+			if(!next)
+				next = src + len;
+			else if(next != src && '\r' != next[-1] && '\n' != next[-1])
+				return false;
+		}
+
+		chunks[i] = (struct ihpa_chunk){
+			.chunks = chunks
+			,.begin = cut
+			,.end = next
+			,.fill = f
+			,.pad_begin = img_len / n * i
+			,.pad_end = i + 1 < n ? img_len / n * (i + 1) : img_len
+			,.pad = pad
+		};
+		cut = next;
+	}
+
+	return true;
+}
+
+static void ihpa_spawn(void* (*fn)(void*), struct ihpa_chunk* chunks, unsigned n)
+{
+	/* The calling thread takes the first chunk, and any chunk a thread
+	 * could not be started for. */
+	pthread_t tids[n];
+	bool started[n];
+	for(unsigned i = 1; i < n; ++i)
+		started[i] = !pthread_create(tids + i, NULL, fn, chunks + i);
+
+	fn(chunks);
+	for(unsigned i = 1; i < n; ++i){
+		if(started[i])
+			pthread_join(tids[i], NULL);
+		else
+			fn(chunks + i);
+	}
+}
+
+static void* ihpa_populate_worker(void* arg)
+{
+	struct ihpa_chunk* c = arg;
+
+	/* The base address in effect is the last one set before this chunk;
+	 * nothing after an EOF record counts. */
+	const char* base = NULL;
+	size_t base_len = 0;
+	for(struct ihpa_chunk* p = c; p-- != c->chunks;){
+		if(p->eof){
+			c->err = IHP_ERR_OK;
+			return NULL;
+		}
+		if(!base && p->base){
+			base = p->base;
+			base_len = p->base_len;
+		}
+	}
+
+	/* Replay that base record from the source, then parse the chunk. */
+	uint8_t* mem = malloc(ihp_size(IHPA_MT_BUFFER));
+	if(!mem){
+		c->err = COUNT_IHP_ERR;
+		return NULL;
+	}
+	struct ihp_ctx* ic = ihp_push(mem, IHPA_MT_BUFFER);
+	ic->user_data = c->fill;
 	ic->cb = ihpa_fill_cb;
 
-	unsigned err = ihp_run(ic);
+	if(base)
+		ihp_feed(ic, base, base_len);
+	ihp_feed(ic, c->begin, c->end - c->begin);
+	c->err = ihp_finish(ic);
 	ihp_destroy(ic);
-	return err;
+	free(mem);
+	return NULL;
+}
+
+static void* ihpa_prescan_worker(void* arg)
+{
+	struct ihpa_chunk* c = arg;
+
+	/* Pad this worker's slice of the image. */
+	memset(c->fill->mem + c->pad_begin, c->pad, c->pad_end - c->pad_begin);
+
+	/* Find the base address and EOF records by walking the record
+	 * headers only. Anything malformed stops the scan;
+	 * the parse proper reports it. */
+	const char* p = c->begin;
+	while(p < c->end){
+		while(p < c->end && ('\r' == *p || '\n' == *p))
+			++p;
+
+		uint8_t hdr[4];
+		uint32_t sum = 0;
+		if(c->end - p < 9 || ':' != *p || ihp_hex_decode(hdr, p + 1, 8, &sum) < 0)
+			break;
+
+		size_t rec_len = 11 + 2 * hdr[0];
+		if(2 == hdr[3] || 4 == hdr[3]){
+			c->base = p;
+			c->base_len = rec_len;
+		}
+		else if(1 == hdr[3]){
+			c->eof = true;
+			break;
+		}
+
+		p += rec_len;
+	}
+
+	return NULL;
 }
 
 static bool ihpa_fill_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len)
@@ -67,157 +493,698 @@ static bool ihpa_fill_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* d
 		return false;
 
 	memcpy(f->mem + address, data, len);
+	if(f->digest)
+		ihpa_digest_add(f->digest, address, data, len);
 	return true;
 }
 
 
 unsigned ihpa_range_run(struct ihpa_range* ranges, unsigned range_count, size_t max, FILE* input)
 {
-	/* Make sure all ranges monotonically increase. */
-	for(unsigned i = 0; i < range_count - 1; ++i){
-		if(ranges[i].start >= ranges[i + 1].start)
-			return COUNT_IHP_ERR;
+	/* Invalid ranges leave the input open, as they always have. */
+	if(!ihpa_range_check(ranges, range_count))
+		return COUNT_IHP_ERR;
+
+	uint8_t* mem = malloc(ihpa_scratch_size(max));
+	unsigned err = mem ? ihpa_range_run_with(ranges, range_count, max, input, mem) : COUNT_IHP_ERR;
+	free(mem);
+	fclose(input);
+	return err;
+}
+
+unsigned ihpa_range_run_with(struct ihpa_range* ranges, unsigned range_count, size_t max,
+	FILE* input, uint8_t* scratch)
+{
+	if(!ihpa_range_check(ranges, range_count))
+		return COUNT_IHP_ERR;
+	return ihpa_range_exec(ranges, range_count, max, input, scratch, NULL);
+}
+
+unsigned ihpa_range_run_async(struct ihpa_range* ranges, unsigned range_count, size_t max,
+	FILE* input, unsigned depth, unsigned consumers)
+{
+	if(!ihpa_range_check(ranges, range_count))
+		return COUNT_IHP_ERR;
+	if(!depth)
+		depth = 8;
+	unsigned pow2 = 1;
+	while(pow2 < depth && pow2 <= UINT_MAX / 2)
+		pow2 *= 2;
+	depth = pow2;
+	if(!consumers)
+		consumers = 1;
+	if(consumers > range_count)
+		consumers = range_count;
+
+	/* Rings, their slots and the slot buffers in one block; each ring
+	 * takes a multiple of the slot alignment so the next one is aligned. */
+	size_t a = _Alignof(struct ihpa_slot);
+	size_t ring_len = depth * ((sizeof(struct ihpa_slot) + max + a - 1) / a * a);
+	uint8_t* mem = malloc(consumers * (sizeof(struct ihpa_ring) + ring_len));
+	uint8_t* scratch = malloc(ihpa_scratch_size(max));
+	struct ihpa_pipe pipe = {
+		.ranges = ranges
+		,.range_count = range_count
+		,.depth = depth
+		,.rings = (struct ihpa_ring*)mem
+	};
+
+	for(; mem && scratch && pipe.n < consumers; ++pipe.n){
+		struct ihpa_ring* r = pipe.rings + pipe.n;
+		*r = (struct ihpa_ring){
+			.pipe = &pipe
+			,.slots = (struct ihpa_slot*)(mem + consumers * sizeof(*r) + pipe.n * ring_len)
+		};
+		for(unsigned i = 0; i < depth; ++i)
+			r->slots[i].data = (uint8_t*)(r->slots + depth) + i * max;
+
+		sem_init(&r->free, 0, 0);
+		sem_init(&r->used, 0, 0);
+		if(pthread_create(&r->tid, NULL, ihpa_pipe_consumer, r)){
+			sem_destroy(&r->free);
+			sem_destroy(&r->used);
+			break;
+		}
 	}
 
-	/* Make sure range does not extend into next range. */
-	for(unsigned i = 0; i < range_count - 1; ++i){
-		if(ranges[i].start + ranges[i].length > ranges[i + 1].start)
-			return COUNT_IHP_ERR;
+	/* Without every consumer, stop those started and run synchronously. */
+	bool ok = pipe.n == consumers;
+	unsigned err = COUNT_IHP_ERR;
+	if(ok)
+		err = ihpa_range_exec(ranges, range_count, max, input, scratch, &pipe);
+
+	/* Mark the end of input; each consumer finishes its ring first. */
+	for(unsigned i = 0; i < pipe.n; ++i){
+		struct ihpa_ring* r = pipe.rings + i;
+		ihpa_ring_claim(r)->range = range_count;
+		ihpa_ring_publish(r);
+		pthread_join(r->tid, NULL);
+		sem_destroy(&r->free);
+		sem_destroy(&r->used);
 	}
 
-	/* Initialize the callback data
+	free(mem);
+	free(scratch);
+	if(!ok)
+		return ihpa_range_run(ranges, range_count, max, input);
+
+	fclose(input);
+	if(IHP_ERR_OK == err && __atomic_load_n(&pipe.abort, __ATOMIC_ACQUIRE))
+		err = IHP_ERR_USER_ABORT;
+	return err;
+}
+
+size_t ihpa_scratch_size(size_t max)
+{
+	if(max < IHPA_POPULATE_BUFFER)
+		max = IHPA_POPULATE_BUFFER;
+	return ihpa_range_offset(max) + ihpa_range_size(max);
+}
+
+static unsigned ihpa_range_exec(struct ihpa_range* ranges, unsigned range_count, size_t max,
+	FILE* input, uint8_t* scratch, struct ihpa_pipe* pipe)
+{
+	/* Initialize the callback data after the ihp context
 	 * -Set the cur_range field to an invalid value */
-	size_t rsize = ihpa_range_size(max);
-	uint8_t ihpa_mem[rsize];
-	__auto_type ird  = (struct ihpa_range_data*)ihpa_mem;
+	__auto_type ird  = (struct ihpa_range_data*)(scratch + ihpa_range_offset(max));
 	ird->ranges = ranges;
 	ird->range_count = range_count;
 	ird->cur_range = range_count;
+	ird->next_range = 0;
 	ird->curlength = 0;
 	ird->maxbuff = max;
+	ird->pipe = pipe;
 
 	/* Initialize the ihp context */
-	size_t isize = ihp_size(max);
-	uint8_t ihp_mem[isize];
-	struct ihp_ctx* ic = ihp_file(ihp_mem, max, input);
+	struct ihp_ctx* ic = ihp_file_buffered(scratch, max, NULL);
+	ihp_reset(ic, input);
 	ic->user_data = ird;
 	ic->cb = ihpa_range_cb;
 
 	unsigned err = ihp_run(ic);
 	ihp_destroy(ic);
+
+	if(IHP_ERR_OK == err){
+		for(unsigned i = 0; i < range_count; ++i){
+			if(ranges[i].digest)
+				ihpa_digest_final(ranges[i].digest);
+		}
+	}
 	return err;
 }
 
+static unsigned ihpa_populate_run(size_t img_len, uint8_t* img_mem, uint8_t pad, FILE* input,
+	uint8_t* scratch, struct ihpa_digest* d)
+{
+	/* Initialize the callback data and the initial image. */
+	struct ihpa_fillbuf f = {
+		.max = img_len
+		,.mem = img_mem
+		,.digest = d
+	};
+	memset(img_mem, pad, img_len);
+
+	/* Initialize the ihp context */
+	struct ihp_ctx* ic = ihp_file_buffered(scratch, IHPA_POPULATE_BUFFER, NULL);
+	ihp_reset(ic, input);
+	ic->user_data = &f;
+	ic->cb = ihpa_fill_cb;
+
+	unsigned err = ihp_run(ic);
+	ihp_destroy(ic);
+	return err;
+}
+
+size_t ihpa_jobs_run(const struct ihpa_job* jobs, size_t count, unsigned* status, unsigned threads)
+{
+	if(!threads)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	struct ihpa_deque queues[threads];
+	struct ihpa_pool pool = {
+		.jobs = jobs
+		,.status = status
+		,.n = threads
+		,.queues = queues
+		,.outstanding = count
+	};
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	memset(queues, 0, sizeof(queues));
+	for(unsigned i = 0; i < threads; ++i)
+		pthread_mutex_init(&queues[i].lock, NULL);
+
+	/* Deal the jobs out; stealing evens out whatever this gets wrong. */
+	for(size_t i = 0; i < count; ++i){
+		struct ihpa_task t = {.kind = IHPA_TASK_JOB, .job = i};
+		ihpa_jobs_push(&pool, i % threads, &t);
+	}
+
+	/* The calling thread is worker 0; the queue of a worker that could
+	 * not be started is emptied by stealing. */
+	struct ihpa_worker workers[threads];
+	pthread_t tids[threads];
+	bool started[threads];
+	for(unsigned i = 0; i < threads; ++i)
+		workers[i] = (struct ihpa_worker){.pool = &pool, .id = i};
+	for(unsigned i = 1; i < threads; ++i)
+		started[i] = !pthread_create(tids + i, NULL, ihpa_jobs_worker, workers + i);
+
+	ihpa_jobs_worker(workers);
+	for(unsigned i = 1; i < threads; ++i){
+		if(started[i])
+			pthread_join(tids[i], NULL);
+	}
+
+	for(unsigned i = 0; i < threads; ++i){
+		free(queues[i].tasks);
+		pthread_mutex_destroy(&queues[i].lock);
+	}
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	return pool.failed;
+}
+
+static bool ihpa_range_check(const struct ihpa_range* ranges, unsigned range_count)
+{
+	/* Make sure all ranges monotonically increase. */
+	for(unsigned i = 0; i < range_count - 1; ++i){
+		if(ranges[i].start >= ranges[i + 1].start)
+			return false;
+	}
+
+	/* Make sure range does not extend into next range. */
+	for(unsigned i = 0; i < range_count - 1; ++i){
+		if(ranges[i].start + ranges[i].length > ranges[i + 1].start)
+			return false;
+	}
+
+	return true;
+}
+
+/** @brief Offset of the range data after the ihp context, kept aligned. */
+static size_t ihpa_range_offset(size_t max_buffer)
+{
+	return (ihp_file_size(max_buffer) + 15) & ~(size_t)15;
+}
+
+
+/** @brief Queue a copy of range data to the consumer of the range,
+ *  waiting for a free slot. */
+static bool ihpa_pipe_put(struct ihpa_pipe* pipe, unsigned range, uint32_t address,
+	const uint8_t* data, size_t len)
+{
+	if(__atomic_load_n(&pipe->abort, __ATOMIC_ACQUIRE))
+		return false;
+
+	struct ihpa_ring* r = pipe->rings + range % pipe->n;
+	struct ihpa_slot* s = ihpa_ring_claim(r);
+	s->range = range;
+	s->address = address;
+	s->len = len;
+	memcpy(s->data, data, len);
+	ihpa_ring_publish(r);
+	return true;
+}
+
+/** @brief Slot at the tail of the ring, once the consumer has freed it. */
+static struct ihpa_slot* ihpa_ring_claim(struct ihpa_ring* r)
+{
+	unsigned depth = r->pipe->depth;
+	while(r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == depth)
+		ihpa_ring_sleep(&r->full, &r->free, &r->head, r->tail - depth);
+	return r->slots + (r->tail & (depth - 1));
+}
+
+/** @brief Pass the claimed slot to the consumer. */
+static void ihpa_ring_publish(struct ihpa_ring* r)
+{
+	/* Sequentially consistent rather than release, so that either this
+	 * side sees the flag or the sleeping side sees the new index. */
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_SEQ_CST);
+	ihpa_ring_wake(&r->empty, &r->used);
+}
+
+/** @brief Sleep until the other side moves *index away from value,
+ *  after raising flag for it. May return early; callers check again. */
+static void ihpa_ring_sleep(bool* flag, sem_t* sem, const unsigned* index, unsigned value)
+{
+	__atomic_store_n(flag, true, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(index, __ATOMIC_SEQ_CST) == value){
+		while(sem_wait(sem))
+			;
+		return;
+	}
+
+	/* It moved meanwhile. If the other side also took the flag down, it
+	 * has posted or will post; take that post so none are left over. */
+	if(!__atomic_exchange_n(flag, false, __ATOMIC_SEQ_CST)){
+		while(sem_wait(sem))
+			;
+	}
+}
+
+/** @brief Wake the other side if it sleeps on flag. */
+static void ihpa_ring_wake(bool* flag, sem_t* sem)
+{
+	if(__atomic_exchange_n(flag, false, __ATOMIC_SEQ_CST))
+		sem_post(sem);
+}
+
+static void* ihpa_pipe_consumer(void* arg)
+{
+	struct ihpa_ring* r = arg;
+	struct ihpa_pipe* pipe = r->pipe;
+
+	/* After an abort, slots are only drained so the parser never waits
+	 * on a ring nobody empties. */
+	for(;;){
+		while(__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->head)
+			ihpa_ring_sleep(&r->empty, &r->used, &r->tail, r->head);
+		struct ihpa_slot* s = r->slots + (r->head & (pipe->depth - 1));
+		if(s->range == pipe->range_count)
+			break;
+
+		struct ihpa_range* c = pipe->ranges + s->range;
+		if(!__atomic_load_n(&pipe->abort, __ATOMIC_ACQUIRE)
+			&& !c->ctx.cb(&c->ctx, s->address, s->data, s->len))
+		{
+			__atomic_store_n(&pipe->abort, true, __ATOMIC_RELEASE);
+		}
+
+		/* Hand the slot back, as ihpa_ring_publish does the other way. */
+		__atomic_store_n(&r->head, r->head + 1, __ATOMIC_SEQ_CST);
+		ihpa_ring_wake(&r->full, &r->free);
+	}
+
+	return NULL;
+}
 
 static size_t ihpa_range_size(size_t max_buffer){
 	return sizeof(struct ihpa_range_data) + max_buffer;
 }
 
-static bool ihpa_range_cb(struct ihp_ctx* ctx, uint32_t address,
-	const uint8_t* data, size_t len)
+static void* ihpa_jobs_worker(void* arg)
 {
-	if(!data)
-		return len ? true : false;
+	struct ihpa_worker* w = arg;
+	struct ihpa_pool* pool = w->pool;
 
-	/* If no data, then trivially true. */
-	if(!len)
-		return true;
+	/* Keep looking until no task is queued or running anywhere,
+	 * as a running task may still add pieces. */
+	struct ihpa_task t;
+	while(__atomic_load_n(&pool->outstanding, __ATOMIC_ACQUIRE)){
+		/* Sleep if nothing was found and nothing changed since looking. */
+		size_t wakeups = __atomic_load_n(&pool->wakeups, __ATOMIC_ACQUIRE);
+		if(!ihpa_jobs_take(pool, w->id, &t)){
+			pthread_mutex_lock(&pool->lock);
+			while(wakeups == pool->wakeups && __atomic_load_n(&pool->outstanding, __ATOMIC_ACQUIRE))
+				pthread_cond_wait(&pool->cond, &pool->lock);
+			pthread_mutex_unlock(&pool->lock);
+			continue;
+		}
 
-	__auto_type ird = (struct ihpa_range_data*)ctx->user_data;
+		ihpa_jobs_task(w, &t);
+		ihpa_jobs_done(pool);
+	}
 
-	/* If there is a current range defined AND
-	 * If the start of this range does not coincide with
-	 * the end of the current range, then flush */
-	if(ird->cur_range < ird->range_count){
-		__auto_type c = ird->ranges + ird->cur_range;
-		if(address != c->start + ird->cur_offset){
-			/* The address is the start
-			 *  plus the current offset (which points to END of current buffer)
-			 *  minus the amount of data in the buffer. */
-			uint32_t user_address = ird->cur_offset - ird->curlength;
-			if(!c->relative)
-				user_address += c->start;
-			c->ctx.cb(&c->ctx, user_address, ird->buffer, ird->curlength);
-			ird->cur_offset = 0;
-			ird->curlength = 0;
-			ird->cur_range = ird->range_count;
+	free(w->scratch);
+	return NULL;
+}
+
+static void ihpa_jobs_task(struct ihpa_worker* w, const struct ihpa_task* t)
+{
+	struct ihpa_pool* pool = w->pool;
+	const struct ihpa_job* job = pool->jobs + t->job;
+	struct ihpa_split* sp = t->split;
+	unsigned err = COUNT_IHP_ERR;
 
-			/* TODO optimization: if address is past this range,
-			 * find the next range. */
+	if(IHPA_TASK_PRESCAN == t->kind){
+		ihpa_prescan_worker(sp->chunks + t->piece);
+
+		/* The last piece padded starts the parse of all of them. */
+		if(__atomic_sub_fetch(&sp->pending, 1, __ATOMIC_ACQ_REL))
+			return;
+		sp->pending = sp->n;
+		__atomic_add_fetch(&pool->outstanding, sp->n, __ATOMIC_ACQ_REL);
+		for(unsigned i = 0; i < sp->n; ++i){
+			struct ihpa_task p = {.kind = IHPA_TASK_PARSE, .job = t->job, .split = sp, .piece = i};
+			ihpa_jobs_push(pool, w->id, &p);
 		}
+		return;
 	}
 
-	/* If no range defined, determine if this block intersects a range. */
-	if(ird->cur_range == ird->range_count){
-		/* Skip over all ranges that end before the beginning of this data */
-		unsigned idx = 0;
-		while(idx < ird->range_count &&
-			ird->ranges[idx].start + ird->ranges[idx].length <= address)
+	if(IHPA_TASK_PARSE == t->kind){
+		ihpa_populate_worker(sp->chunks + t->piece);
+		if(__atomic_sub_fetch(&sp->pending, 1, __ATOMIC_ACQ_REL))
+			return;
+
+		/* The last piece parsed completes the job. */
+		err = IHP_ERR_OK;
+		for(unsigned i = 0; i < sp->n && IHP_ERR_OK == err; ++i)
+			err = sp->chunks[i].err;
+		munmap(sp->map, sp->map_len);
+		fclose(sp->input);
+		free(sp);
+	}
+	else if(IHPA_JOB_RANGE == job->type){
+		FILE* input = fopen(job->path, "r");
+		uint8_t* mem = ihpa_jobs_scratch(w, ihpa_scratch_size(job->max));
+		if(input && mem)
+			err = ihpa_range_run_with(job->ranges, job->range_count, job->max, input, mem);
+		if(input)
+			fclose(input);
+	}
+	else{
+		FILE* input = fopen(job->path, "r");
+		struct stat st;
+		void* m = MAP_FAILED;
+		if(input && !fstat(fileno(input), &st) && S_ISREG(st.st_mode)
+			&& st.st_size > IHPA_JOBS_SPLIT && pool->n > 1)
 		{
-			++idx;
+			m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(input), 0);
 		}
 
-		/* If no range found, then just discard data. */
-		if(idx == ird->range_count)
-			return true;
+		unsigned n = MAP_FAILED != m ? st.st_size / IHPA_MT_MIN_SPAN : 0;
+		if(n > IHPA_JOBS_PIECES * pool->n)
+			n = IHPA_JOBS_PIECES * pool->n;
+		sp = n ? malloc(sizeof(*sp) + n * sizeof(struct ihpa_chunk)) : NULL;
 
-		/* If this range starts past the current window, then discard. */
-		__auto_type c = ird->ranges + idx;
-		if(c->start > address + len)
-			return true;
+		if(sp){
+			/* Split the file, unless it cannot be split safely. */
+			*sp = (struct ihpa_split){
+				.input = input
+				,.map = m
+				,.map_len = st.st_size
+				,.fill = {.max = job->img_len, .mem = job->img_mem}
+				,.pending = n
+				,.n = n
+			};
+			if(!ihpa_split(m, st.st_size, &sp->fill, job->pad, sp->chunks, n)){
+				free(sp);
+				sp = NULL;
+			}
+		}
+
+		if(sp){
+			/* Its pieces go to the own queue first, where idle workers
+			 * find them. */
+			__atomic_add_fetch(&pool->outstanding, n, __ATOMIC_ACQ_REL);
+			for(unsigned i = 0; i < n; ++i){
+				struct ihpa_task p = {.kind = IHPA_TASK_PRESCAN, .job = t->job, .split = sp, .piece = i};
+				ihpa_jobs_push(pool, w->id, &p);
+			}
+			return;
+		}
+
+		if(MAP_FAILED != m)
+			munmap(m, st.st_size);
 
-		/* Otherwise, this range must intersect the data window somewhere. */
-		ird->cur_range = idx;
-		ird->cur_offset = address - c->start;
-		ird->curlength = 0;
+		uint8_t* mem = ihpa_jobs_scratch(w, ihpa_scratch_size(0));
+		if(input && mem)
+			err = ihpa_populate_with(job->img_len, job->img_mem, job->pad, input, mem);
+		if(input)
+			fclose(input);
+	}
 
-		/* If the data window starts before the range,
-		 * discard the preceding bytes */
-		if(address < c->start){
-			unsigned diff = c->start - address;
-			address += diff;
-			len -= diff;
-			data += diff;
+	pool->status[t->job] = err;
+	if(err)
+		__atomic_add_fetch(&pool->failed, 1, __ATOMIC_RELAXED);
+}
+
+static void ihpa_jobs_push(struct ihpa_pool* pool, unsigned id, const struct ihpa_task* t)
+{
+	struct ihpa_deque* q = pool->queues + id;
+	pthread_mutex_lock(&q->lock);
+
+	/* Reclaim the space in front of the head before growing. */
+	if(q->tail == q->capacity && q->head){
+		memmove(q->tasks, q->tasks + q->head, (q->tail - q->head) * sizeof(*q->tasks));
+		q->tail -= q->head;
+		q->head = 0;
+	}
+	if(q->tail == q->capacity){
+		size_t cap = q->capacity ? 2 * q->capacity : 16;
+		struct ihpa_task* tasks = realloc(q->tasks, cap * sizeof(*tasks));
+		if(!tasks){
+			/* Out of memory: run it right away instead. */
+			pthread_mutex_unlock(&q->lock);
+			struct ihpa_worker w = {.pool = pool, .id = id};
+			ihpa_jobs_task(&w, t);
+			free(w.scratch);
+			ihpa_jobs_done(pool);
+			return;
 		}
+		q->tasks = tasks;
+		q->capacity = cap;
 	}
 
-	/* At this point we have a defined range, so append data to it. */
-	__auto_type c = ird->ranges + ird->cur_range;
-	unsigned append = len;
-
-	/* Check against the remaining data in the range. */
-	if(append > c->length - ird->cur_offset)
-		append = c->length - ird->cur_offset;
-
-	/* Check against remaining data in the buffer. */
-	if(append > ird->maxbuff - ird->curlength)
-		append = ird->maxbuff - ird->curlength;
-
-	memcpy(ird->buffer + ird->curlength, data, append);
-	ird->curlength += append;
-	ird->cur_offset += append;
-	data += append;
-	len -= append;
-	address += append;
-
-	/* If the buffer is full, 
-	 * OR the range is filled out, then flush. */
-	if(ird->curlength == ird->maxbuff || c->length == ird->cur_offset){
-		uint32_t user_address = ird->cur_offset - ird->curlength;
-		if(!c->relative)
-			user_address += c->start;
-		c->ctx.cb(&c->ctx, user_address, ird->buffer, ird->curlength);
-
-		/* Flushed the buffer, so reset the length */
-		ird->curlength = 0;
-
-		/* If we flushed because the range was finished out, reset
-		 * the range variables. */
+	q->tasks[q->tail++] = *t;
+	pthread_mutex_unlock(&q->lock);
+	ihpa_jobs_wake(pool);
+}
+
+/** @brief Count a task as finished, waking the idle workers to leave
+ *  after the last one. */
+static void ihpa_jobs_done(struct ihpa_pool* pool)
+{
+	if(!__atomic_sub_fetch(&pool->outstanding, 1, __ATOMIC_ACQ_REL))
+		ihpa_jobs_wake(pool);
+}
+
+static void ihpa_jobs_wake(struct ihpa_pool* pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	__atomic_add_fetch(&pool->wakeups, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/** @brief Take the newest task of the own queue, or else steal the
+ *  oldest task of another. */
+static bool ihpa_jobs_take(struct ihpa_pool* pool, unsigned id, struct ihpa_task* t)
+{
+	for(unsigned i = 0; i < pool->n; ++i){
+		struct ihpa_deque* q = pool->queues + (id + i) % pool->n;
+		pthread_mutex_lock(&q->lock);
+		bool found = q->head != q->tail;
+		if(found && !i)
+			*t = q->tasks[--q->tail];
+		else if(found)
+			*t = q->tasks[q->head++];
+		if(q->head == q->tail)
+			q->head = q->tail = 0;
+		pthread_mutex_unlock(&q->lock);
+
+		if(found)
+			return true;
+	}
+
+	return false;
+}
+
+/** @brief Scratch memory of at least len bytes, kept from job to job. */
+static uint8_t* ihpa_jobs_scratch(struct ihpa_worker* w, size_t len)
+{
+	if(len > w->scratch_len){
+		free(w->scratch);
+		w->scratch = malloc(len);
+		w->scratch_len = w->scratch ? len : 0;
+	}
+	return w->scratch;
+}
+
+static bool ihpa_range_cb(struct ihp_ctx* ctx, uint32_t address,
+	const uint8_t* data, size_t len)
+{
+	__auto_type ird = (struct ihpa_range_data*)ctx->user_data;
+
+	/* End of input: hand over whatever is still buffered.
+	 * On error, there is nothing more to do. */
+	if(!data)
+		return len ? true : ihpa_range_flush(ird);
+
+	while(len){
+		/* If there is a current range defined AND
+		 * If the start of this data does not coincide with
+		 * the end of the current range, then flush */
+		if(ird->cur_range < ird->range_count){
+			__auto_type c = ird->ranges + ird->cur_range;
+			if(address != c->start + ird->cur_offset && !ihpa_range_flush(ird))
+				return false;
+		}
+
+		/* If no range defined, determine if this block intersects a range. */
+		if(ird->cur_range == ird->range_count){
+			/* Skip over all ranges that end before the beginning of this data */
+			unsigned idx = ihpa_range_find(ird, address);
+
+			/* If no range found, then just discard data. */
+			if(idx == ird->range_count)
+				return true;
+
+			/* If this range starts past the current window, then discard. */
+			__auto_type c = ird->ranges + idx;
+			if(c->start >= (uint64_t)address + len)
+				return true;
+
+			/* If the data window starts before the range,
+			 * discard the preceding bytes */
+			if(address < c->start){
+				unsigned diff = c->start - address;
+				address += diff;
+				len -= diff;
+				data += diff;
+			}
+
+			ird->cur_range = idx;
+			ird->next_range = idx + 1;
+			ird->cur_offset = address - c->start;
+			ird->curlength = 0;
+		}
+
+		/* At this point we have a defined range, so append data to it,
+		 * up to the end of the range. */
+		__auto_type c = ird->ranges + ird->cur_range;
+		size_t left = c->length - ird->cur_offset;
+		size_t append = len < left ? len : left;
+
+		if(!ird->curlength && (append >= ird->maxbuff || append == left)){
+			/* Nothing is buffered and a full callback's worth is at hand,
+			 * so pass the caller's data straight through. */
+			if(append > ird->maxbuff)
+				append = ird->maxbuff;
+			ird->cur_offset += append;
+			if(!ihpa_range_emit(ird, data, append))
+				return false;
+		}
+		else{
+			/* Check against remaining data in the buffer. */
+			if(append > ird->maxbuff - ird->curlength)
+				append = ird->maxbuff - ird->curlength;
+
+			memcpy(ird->buffer + ird->curlength, data, append);
+			ird->curlength += append;
+			ird->cur_offset += append;
+
+			/* If the buffer is full,
+			 * OR the range is filled out, then flush. */
+			if(ird->curlength == ird->maxbuff || c->length == ird->cur_offset){
+				size_t n = ird->curlength;
+				ird->curlength = 0;
+				if(!ihpa_range_emit(ird, ird->buffer, n))
+					return false;
+			}
+		}
+
+		data += append;
+		len -= append;
+		address += append;
+
+		/* If the range was finished out, reset the range variables. */
 		if(c->length == ird->cur_offset){
 			ird->cur_offset = 0;
 			ird->cur_range = ird->range_count;
 		}
 	}
 
-	return ihpa_range_cb(ctx, address, data, len);
+	return true;
+}
+
+static bool ihpa_range_emit(struct ihpa_range_data* ird, const uint8_t* data, size_t len)
+{
+	/* The address is the start
+	 *  plus the current offset (which points to END of the data) minus
+	 *  the amount of data. */
+	__auto_type c = ird->ranges + ird->cur_range;
+	uint32_t user_address = ird->cur_offset - len;
+	if(c->digest)
+		ihpa_digest_add(c->digest, c->start + user_address, data, len);
+	if(!c->relative)
+		user_address += c->start;
+	if(ird->pipe)
+		return ihpa_pipe_put(ird->pipe, ird->cur_range, user_address, data, len);
+	return c->ctx.cb(&c->ctx, user_address, data, len);
+}
+
+static bool ihpa_range_flush(struct ihpa_range_data* ird)
+{
+	if(ird->cur_range == ird->range_count)
+		return true;
+
+	size_t n = ird->curlength;
+	bool ret = !n || ihpa_range_emit(ird, ird->buffer, n);
+	ird->cur_offset = 0;
+	ird->curlength = 0;
+	ird->cur_range = ird->range_count;
+	return ret;
+}
+
+static unsigned ihpa_range_find(struct ihpa_range_data* ird, uint32_t address)
+{
+	/* Ranges are sorted and disjoint, so their ends are sorted too. */
+	#define RANGE_END(i) ((uint64_t)ird->ranges[i].start + ird->ranges[i].length)
+
+	/* In-order input usually continues in the range after the last one
+	 * used, or past all ranges. */
+	unsigned idx = ird->next_range;
+	if(idx <= ird->range_count
+		&& (idx == ird->range_count || RANGE_END(idx) > address)
+		&& (idx == 0 || RANGE_END(idx - 1) <= address))
+	{
+		return idx;
+	}
+
+	/* Otherwise binary search for the first range ending past address. */
+	unsigned lo = 0;
+	unsigned hi = ird->range_count;
+	while(lo < hi){
+		unsigned mid = lo + (hi - lo) / 2;
+		if(RANGE_END(mid) <= address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	#undef RANGE_END
+	return lo;
 }
@@ -3,6 +3,60 @@
 
 #include "ihp.h"
 
+/** @brief Digests computed by struct ihpa_digest. */
+enum {
+	/** @brief CRC-32 as used by zlib and Ethernet. */
+	IHPA_DIGEST_CRC32 = 1
+
+	/** @brief SHA-256. */
+	,IHPA_DIGEST_SHA256 = 2
+};
+
+/** @brief Digest of an address span, computed as data streams past so the
+ *  data never has to be held anywhere. Bytes of the span without data
+ *  count as the pad byte, so the result equals the digest of that span
+ *  of a padded image. Data outside the span is ignored. */
+struct ihpa_digest {
+	/** @brief IHPA_DIGEST_* to compute. */
+	unsigned kinds;
+
+	/** @brief Results, set by ihpa_digest_final. */
+	uint32_t crc32;
+	uint8_t sha256[32];
+
+	/** @brief False once data arrived for an address already digested,
+	 *  which a single pass cannot take back; there are no results then. */
+	bool valid;
+
+	/** @brief Span and pad byte. */
+	uint32_t start;
+	uint64_t end;
+	uint8_t pad;
+
+	/** @brief Address digested up to. */
+	uint64_t next;
+
+	uint32_t crc;
+	uint32_t state[8];
+	uint8_t block[64];
+	uint64_t total;
+};
+
+/** @brief Start a digest of length bytes from start.
+ *  @param kinds IHPA_DIGEST_* to compute. */
+void ihpa_digest_init(struct ihpa_digest* d, unsigned kinds, uint32_t start, size_t length, uint8_t pad);
+
+/** @brief Digest data, padding any gap since the previous data.
+ *  @return false if the digest is no longer valid. */
+bool ihpa_digest_add(struct ihpa_digest* d, uint32_t address, const uint8_t* data, size_t len);
+
+/** @brief Pad to the end of the span and set the results, if valid. */
+void ihpa_digest_final(struct ihpa_digest* d);
+
+/** @brief ihp_cb feeding the digest in ctx->user_data; the final callback
+ *  of a successful parse completes it. */
+bool ihpa_digest_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len);
+
 struct ihpa_range {
 	/** @brief  */
 	struct ihp_ctx ctx;
@@ -15,12 +69,398 @@ struct ihpa_range {
 
 	/** @brief If true, call cb with an address relative to the start. */
 	bool relative;
+
+	/** @brief If set, fed all data passed to cb, by absolute address,
+	 *  and completed at the end of a successful run. The caller
+	 *  initializes it, usually over the span of the range. */
+	struct ihpa_digest* digest;
 };
 
-/** @brief . */
+/** @brief Parse input and dispatch the data within each range to its callback.
+ *  Each call passes at most max bytes. Data is passed straight from the
+ *  parser where it can be; it is only copied to join pieces that are
+ *  smaller than max.
+ *  @param ranges Ranges sorted by start and not overlapping.
+ *  @return Error status IHP_ERR_*; IHP_ERR_USER_ABORT if a range callback
+ *   returned false; COUNT_IHP_ERR if the ranges are invalid. */
 unsigned ihpa_range_run(struct ihpa_range* ranges, unsigned range_count, size_t max, FILE* input);
 
+/** @brief Calculate RAM required as scratch for ihpa_range_run_with with
+ *  buffer size max, or for ihpa_populate_with when max is 0. */
+size_t ihpa_scratch_size(size_t max);
+
+/** @brief ihpa_range_run in caller memory, for calling in a loop without
+ *  allocating or using much stack.
+ *  @param input Not closed by this; the caller still owns it.
+ *  @param scratch Pointer to raw memory of at least size ihpa_scratch_size(max),
+ *   16 byte aligned; reused from call to call. */
+unsigned ihpa_range_run_with(struct ihpa_range* ranges, unsigned range_count, size_t max,
+	FILE* input, uint8_t* scratch);
+
+/** @brief ihpa_range_run with the range callbacks run on consumer threads,
+ *  so slow callbacks, such as those programming a device, overlap parsing.
+ *  The parser copies data into a ring of depth buffers of max bytes per
+ *  consumer and waits while that ring is full. Each range is served by
+ *  one consumer, so its calls keep their order; callbacks of ranges
+ *  served by different consumers run concurrently. Digests are fed by
+ *  the parser. Runs synchronously if threads cannot be started.
+ *  @param depth Buffers per consumer, rounded up to a power of 2; 0 for 8.
+ *  @param consumers Number of consumer threads; 0 for 1, at most range_count.
+ *  @return As ihpa_range_run; data already queued when a callback returns
+ *   false is dropped. */
+unsigned ihpa_range_run_async(struct ihpa_range* ranges, unsigned range_count, size_t max,
+	FILE* input, unsigned depth, unsigned consumers);
+
+/** @brief Kind of work of a struct ihpa_job. */
+enum {
+	/** @brief ihpa_populate into img_mem. */
+	IHPA_JOB_POPULATE
+
+	/** @brief ihpa_range_run over ranges. */
+	,IHPA_JOB_RANGE
+};
+
+/** @brief One independent job of ihpa_jobs_run. */
+struct ihpa_job {
+	/** @brief IHPA_JOB_* */
+	unsigned type;
+
+	/** @brief Path of the hex file. */
+	const char* path;
+
+	/** @brief IHPA_JOB_POPULATE: image and pad byte. */
+	size_t img_len;
+	uint8_t* img_mem;
+	uint8_t pad;
+
+	/** @brief IHPA_JOB_RANGE: ranges and callback buffer size. */
+	struct ihpa_range* ranges;
+	unsigned range_count;
+	size_t max;
+};
+
+/** @brief Run independent jobs on a work stealing pool of threads.
+ *  Each worker takes jobs from its own queue and reuses its own scratch
+ *  memory for parser contexts; a worker with nothing left steals the
+ *  oldest job of another. Populate jobs of files over 4M are split into
+ *  pieces like ihpa_populate_mt does, so that any idle worker can help
+ *  with a large image. Range jobs are never split, as their callbacks
+ *  must see the data in order.
+ *  @param status Set to the error status IHP_ERR_* of each job;
+ *   COUNT_IHP_ERR if its file cannot be opened or its ranges are invalid.
+ *  @param threads Number of workers, including the calling thread;
+ *   0 uses one per online CPU.
+ *  @return Number of jobs that failed. */
+size_t ihpa_jobs_run(const struct ihpa_job* jobs, size_t count, unsigned* status, unsigned threads);
+
+/** @brief Opaque type for the page stage;
+ * ACTUAL SIZE OF THE STRUCT MUST BE CALCULATED at run time. */
+struct ihpa_pages;
+
+/** @brief Calculate RAM required for a page stage holding up to slots
+ *  pages of page bytes at a time. */
+size_t ihpa_pages_size(size_t page, unsigned slots);
+
+/** @brief Initialize a stage that turns a data stream into whole, aligned
+ *  pages for out->cb. Data for the same page is merged, whatever order it
+ *  arrives in, as long as the page is still held; when all slots are in
+ *  use the lowest page is passed on to make room. Data arriving for a page
+ *  after that starts it over, so it is passed on again holding only the
+ *  new data; use enough slots to cover how far out of order the input is.
+ *  Bytes without data are fill, and pages that are entirely fill are not
+ *  passed on at all.
+ *  The final callback is passed on after the remaining pages.
+ *  Install it by setting ctx->cb to ihpa_pages_cb and ctx->user_data to
+ *  the stage.
+ *  @param mem Pointer to raw memory of at least size ihpa_pages_size(page, slots)
+ *  @return pointer to initialized mem, or NULL if page or slots is 0. */
+struct ihpa_pages* ihpa_pages_init(uint8_t* mem, size_t page, unsigned slots,
+	uint8_t fill, struct ihp_ctx* out);
+
+/** @brief ihp_cb feeding the page stage in ctx->user_data. */
+bool ihpa_pages_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len);
+
+/** @brief Parse input through a page stage into out->cb.
+ *  @return Error status IHP_ERR_*; IHP_ERR_USER_ABORT if out->cb returned
+ *   false, including for the pages passed on at the end. */
+unsigned ihpa_pages_run(size_t page, unsigned slots, uint8_t fill,
+	struct ihp_ctx* out, FILE* input);
+
+/** @brief Opaque type for the coalescing stage;
+ * ACTUAL SIZE OF THE STRUCT MUST BE CALCULATED at run time. */
+struct ihpa_coalesce;
+
+/** @brief Calculate RAM required for a coalescing stage holding up to
+ *  limit bytes of data and piece bookkeeping; it is about twice limit. */
+size_t ihpa_coalesce_size(size_t limit);
+
+/** @brief Initialize a stage that collects a data stream and passes it on
+ *  to out->cb as maximal contiguous segments in ascending address order,
+ *  however the records were ordered or split. Where data overlaps, the
+ *  data that arrived last wins, as it would without the stage.
+ *  When limit is reached, everything held so far is passed on and
+ *  collecting starts over, so the order is then only ascending within
+ *  each batch; data bigger than the limit on its own is passed straight on.
+ *  The final callback is passed on after the remaining segments; on error
+ *  the segments held are dropped.
+ *  Install it by setting ctx->cb to ihpa_coalesce_cb and ctx->user_data to
+ *  the stage.
+ *  @param mem Pointer to raw memory of at least size ihpa_coalesce_size(limit),
+ *   aligned as by malloc
+ *  @return pointer to initialized mem, or NULL if limit is too small. */
+struct ihpa_coalesce* ihpa_coalesce_init(uint8_t* mem, size_t limit, struct ihp_ctx* out);
+
+/** @brief ihp_cb feeding the coalescing stage in ctx->user_data. */
+bool ihpa_coalesce_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len);
+
+/** @brief Parse input through a coalescing stage into out->cb.
+ *  @return Error status IHP_ERR_*; IHP_ERR_USER_ABORT if out->cb returned
+ *   false, including for the segments passed on at the end. */
+unsigned ihpa_coalesce_run(size_t limit, struct ihp_ctx* out, FILE* input);
+
 /** @brief Populate an area of RAM with the hex file contents. */
 unsigned ihpa_populate(size_t img_len, uint8_t* img_mem, uint8_t pad, FILE* input);
 
+/** @brief ihpa_populate in caller memory.
+ *  @param input Not closed by this; the caller still owns it.
+ *  @param scratch Pointer to raw memory of at least size ihpa_scratch_size(0),
+ *   16 byte aligned; reused from call to call. */
+unsigned ihpa_populate_with(size_t img_len, uint8_t* img_mem, uint8_t pad, FILE* input,
+	uint8_t* scratch);
+
+/** @brief Populate a file with the hex file contents of an image window,
+ *  writing it through a shared mapping instead of RAM of its own.
+ *  A regular file is resized to img_len bytes, which leaves it untouched
+ *  if that fails; other files must already be big enough. Byte i holds
+ *  address base + i. Only the bytes no data was written to are padded
+ *  afterwards, so each byte is written once; with pad 0, bytes past the
+ *  old end of a regular file are not padded, as they already read as 0.
+ *  @param fd Output file, opened for reading and writing; not closed.
+ *  @return Error status IHP_ERR_*; IHP_ERR_USER_ABORT if data falls
+ *   outside the window; COUNT_IHP_ERR if the file cannot be sized or
+ *   mapped. */
+unsigned ihpa_populate_file(uint32_t base, size_t img_len, uint8_t pad, FILE* input, int fd);
+
+/** @brief ihpa_populate, also computing a digest of a span of the image
+ *  while the data is copied in. If data arrives out of address order,
+ *  the span is digested from the finished image instead.
+ *  @param d Initialized with ihpa_digest_init; complete if the result
+ *   is IHP_ERR_OK. */
+unsigned ihpa_populate_digest(size_t img_len, uint8_t* img_mem, uint8_t pad, FILE* input,
+	struct ihpa_digest* d);
+
+/** @brief Populate an area of RAM with the hex file contents using threads.
+ *  The file is mapped and split at record boundaries; each thread pads its
+ *  share of the image and parses one piece, starting from the base address
+ *  set by the last type 02/04 record before it.
+ *  Falls back to ihpa_populate if input is not a regular file, or if a
+ *  split point does not start a line.
+ *  If records overlap across pieces, which of them ends up in the image
+ *  is unspecified.
+ *  @param threads Number of threads; 0 uses one per online CPU. */
+unsigned ihpa_populate_mt(size_t img_len, uint8_t* img_mem, uint8_t pad, FILE* input, unsigned threads);
+
+/** @brief Contiguous block of data in a sparse image. */
+struct ihpa_extent {
+	/** @brief Address of the first byte. */
+	uint32_t start;
+
+	/** @brief Number of bytes. */
+	size_t length;
+
+	/** @brief Allocated size of data. */
+	size_t capacity;
+
+	uint8_t* data;
+};
+
+/** @brief Image holding only the bytes present in a hex file,
+ *  so memory scales with the payload rather than the address span.
+ *  Extents are sorted by address and never touch or overlap;
+ *  blocks that meet are merged as they are added. */
+struct ihpa_sparse {
+	struct ihpa_extent* extents;
+
+	/** @brief Number of extents. */
+	size_t count;
+
+	/** @brief Allocated number of extents. */
+	size_t capacity;
+};
+
+/** @brief Initialize an empty sparse image. */
+void ihpa_sparse_init(struct ihpa_sparse* img);
+
+/** @brief Release all memory of a sparse image, leaving it empty. */
+void ihpa_sparse_free(struct ihpa_sparse* img);
+
+/** @brief Add a block of data; it replaces any data already at its addresses.
+ *  @return false if out of memory. */
+bool ihpa_sparse_add(struct ihpa_sparse* img, uint32_t address, const uint8_t* data, size_t len);
+
+/** @brief Add the contents of a hex file to a sparse image.
+ *  @return Error status IHP_ERR_*; IHP_ERR_USER_ABORT if out of memory. */
+unsigned ihpa_sparse_populate(struct ihpa_sparse* img, FILE* input);
+
+/** @brief Find the extent holding address.
+ *  @return The extent, or NULL if address holds no data. */
+const struct ihpa_extent* ihpa_sparse_find(const struct ihpa_sparse* img, uint32_t address);
+
+/** @brief Copy len bytes starting at address, padding where there is no data.
+ *  @return Number of bytes that held data. */
+size_t ihpa_sparse_read(const struct ihpa_sparse* img, uint32_t address,
+	uint8_t* dest, size_t len, uint8_t pad);
+
+/** @brief Pass every extent, in address order, to ctx->cb.
+ *  @return false if the callback aborted. */
+bool ihpa_sparse_iterate(const struct ihpa_sparse* img, struct ihp_ctx* ctx);
+
+/** @brief Export to a flat image covering img_len bytes from address base,
+ *  as ihpa_populate would have produced.
+ *  @return Number of bytes that held data. */
+size_t ihpa_sparse_flatten(const struct ihpa_sparse* img, uint32_t base,
+	size_t img_len, uint8_t* img_mem, uint8_t pad);
+
+/** @brief What a merge does where inputs hold different data
+ *  for the same address. */
+enum {
+	/** @brief Fail with IHPA_ERR_OVERLAP. */
+	IHPA_MERGE_ERROR
+
+	/** @brief Keep the data of the earliest input. */
+	,IHPA_MERGE_FIRST_WINS
+
+	/** @brief Keep the data of the latest input, as calling ihpa_populate
+	 *  once per input would. */
+	,IHPA_MERGE_LAST_WINS
+};
+
+enum {
+	/** @brief Merge inputs conflict and the policy is IHPA_MERGE_ERROR. */
+	IHPA_ERR_OVERLAP = COUNT_IHP_ERR + 1
+};
+
+/** @brief Addresses where two merge inputs hold different data. */
+struct ihpa_overlap {
+	uint32_t start;
+	size_t length;
+
+	/** @brief Indices of the two inputs, first < second. */
+	unsigned first;
+	unsigned second;
+};
+
+/** @brief Options and results of a merge. */
+struct ihpa_merge {
+	/** @brief IHPA_MERGE_* policy. */
+	unsigned policy;
+
+	/** @brief Where to store conflicts; may be NULL. */
+	struct ihpa_overlap* overlaps;
+
+	/** @brief Number of entries overlaps can hold. */
+	size_t overlap_max;
+
+	/** @brief Set to the number of conflicts found,
+	 *  which may be more than overlap_max. */
+	size_t overlap_count;
+
+	/** @brief Set to the index of the first input that failed to parse,
+	 *  or to the input count if none did. */
+	unsigned failed;
+};
+
+/** @brief Parse several hex files concurrently, one thread each, and merge
+ *  them into a sparse image. Wherever two inputs both hold data and it
+ *  differs, each run of differing bytes is reported in m whatever the
+ *  policy; identical data is not a conflict. Every input is closed.
+ *  @param img Sparse image to fill; must be empty.
+ *  @return Error status IHP_ERR_* of the first input that failed,
+ *   IHP_ERR_USER_ABORT if out of memory, or IHPA_ERR_OVERLAP. */
+unsigned ihpa_merge_sparse(struct ihpa_sparse* img, FILE* const* inputs, unsigned count,
+	struct ihpa_merge* m);
+
+/** @brief Merge several hex files as ihpa_merge_sparse does, into a flat
+ *  image of img_len bytes from address 0 padded with pad.
+ *  @return As ihpa_merge_sparse; IHP_ERR_USER_ABORT if data lies beyond
+ *   img_len, as ihpa_populate. */
+unsigned ihpa_merge_populate(size_t img_len, uint8_t* img_mem, uint8_t pad,
+	FILE* const* inputs, unsigned count, struct ihpa_merge* m);
+
+/** @brief Pass the data of new_input that differs from old_input to
+ *  ctx->cb, so that only what changed needs to be programmed.
+ *  Addresses without data in old_input compare as pad, the value of erased
+ *  memory; data only in old_input is not reported.
+ *  The final callback reports the end or the error as ihp_run does.
+ *  Both inputs are closed.
+ *  @param page 0 to report exact ranges of changed bytes; otherwise every
+ *   page aligned to a multiple of page that holds a change is passed whole,
+ *   with new data laid over the old contents, as needed to rewrite it
+ *   after an erase.
+ *  @return Error status IHP_ERR_* of either input; IHP_ERR_USER_ABORT if
+ *   the callback returned false or out of memory. */
+unsigned ihpa_diff(FILE* old_input, FILE* new_input, size_t page, uint8_t pad,
+	struct ihp_ctx* ctx);
+
+/** @brief As ihpa_diff, but against a binary image such as a readback of
+ *  the device, holding old_len bytes from address base. */
+unsigned ihpa_diff_binary(const uint8_t* old_img, size_t old_len, uint32_t base,
+	FILE* new_input, size_t page, uint8_t pad, struct ihp_ctx* ctx);
+
+/** @brief Parsed image loaded from a cache file.
+ *  The cache file holds a header keyed on the size, modification time and
+ *  a hash of the source hex file, a sorted extent table and the raw data;
+ *  it is mapped, so loading it decodes nothing. */
+struct ihpa_cache {
+	/** @brief The image, usable with the read only ihpa_sparse functions,
+	 *  e.g. ihpa_sparse_iterate to serve callbacks. It must not be
+	 *  modified or freed other than by ihpa_cache_close. */
+	struct ihpa_sparse img;
+
+	/** @brief Mapping of the cache file, if the image is served from it. */
+	void* map;
+	size_t map_len;
+};
+
+/** @brief Load a hex file through a cache file.
+ *  If cache_path is a cache of the current contents of hex_path it is
+ *  mapped; otherwise hex_path is parsed and cache_path is (re)written for
+ *  next time. The source is hashed only if its size matches the cache but
+ *  its modification time does not. If the cache cannot be written, the
+ *  parsed image is used from memory.
+ *  @return Error status IHP_ERR_* of parsing; IHP_ERR_USER_ABORT if out of
+ *   memory; COUNT_IHP_ERR if hex_path cannot be opened. */
+unsigned ihpa_cache_open(struct ihpa_cache* c, const char* hex_path, const char* cache_path);
+
+/** @brief Release a cached image. */
+void ihpa_cache_close(struct ihpa_cache* c);
+
+/** @brief One file of a batch. */
+struct ihpa_batch_job {
+	/** @brief Path of the hex file. */
+	const char* path;
+
+	/** @brief Callback and user_data for the data of the file; the callback
+	 *  is passed the parser's context, holding the same user_data.
+	 *  Its final callback reports the end of the file or the error,
+	 *  as ihp_run does. */
+	struct ihp_ctx ctx;
+
+	/** @brief Set to the error status IHP_ERR_* of the file;
+	 *  COUNT_IHP_ERR if it could not be read. */
+	unsigned err;
+};
+
+/** @brief Parse many files, overlapping reading with parsing.
+ *  depth reader threads load whole files into reusable buffers with plain
+ *  open/read, while `threads` parser threads parse loaded files in place.
+ *  Callbacks of different jobs may run concurrently, and jobs complete in
+ *  no particular order.
+ *  @param max Maximum amount of data to pass in a callback call
+ *  @param threads Number of parser threads; 0 uses one per online CPU.
+ *  @param depth Number of files read ahead concurrently; 0 uses 4.
+ *  @return Number of jobs that failed. */
+size_t ihpa_batch_run(struct ihpa_batch_job* jobs, size_t count, size_t max,
+	unsigned threads, unsigned depth);
+
 #endif
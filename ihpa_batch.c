@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ihpa.h"
+
+/** @brief Buffer holding one loaded file; reused from file to file. */
+struct ihpa_batch_slot {
+	struct ihpa_batch_slot* next;
+
+	/** @brief Index of the job loaded. */
+	size_t job;
+
+	/** @brief False if the file could not be read. */
+	bool ok;
+
+	char* buf;
+	size_t len;
+	size_t capacity;
+};
+
+struct ihpa_batch {
+	struct ihpa_batch_job* jobs;
+	size_t count;
+	size_t max;
+
+	pthread_mutex_t lock;
+
+	/** @brief Signalled when a slot is freed or loaded,
+	 *  and when the readers are done. */
+	pthread_cond_t cond;
+
+	/** @brief Next job to load. */
+	size_t next_job;
+
+	/** @brief Readers still running. */
+	unsigned readers;
+
+	/** @brief Slots waiting to be loaded. */
+	struct ihpa_batch_slot* free;
+
+	/** @brief Loaded slots waiting to be parsed, oldest first. */
+	struct ihpa_batch_slot* ready;
+	struct ihpa_batch_slot* ready_tail;
+
+	size_t failed;
+};
+
+static void* ihpa_batch_reader(void* arg);
+
+static void* ihpa_batch_parser(void* arg);
+
+static bool ihpa_batch_load(struct ihpa_batch_slot* s, const char* path);
+
+size_t ihpa_batch_run(struct ihpa_batch_job* jobs, size_t count, size_t max,
+	unsigned threads, unsigned depth)
+{
+	if(!threads)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(!depth)
+		depth = 4;
+
+	/* Enough slots for every reader to load while every parser parses. */
+	unsigned slot_count = depth + threads;
+	struct ihpa_batch_slot slots[slot_count];
+	memset(slots, 0, sizeof(slots));
+	for(unsigned i = 0; i + 1 < slot_count; ++i)
+		slots[i].next = slots + i + 1;
+
+	struct ihpa_batch b = {
+		.jobs = jobs
+		,.count = count
+		,.max = max
+		,.readers = depth
+		,.free = slots
+	};
+	pthread_mutex_init(&b.lock, NULL);
+	pthread_cond_init(&b.cond, NULL);
+
+	/* Parsers load files themselves once no readers are left, so the
+	 * batch completes whatever threads could be started; if none, the
+	 * calling thread does it all. */
+	pthread_t tids[depth + threads];
+	bool started[depth + threads];
+	unsigned running = 0;
+	for(unsigned i = 0; i < depth; ++i){
+		started[i] = !pthread_create(tids + i, NULL, ihpa_batch_reader, &b);
+		running += !started[i];
+	}
+
+	pthread_mutex_lock(&b.lock);
+	b.readers -= running;
+	pthread_mutex_unlock(&b.lock);
+
+	running = 0;
+	for(unsigned i = depth; i < depth + threads; ++i){
+		started[i] = !pthread_create(tids + i, NULL, ihpa_batch_parser, &b);
+		running += started[i];
+	}
+	if(!running)
+		ihpa_batch_parser(&b);
+
+	for(unsigned i = 0; i < depth + threads; ++i){
+		if(started[i])
+			pthread_join(tids[i], NULL);
+	}
+
+	for(unsigned i = 0; i < slot_count; ++i)
+		free(slots[i].buf);
+	pthread_cond_destroy(&b.cond);
+	pthread_mutex_destroy(&b.lock);
+	return b.failed;
+}
+
+/* Internal functions. */
+
+static void* ihpa_batch_reader(void* arg)
+{
+	struct ihpa_batch* b = arg;
+
+	pthread_mutex_lock(&b->lock);
+	for(;;){
+		while(b->next_job < b->count && !b->free)
+			pthread_cond_wait(&b->cond, &b->lock);
+		if(b->next_job == b->count)
+			break;
+
+		struct ihpa_batch_slot* s = b->free;
+		b->free = s->next;
+		s->job = b->next_job++;
+		pthread_mutex_unlock(&b->lock);
+
+		s->ok = ihpa_batch_load(s, b->jobs[s->job].path);
+
+		pthread_mutex_lock(&b->lock);
+		s->next = NULL;
+		if(b->ready)
+			b->ready_tail->next = s;
+		else
+			b->ready = s;
+		b->ready_tail = s;
+		pthread_cond_broadcast(&b->cond);
+	}
+
+	--b->readers;
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+	return NULL;
+}
+
+static void* ihpa_batch_parser(void* arg)
+{
+	struct ihpa_batch* b = arg;
+	uint8_t* mem = malloc(ihp_size(b->max));
+
+	pthread_mutex_lock(&b->lock);
+	for(;;){
+		while(!b->ready && (b->readers || (b->next_job < b->count && !b->free)))
+			pthread_cond_wait(&b->cond, &b->lock);
+
+		/* Take a loaded file; with no readers left, load the next one here. */
+		struct ihpa_batch_slot* s = b->ready;
+		bool load = false;
+		if(s){
+			b->ready = s->next;
+		}
+		else if(b->next_job < b->count){
+			s = b->free;
+			b->free = s->next;
+			s->job = b->next_job++;
+			load = true;
+		}
+		else{
+			break;
+		}
+		pthread_mutex_unlock(&b->lock);
+
+		if(load)
+			s->ok = ihpa_batch_load(s, b->jobs[s->job].path);
+
+		struct ihpa_batch_job* job = b->jobs + s->job;
+		unsigned err = COUNT_IHP_ERR;
+		if(s->ok && mem){
+			struct ihp_ctx* ic = ihp_mem(mem, b->max, s->buf, s->len);
+			ic->user_data = job->ctx.user_data;
+			ic->cb = job->ctx.cb;
+			err = ihp_run(ic);
+			ihp_destroy(ic);
+		}
+		else{
+			job->ctx.cb(&job->ctx, 0, NULL, err);
+		}
+		job->err = err;
+
+		pthread_mutex_lock(&b->lock);
+		if(err)
+			++b->failed;
+		s->next = b->free;
+		b->free = s;
+		pthread_cond_broadcast(&b->cond);
+	}
+
+	pthread_mutex_unlock(&b->lock);
+	free(mem);
+	return NULL;
+}
+
+/** @brief Read the whole file at path into the slot buffer. */
+static bool ihpa_batch_load(struct ihpa_batch_slot* s, const char* path)
+{
+	s->len = 0;
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return false;
+
+	/* The size is only a hint; read until the end either way. */
+	struct stat st;
+	size_t want = !fstat(fd, &st) && st.st_size > 0 ? st.st_size + 1 : 4096;
+	bool ok = true;
+	for(;;){
+		if(s->capacity - s->len < want){
+			char* buf = realloc(s->buf, s->len + want);
+			if(!buf){
+				ok = false;
+				break;
+			}
+			s->buf = buf;
+			s->capacity = s->len + want;
+		}
+
+		ssize_t got = read(fd, s->buf + s->len, s->capacity - s->len);
+		if(got <= 0){
+			ok = !got;
+			break;
+		}
+		s->len += got;
+
+		/* Grow only once the buffer is full. */
+		want = s->capacity == s->len ? s->len : 1;
+	}
+
+	close(fd);
+	return ok;
+}
@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ihpa.h"
+
+/* A cache file is, in host byte order:
+ *
+ *   header
+ *   extent_count extent entries, sorted by start
+ *   data of each extent at its offset, 8 byte aligned
+ *
+ * */
+
+#define IHPA_CACHE_MAGIC "IHPC"
+#define IHPA_CACHE_VERSION 2
+
+struct ihpa_cache_header {
+	char magic[4];
+	uint32_t version;
+
+	/** @brief Key of the source hex file. */
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t source_hash;
+
+	uint64_t extent_count;
+
+	/** @brief Size of the whole cache file. */
+	uint64_t file_size;
+};
+
+struct ihpa_cache_extent {
+	uint32_t start;
+	uint32_t reserved;
+	uint64_t length;
+
+	/** @brief Offset of the data from the start of the file. */
+	uint64_t offset;
+};
+
+/** @brief What identifies the contents of the source. */
+struct ihpa_cache_key {
+	int fd;
+	uint64_t size;
+
+	/** @brief Modification time in nanoseconds. */
+	int64_t mtime;
+
+	/** @brief CRC-32 of the contents; only computed when needed. */
+	uint64_t hash;
+	bool hashed;
+
+	/** @brief False if the contents could not be hashed. */
+	bool hash_ok;
+};
+
+static bool ihpa_cache_map(struct ihpa_cache* c, const char* cache_path, struct ihpa_cache_key* key);
+
+static bool ihpa_cache_write(const struct ihpa_sparse* img, const char* cache_path,
+	struct ihpa_cache_key* key);
+
+static bool ihpa_cache_hash(struct ihpa_cache_key* key);
+
+static bool ihpa_cache_touch(const char* cache_path, const struct ihpa_cache_key* key,
+	const void* map, size_t len);
+
+static FILE* ihpa_cache_create(const char* cache_path, char* tmp, size_t tmp_len);
+
+static bool ihpa_cache_commit(FILE* f, const char* tmp, const char* cache_path, bool ok);
+
+unsigned ihpa_cache_open(struct ihpa_cache* c, const char* hex_path, const char* cache_path)
+{
+	memset(c, 0, sizeof(*c));
+	ihpa_sparse_init(&c->img);
+
+	FILE* input = fopen(hex_path, "r");
+	struct stat st;
+	if(!input)
+		return COUNT_IHP_ERR;
+
+	/* Only regular files have a meaningful key. */
+	if(fstat(fileno(input), &st) < 0 || !S_ISREG(st.st_mode)){
+		unsigned err = ihpa_sparse_populate(&c->img, input);
+		if(IHP_ERR_OK != err)
+			ihpa_sparse_free(&c->img);
+		return err;
+	}
+
+	struct ihpa_cache_key key = {
+		.fd = fileno(input)
+		,.size = st.st_size
+		,.mtime = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec
+	};
+	if(ihpa_cache_map(c, cache_path, &key)){
+		fclose(input);
+		return IHP_ERR_OK;
+	}
+
+	/* Key the new cache before parsing closes the input. */
+	bool keyed = ihpa_cache_hash(&key);
+	unsigned err = ihpa_sparse_populate(&c->img, input);
+	if(IHP_ERR_OK != err){
+		ihpa_sparse_free(&c->img);
+		return err;
+	}
+
+	/* Serve the image from the new cache, so it is paged like any other
+	 * load; if that fails, keep it in memory. */
+	key.fd = -1;
+	struct ihpa_cache m;
+	if(keyed && ihpa_cache_write(&c->img, cache_path, &key) && ihpa_cache_map(&m, cache_path, &key)){
+		ihpa_sparse_free(&c->img);
+		*c = m;
+	}
+
+	return IHP_ERR_OK;
+}
+
+void ihpa_cache_close(struct ihpa_cache* c)
+{
+	if(c->map){
+		/* The extent data lives in the mapping. */
+		free(c->img.extents);
+		munmap(c->map, c->map_len);
+		ihpa_sparse_init(&c->img);
+	}
+	else{
+		ihpa_sparse_free(&c->img);
+	}
+
+	c->map = NULL;
+	c->map_len = 0;
+}
+
+/* Internal functions. */
+
+/** @brief Map cache_path if it is intact and matches key. */
+static bool ihpa_cache_map(struct ihpa_cache* c, const char* cache_path, struct ihpa_cache_key* key)
+{
+	int fd = open(cache_path, O_RDONLY);
+	if(fd < 0)
+		return false;
+
+	struct stat st;
+	void* m = MAP_FAILED;
+	if(!fstat(fd, &st) && (size_t)st.st_size >= sizeof(struct ihpa_cache_header))
+		m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(MAP_FAILED == m)
+		return false;
+
+	size_t len = st.st_size;
+	const struct ihpa_cache_header* h = m;
+	const struct ihpa_cache_extent* table = (const struct ihpa_cache_extent*)(h + 1);
+
+	/* The header must describe this file; the source must be unchanged,
+	 * which only takes hashing if it was touched without resizing. */
+	bool ok = !memcmp(h->magic, IHPA_CACHE_MAGIC, 4)
+		&& IHPA_CACHE_VERSION == h->version
+		&& h->file_size == len
+		&& h->extent_count <= (len - sizeof(*h)) / sizeof(*table)
+		&& h->source_size == key->size
+		&& (h->source_mtime == key->mtime || (ihpa_cache_hash(key) && h->source_hash == key->hash));
+
+	struct ihpa_extent* extents = NULL;
+	if(ok && h->extent_count){
+		extents = malloc(h->extent_count * sizeof(*extents));
+		ok = extents;
+	}
+
+	/* Do not trust the table to be sorted or in bounds. */
+	uint64_t prev_end = 0;
+	for(size_t i = 0; ok && i < h->extent_count; ++i){
+		const struct ihpa_cache_extent* e = table + i;
+		ok = e->length && e->start >= prev_end
+			&& e->offset <= len && e->length <= len - e->offset;
+		prev_end = (uint64_t)e->start + e->length;
+
+		extents[i] = (struct ihpa_extent){
+			.start = e->start
+			,.length = e->length
+			,.capacity = e->length
+			,.data = (uint8_t*)m + e->offset
+		};
+	}
+
+	if(!ok){
+		free(extents);
+		munmap(m, len);
+		return false;
+	}
+
+	/* Touched but unchanged: record the new time, so the next open does
+	 * not hash the source again. */
+	if(h->source_mtime != key->mtime)
+		ihpa_cache_touch(cache_path, key, m, len);
+
+	c->img.extents = extents;
+	c->img.count = c->img.capacity = h->extent_count;
+	c->map = m;
+	c->map_len = len;
+	return true;
+}
+
+/** @brief Rewrite the verified cache in map with the new source mtime,
+ *  replacing cache_path in one step like ihpa_cache_write, so a reader
+ *  never sees a header being changed. Failing is harmless; the source is
+ *  just hashed again next time. */
+static bool ihpa_cache_touch(const char* cache_path, const struct ihpa_cache_key* key,
+	const void* map, size_t len)
+{
+	char tmp[strlen(cache_path) + 32];
+	FILE* f = ihpa_cache_create(cache_path, tmp, sizeof(tmp));
+	if(!f)
+		return false;
+
+	struct ihpa_cache_header h;
+	memcpy(&h, map, sizeof(h));
+	h.source_mtime = key->mtime;
+	bool ok = 1 == fwrite(&h, sizeof(h), 1, f)
+		&& fwrite((const uint8_t*)map + sizeof(h), 1, len - sizeof(h), f) == len - sizeof(h);
+	return ihpa_cache_commit(f, tmp, cache_path, ok);
+}
+
+/** @brief Write a cache of img, replacing cache_path in one step. */
+static bool ihpa_cache_write(const struct ihpa_sparse* img, const char* cache_path,
+	struct ihpa_cache_key* key)
+{
+	char tmp[strlen(cache_path) + 32];
+	FILE* f = ihpa_cache_create(cache_path, tmp, sizeof(tmp));
+	if(!f)
+		return false;
+
+	struct ihpa_cache_header h = {
+		.magic = IHPA_CACHE_MAGIC
+		,.version = IHPA_CACHE_VERSION
+		,.source_size = key->size
+		,.source_mtime = key->mtime
+		,.source_hash = key->hash
+		,.extent_count = img->count
+	};
+
+	/* Lay out the data after the table. */
+	uint64_t offset = sizeof(h) + img->count * sizeof(struct ihpa_cache_extent);
+	for(size_t i = 0; i < img->count; ++i)
+		offset += (img->extents[i].length + 7) & ~7ull;
+	h.file_size = offset;
+
+	bool ok = 1 == fwrite(&h, sizeof(h), 1, f);
+	offset = sizeof(h) + img->count * sizeof(struct ihpa_cache_extent);
+	for(size_t i = 0; ok && i < img->count; ++i){
+		struct ihpa_cache_extent e = {
+			.start = img->extents[i].start
+			,.length = img->extents[i].length
+			,.offset = offset
+		};
+		ok = 1 == fwrite(&e, sizeof(e), 1, f);
+		offset += (e.length + 7) & ~7ull;
+	}
+
+	static const uint8_t zero[8];
+	for(size_t i = 0; ok && i < img->count; ++i){
+		size_t len = img->extents[i].length;
+		ok = fwrite(img->extents[i].data, 1, len, f) == len
+			&& fwrite(zero, 1, -len & 7, f) == (-len & 7);
+	}
+
+	return ihpa_cache_commit(f, tmp, cache_path, ok);
+}
+
+/** @brief Create the temporary file a new cache_path is written to.
+ *  @param tmp Set to its path; at least strlen(cache_path) + 32 bytes. */
+static FILE* ihpa_cache_create(const char* cache_path, char* tmp, size_t tmp_len)
+{
+	snprintf(tmp, tmp_len, "%s.%ld.tmp", cache_path, (long)getpid());
+	return fopen(tmp, "w");
+}
+
+/** @brief Close the temporary file and, if it was written completely,
+ *  rename it over cache_path; remove it otherwise. */
+static bool ihpa_cache_commit(FILE* f, const char* tmp, const char* cache_path, bool ok)
+{
+	ok = !fclose(f) && ok && !rename(tmp, cache_path);
+	if(!ok)
+		unlink(tmp);
+	return ok;
+}
+
+/** @brief Hash the source contents with the CRC-32 of ihpa_digest; it
+ *  only has to tell contents of the same size apart.
+ *  @return false if they cannot be read. */
+static bool ihpa_cache_hash(struct ihpa_cache_key* key)
+{
+	if(key->hashed)
+		return key->hash_ok;
+	key->hashed = true;
+
+	struct ihpa_digest d;
+	ihpa_digest_init(&d, IHPA_DIGEST_CRC32, 0, key->size, 0);
+	if(key->size){
+		const uint8_t* p = mmap(NULL, key->size, PROT_READ, MAP_PRIVATE, key->fd, 0);
+		if(MAP_FAILED == p)
+			return false;
+		ihpa_digest_add(&d, 0, p, key->size);
+		munmap((void*)p, key->size);
+	}
+	ihpa_digest_final(&d);
+
+	key->hash = d.crc32;
+	key->hash_ok = true;
+	return true;
+}
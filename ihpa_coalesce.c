@@ -0,0 +1,218 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ihpa.h"
+
+/** @brief Data held by the stage, in the order it arrived. */
+struct ihpa_piece {
+	uint32_t address;
+	size_t len;
+
+	/** @brief Offset of the data in the arena; increases with arrival. */
+	size_t offset;
+};
+
+/* The arena holds piece data growing up from the start and piece
+ * descriptors growing down from the end, so many small pieces and a few
+ * large ones fit the same limit. Segments made of several pieces are
+ * put together in a second buffer of the same size. */
+struct ihpa_coalesce {
+	struct ihp_ctx* out;
+
+	/** @brief Size of the arena and of the segment buffer. */
+	size_t limit;
+
+	/** @brief End of the data in the arena. */
+	size_t top;
+
+	/** @brief Number of pieces held. */
+	size_t count;
+
+	/** @brief Set once out->cb has returned false. */
+	bool failed;
+
+	/** @brief Arena, followed by the segment buffer. Aligned, as are
+	 *  limit and so the descriptors carved from its top. */
+	_Alignas(max_align_t) uint8_t mem[];
+};
+
+static size_t ihpa_coalesce_limit(size_t limit);
+
+static struct ihpa_piece* ihpa_coalesce_pieces(struct ihpa_coalesce* c);
+
+static bool ihpa_coalesce_flush(struct ihpa_coalesce* c);
+
+static bool ihpa_coalesce_emit(struct ihpa_coalesce* c, uint32_t address, const uint8_t* data, size_t len);
+
+static int ihpa_piece_by_address(const void* a, const void* b);
+
+static int ihpa_piece_by_arrival(const void* a, const void* b);
+
+size_t ihpa_coalesce_size(size_t limit)
+{
+	return sizeof(struct ihpa_coalesce) + 2 * ihpa_coalesce_limit(limit);
+}
+
+struct ihpa_coalesce* ihpa_coalesce_init(uint8_t* mem, size_t limit, struct ihp_ctx* out)
+{
+	if(limit < sizeof(struct ihpa_piece))
+		return NULL;
+
+	__auto_type ret = (struct ihpa_coalesce*)mem;
+	memset(ret, 0, sizeof(*ret));
+	ret->out = out;
+	ret->limit = ihpa_coalesce_limit(limit);
+	return ret;
+}
+
+bool ihpa_coalesce_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len)
+{
+	__auto_type c = (struct ihpa_coalesce*)ctx->user_data;
+
+	/* End of input: pass on the segments held, then the end itself.
+	 * On error, the segments held may be incomplete and are dropped. */
+	if(!data){
+		bool ok = len || ihpa_coalesce_flush(c);
+		c->out->cb(c->out, 0, NULL, ok ? len : IHP_ERR_USER_ABORT);
+		return ok;
+	}
+
+	/* Data continuing the last piece extends it; its data is at the top. */
+	struct ihpa_piece* last = c->count ? ihpa_coalesce_pieces(c) : NULL;
+	size_t room = c->limit - c->count * sizeof(struct ihpa_piece) - c->top;
+	if(last && (uint64_t)last->address + last->len == address && len <= room){
+		memcpy(c->mem + c->top, data, len);
+		c->top += len;
+		last->len += len;
+		return true;
+	}
+
+	/* Out of room: pass on what is held, sorted as far as it goes. */
+	if(len + sizeof(struct ihpa_piece) > room){
+		if(!ihpa_coalesce_flush(c))
+			return false;
+		room = c->limit;
+	}
+
+	/* Too big to hold at all; pass it straight on. */
+	if(len + sizeof(struct ihpa_piece) > room)
+		return ihpa_coalesce_emit(c, address, data, len);
+
+	++c->count;
+	*ihpa_coalesce_pieces(c) = (struct ihpa_piece){
+		.address = address
+		,.len = len
+		,.offset = c->top
+	};
+	memcpy(c->mem + c->top, data, len);
+	c->top += len;
+	return true;
+}
+
+unsigned ihpa_coalesce_run(size_t limit, struct ihp_ctx* out, FILE* input)
+{
+	/* The stage and the parser context share one allocation. */
+	size_t offset = (ihpa_coalesce_size(limit) + 15) & ~(size_t)15;
+	uint8_t* mem = malloc(offset + ihp_file_size(256));
+	struct ihpa_coalesce* c = mem ? ihpa_coalesce_init(mem, limit, out) : NULL;
+	if(!c){
+		free(mem);
+		fclose(input);
+		return COUNT_IHP_ERR;
+	}
+
+	/* Records are gathered anyway, so a small callback buffer will do. */
+	struct ihp_ctx* ic = ihp_file_buffered(mem + offset, 256, input);
+	ic->user_data = c;
+	ic->cb = ihpa_coalesce_cb;
+
+	unsigned err = ihp_run(ic);
+	ihp_destroy(ic);
+	if(IHP_ERR_OK == err && c->failed)
+		err = IHP_ERR_USER_ABORT;
+
+	free(mem);
+	return err;
+}
+
+/* Internal functions. */
+
+/** @brief Arena size for limit, a multiple of the descriptor alignment. */
+static size_t ihpa_coalesce_limit(size_t limit)
+{
+	size_t a = _Alignof(struct ihpa_piece);
+	return (limit + a - 1) / a * a;
+}
+
+/** @brief Descriptors of the pieces held, newest first. */
+static struct ihpa_piece* ihpa_coalesce_pieces(struct ihpa_coalesce* c)
+{
+	return (struct ihpa_piece*)(c->mem + c->limit) - c->count;
+}
+
+/** @brief Pass on all pieces held as maximal contiguous segments,
+ *  in address order, and empty the stage. */
+static bool ihpa_coalesce_flush(struct ihpa_coalesce* c)
+{
+	struct ihpa_piece* pieces = ihpa_coalesce_pieces(c);
+	size_t n = c->count;
+	c->count = 0;
+	c->top = 0;
+
+	qsort(pieces, n, sizeof(*pieces), ihpa_piece_by_address);
+
+	uint8_t* segment = c->mem + c->limit;
+	for(size_t i = 0; i < n;){
+		/* Take every piece touching or overlapping the segment so far. */
+		uint64_t start = pieces[i].address;
+		uint64_t end = start + pieces[i].len;
+		size_t j = i + 1;
+		for(; j < n && pieces[j].address <= end; ++j){
+			if((uint64_t)pieces[j].address + pieces[j].len > end)
+				end = (uint64_t)pieces[j].address + pieces[j].len;
+		}
+
+		/* A single piece is passed on where it lies. Otherwise lay the
+		 * pieces down in arrival order, so later data wins as it would
+		 * without the stage. */
+		bool ok;
+		if(j == i + 1){
+			ok = ihpa_coalesce_emit(c, start, c->mem + pieces[i].offset, pieces[i].len);
+		}
+		else{
+			qsort(pieces + i, j - i, sizeof(*pieces), ihpa_piece_by_arrival);
+			for(size_t k = i; k < j; ++k)
+				memcpy(segment + (pieces[k].address - start), c->mem + pieces[k].offset, pieces[k].len);
+			ok = ihpa_coalesce_emit(c, start, segment, end - start);
+		}
+
+		if(!ok)
+			return false;
+		i = j;
+	}
+
+	return true;
+}
+
+static bool ihpa_coalesce_emit(struct ihpa_coalesce* c, uint32_t address, const uint8_t* data, size_t len)
+{
+	if(!c->out->cb(c->out, address, data, len))
+		c->failed = true;
+	return !c->failed;
+}
+
+static int ihpa_piece_by_address(const void* a, const void* b)
+{
+	const struct ihpa_piece* x = a;
+	const struct ihpa_piece* y = b;
+	if(x->address != y->address)
+		return x->address < y->address ? -1 : 1;
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int ihpa_piece_by_arrival(const void* a, const void* b)
+{
+	const struct ihpa_piece* x = a;
+	const struct ihpa_piece* y = b;
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+#include "ihpa.h"
+
+/** @brief Bytes of old contents read and compared at a time. */
+#define IHPA_DIFF_BLOCK 4096
+
+/** @brief Old contents: a sparse image or a binary image. */
+struct ihpa_diff_old {
+	const struct ihpa_sparse* img;
+
+	const uint8_t* bin;
+	size_t bin_len;
+	uint32_t base;
+
+	uint8_t pad;
+};
+
+static unsigned ihpa_diff_run(const struct ihpa_diff_old* old, FILE* new_input,
+	size_t page, struct ihp_ctx* ctx);
+
+static bool ihpa_diff_bytes(const struct ihpa_diff_old* old, const struct ihpa_sparse* img,
+	struct ihp_ctx* ctx);
+
+static bool ihpa_diff_pages(const struct ihpa_diff_old* old, const struct ihpa_sparse* img,
+	size_t page, struct ihp_ctx* ctx);
+
+static void ihpa_diff_read(const struct ihpa_diff_old* old, uint64_t address,
+	uint8_t* dest, size_t len);
+
+static size_t ihpa_diff_span(const uint8_t* a, const uint8_t* b, size_t len, bool equal);
+
+unsigned ihpa_diff(FILE* old_input, FILE* new_input, size_t page, uint8_t pad,
+	struct ihp_ctx* ctx)
+{
+	struct ihpa_sparse img;
+	ihpa_sparse_init(&img);
+
+	unsigned err = ihpa_sparse_populate(&img, old_input);
+	if(IHP_ERR_OK == err){
+		struct ihpa_diff_old old = {.img = &img, .pad = pad};
+		err = ihpa_diff_run(&old, new_input, page, ctx);
+	}
+	else{
+		fclose(new_input);
+		ctx->cb(ctx, 0, NULL, err);
+	}
+
+	ihpa_sparse_free(&img);
+	return err;
+}
+
+unsigned ihpa_diff_binary(const uint8_t* old_img, size_t old_len, uint32_t base,
+	FILE* new_input, size_t page, uint8_t pad, struct ihp_ctx* ctx)
+{
+	struct ihpa_diff_old old = {
+		.bin = old_img
+		,.bin_len = old_len
+		,.base = base
+		,.pad = pad
+	};
+	return ihpa_diff_run(&old, new_input, page, ctx);
+}
+
+/* Internal functions. */
+
+static unsigned ihpa_diff_run(const struct ihpa_diff_old* old, FILE* new_input,
+	size_t page, struct ihp_ctx* ctx)
+{
+	struct ihpa_sparse img;
+	ihpa_sparse_init(&img);
+
+	unsigned err = ihpa_sparse_populate(&img, new_input);
+	if(IHP_ERR_OK == err){
+		bool ok = page ? ihpa_diff_pages(old, &img, page, ctx) : ihpa_diff_bytes(old, &img, ctx);
+		if(!ok)
+			err = IHP_ERR_USER_ABORT;
+	}
+
+	ihpa_sparse_free(&img);
+	ctx->cb(ctx, 0, NULL, err);
+	return err;
+}
+
+/** @brief Report each run of new bytes that differ from the old ones,
+ *  straight out of the extents. */
+static bool ihpa_diff_bytes(const struct ihpa_diff_old* old, const struct ihpa_sparse* img,
+	struct ihp_ctx* ctx)
+{
+	uint8_t block[IHPA_DIFF_BLOCK];
+	for(size_t i = 0; i < img->count; ++i){
+		const struct ihpa_extent* e = img->extents + i;
+
+		/* A run of changes may continue across blocks, so only report
+		 * it when it ends. */
+		size_t run = 0;
+		bool in_run = false;
+		for(size_t off = 0; off < e->length; off += IHPA_DIFF_BLOCK){
+			size_t len = e->length - off < IHPA_DIFF_BLOCK ? e->length - off : IHPA_DIFF_BLOCK;
+			ihpa_diff_read(old, (uint64_t)e->start + off, block, len);
+
+			for(size_t pos = 0; pos < len;){
+				pos += ihpa_diff_span(e->data + off + pos, block + pos, len - pos, !in_run);
+				if(pos == len)
+					break;
+
+				if(in_run && !ctx->cb(ctx, e->start + run, e->data + run, off + pos - run))
+					return false;
+				run = off + pos;
+				in_run = !in_run;
+			}
+		}
+
+		if(in_run && !ctx->cb(ctx, e->start + run, e->data + run, e->length - run))
+			return false;
+	}
+
+	return true;
+}
+
+/** @brief Report each page holding a change, rebuilt from the old contents
+ *  and every extent that reaches into it. */
+static bool ihpa_diff_pages(const struct ihpa_diff_old* old, const struct ihpa_sparse* img,
+	size_t page, struct ihp_ctx* ctx)
+{
+	uint8_t* buf = malloc(2 * page);
+	if(!buf)
+		return false;
+	uint8_t* was = buf + page;
+
+	bool ok = true;
+	uint64_t next = 0;
+	size_t first = 0;
+	for(size_t i = 0; ok && i < img->count; ++i){
+		const struct ihpa_extent* e = img->extents + i;
+		uint64_t end = (uint64_t)e->start + e->length;
+
+		/* Pages shared with the previous extent are already done. */
+		uint64_t p = e->start - e->start % page;
+		if(p < next)
+			p = next;
+
+		for(; ok && p < end; p += page){
+			ihpa_diff_read(old, p, was, page);
+			memcpy(buf, was, page);
+
+			/* Lay all new data within the page over the old. */
+			while(first < img->count
+				&& (uint64_t)img->extents[first].start + img->extents[first].length <= p)
+			{
+				++first;
+			}
+			for(size_t j = first; j < img->count && img->extents[j].start < p + page; ++j){
+				const struct ihpa_extent* x = img->extents + j;
+				uint64_t from = x->start > p ? x->start : p;
+				uint64_t to = (uint64_t)x->start + x->length;
+				if(to > p + page)
+					to = p + page;
+				memcpy(buf + (from - p), x->data + (from - x->start), to - from);
+			}
+
+			if(ihpa_diff_span(buf, was, page, true) != page)
+				ok = ctx->cb(ctx, p, buf, page);
+		}
+		next = p;
+	}
+
+	free(buf);
+	return ok;
+}
+
+/** @brief Copy the old contents at address, as pad where there are none. */
+static void ihpa_diff_read(const struct ihpa_diff_old* old, uint64_t address,
+	uint8_t* dest, size_t len)
+{
+	if(old->img){
+		ihpa_sparse_read(old->img, address, dest, len, old->pad);
+		return;
+	}
+
+	memset(dest, old->pad, len);
+
+	uint64_t end = address + len;
+	uint64_t bin_end = (uint64_t)old->base + old->bin_len;
+	uint64_t from = address > old->base ? address : old->base;
+	uint64_t to = end < bin_end ? end : bin_end;
+	if(from < to)
+		memcpy(dest + (from - address), old->bin + (from - old->base), to - from);
+}
+
+/** @brief Length of the prefix of a and b where bytes are equal,
+ *  or where they differ if equal is false. */
+static size_t ihpa_diff_span(const uint8_t* a, const uint8_t* b, size_t len, bool equal)
+{
+	size_t i = 0;
+
+#if defined(__x86_64__)
+	/* 16 bytes per step; the compare mask tells where the span ends. */
+	for(; i + 16 <= len; i += 16){
+		__m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+		if(!equal)
+			mask = ~mask;
+		mask = ~mask & 0xFFFF;
+		if(mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+
+	while(i < len && (a[i] == b[i]) == equal)
+		++i;
+	return i;
+}
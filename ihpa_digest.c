@@ -0,0 +1,331 @@
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "ihpa.h"
+
+/** @brief Pad bytes digested at a time for gaps. */
+#define IHPA_DIGEST_FILL 256
+
+typedef void (*sha256_fn)(uint32_t* state, const uint8_t* data, size_t blocks);
+
+static void ihpa_digest_bytes(struct ihpa_digest* d, const uint8_t* data, size_t len);
+
+static void ihpa_digest_fill(struct ihpa_digest* d, uint64_t to);
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t len);
+
+static void crc32_tables(void);
+
+static void sha256_update(struct ihpa_digest* d, const uint8_t* data, size_t len);
+
+static void sha256_final(struct ihpa_digest* d);
+
+static void sha256_scalar(uint32_t* state, const uint8_t* data, size_t blocks);
+
+static void sha256_resolve(void);
+
+#if defined(__x86_64__)
+static void sha256_ni(uint32_t* state, const uint8_t* data, size_t blocks);
+#endif
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5
+	,0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174
+	,0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da
+	,0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967
+	,0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85
+	,0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070
+	,0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3
+	,0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_init[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/** @brief Slice by 8 tables of the reflected CRC-32 polynomial 0xEDB88320. */
+static uint32_t crc32_table[8][256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+/** @brief SHA-256 block function in use; resolved once, by the first
+ *  ihpa_digest_init computing SHA-256. */
+static sha256_fn sha256_blocks = sha256_scalar;
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+void ihpa_digest_init(struct ihpa_digest* d, unsigned kinds, uint32_t start, size_t length, uint8_t pad)
+{
+	memset(d, 0, sizeof(*d));
+	d->kinds = kinds;
+	d->valid = true;
+	d->start = start;
+	d->end = (uint64_t)start + length;
+	d->pad = pad;
+	d->next = start;
+	d->crc = 0xFFFFFFFF;
+	memcpy(d->state, sha256_init, sizeof(d->state));
+
+	if(kinds & IHPA_DIGEST_CRC32)
+		pthread_once(&crc32_once, crc32_tables);
+	if(kinds & IHPA_DIGEST_SHA256)
+		pthread_once(&sha256_once, sha256_resolve);
+}
+
+bool ihpa_digest_add(struct ihpa_digest* d, uint32_t address, const uint8_t* data, size_t len)
+{
+	/* Clip to the span. */
+	uint64_t from = address > d->start ? address : d->start;
+	uint64_t to = (uint64_t)address + len < d->end ? (uint64_t)address + len : d->end;
+	if(from >= to)
+		return d->valid;
+
+	/* Bytes already digested cannot be taken back. */
+	if(from < d->next)
+		d->valid = false;
+	if(!d->valid)
+		return false;
+
+	ihpa_digest_fill(d, from);
+	ihpa_digest_bytes(d, data + (from - address), to - from);
+	d->next = to;
+	return true;
+}
+
+void ihpa_digest_final(struct ihpa_digest* d)
+{
+	if(!d->valid)
+		return;
+
+	ihpa_digest_fill(d, d->end);
+	d->next = d->end;
+	if(d->kinds & IHPA_DIGEST_CRC32)
+		d->crc32 = ~d->crc;
+	if(d->kinds & IHPA_DIGEST_SHA256)
+		sha256_final(d);
+}
+
+bool ihpa_digest_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len)
+{
+	struct ihpa_digest* d = ctx->user_data;
+	if(!data){
+		if(!len)
+			ihpa_digest_final(d);
+		return true;
+	}
+
+	/* Data out of order only spoils the digest; parsing goes on. */
+	ihpa_digest_add(d, address, data, len);
+	return true;
+}
+
+/* Internal functions. */
+
+static void ihpa_digest_bytes(struct ihpa_digest* d, const uint8_t* data, size_t len)
+{
+	if(d->kinds & IHPA_DIGEST_CRC32)
+		d->crc = crc32_update(d->crc, data, len);
+	if(d->kinds & IHPA_DIGEST_SHA256)
+		sha256_update(d, data, len);
+}
+
+/** @brief Digest pad bytes from the next address up to to. */
+static void ihpa_digest_fill(struct ihpa_digest* d, uint64_t to)
+{
+	if(to <= d->next)
+		return;
+
+	uint8_t fill[IHPA_DIGEST_FILL];
+	memset(fill, d->pad, sizeof(fill));
+	for(uint64_t n = to - d->next; n;){
+		size_t step = n < sizeof(fill) ? n : sizeof(fill);
+		ihpa_digest_bytes(d, fill, step);
+		n -= step;
+	}
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t len)
+{
+	/* 8 bytes per step, looking up each in its own table. */
+	const uint32_t (*t)[256] = crc32_table;
+	for(; len >= 8; data += 8, len -= 8){
+		uint32_t lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+		uint32_t hi = data[4] | data[5] << 8 | data[6] << 16 | (uint32_t)data[7] << 24;
+		crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+			^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+	}
+
+	while(len--)
+		crc = t[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+static void crc32_tables(void)
+{
+	for(unsigned i = 0; i < 256; ++i){
+		uint32_t c = i;
+		for(unsigned k = 0; k < 8; ++k)
+			c = c & 1 ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+		crc32_table[0][i] = c;
+	}
+
+	for(unsigned i = 0; i < 256; ++i){
+		for(unsigned s = 1; s < 8; ++s){
+			uint32_t c = crc32_table[s - 1][i];
+			crc32_table[s][i] = (c >> 8) ^ crc32_table[0][c & 0xFF];
+		}
+	}
+}
+
+static void sha256_update(struct ihpa_digest* d, const uint8_t* data, size_t len)
+{
+	size_t used = d->total & 63;
+	d->total += len;
+
+	/* Complete a partial block first, then hash whole blocks in place. */
+	if(used){
+		size_t take = 64 - used < len ? 64 - used : len;
+		memcpy(d->block + used, data, take);
+		data += take;
+		len -= take;
+		if(used + take < 64)
+			return;
+		sha256_blocks(d->state, d->block, 1);
+	}
+
+	if(len >= 64){
+		sha256_blocks(d->state, data, len / 64);
+		data += len & ~(size_t)63;
+		len &= 63;
+	}
+
+	memcpy(d->block, data, len);
+}
+
+static void sha256_final(struct ihpa_digest* d)
+{
+	uint64_t bits = d->total * 8;
+	size_t used = d->total & 63;
+
+	d->block[used++] = 0x80;
+	if(used > 56){
+		memset(d->block + used, 0, 64 - used);
+		sha256_blocks(d->state, d->block, 1);
+		used = 0;
+	}
+	memset(d->block + used, 0, 56 - used);
+	for(unsigned i = 0; i < 8; ++i)
+		d->block[56 + i] = bits >> (56 - 8 * i);
+	sha256_blocks(d->state, d->block, 1);
+
+	for(unsigned i = 0; i < 32; ++i)
+		d->sha256[i] = d->state[i / 4] >> (24 - 8 * (i % 4));
+}
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_scalar(uint32_t* state, const uint8_t* data, size_t blocks)
+{
+	for(; blocks--; data += 64){
+		uint32_t w[64];
+		for(unsigned i = 0; i < 16; ++i){
+			w[i] = (uint32_t)data[4 * i] << 24 | data[4 * i + 1] << 16
+				| data[4 * i + 2] << 8 | data[4 * i + 3];
+		}
+		for(unsigned i = 16; i < 64; ++i){
+			uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for(unsigned i = 0; i < 64; ++i){
+			uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g))
+				+ sha256_k[i] + w[i];
+			uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+#undef ROR
+
+static void sha256_resolve(void)
+{
+#if defined(__x86_64__)
+	/* SHA extensions are CPUID leaf 7 EBX bit 29; the kernel also needs
+	 * SSSE3 and SSE4.1, which come with any CPU that has them. */
+	unsigned a, b, c, d;
+	if(__get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29)))
+		sha256_blocks = sha256_ni;
+#endif
+}
+
+#if defined(__x86_64__)
+
+/* The SHA extensions keep the state as ABEF and CDGH and do 2 rounds per
+ * sha256rnds2; sha256msg1/2 extend the message schedule 4 words at a time. */
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha256_ni(uint32_t* state, const uint8_t* data, size_t blocks)
+{
+	const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0xB1);
+	__m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(state + 4)), 0x1B);
+	__m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+	cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+
+	for(; blocks--; data += 64){
+		__m128i abef_save = abef;
+		__m128i cdgh_save = cdgh;
+
+		__m128i msg[4];
+		for(unsigned i = 0; i < 4; ++i)
+			msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * i)), swap);
+
+		/* Each group of 4 rounds consumes one schedule register, which
+		 * is then refilled with the words 16 rounds ahead. */
+		for(unsigned r = 0; r < 16; ++r){
+			__m128i k = _mm_loadu_si128((const __m128i*)(sha256_k + 4 * r));
+			__m128i t = _mm_add_epi32(msg[r & 3], k);
+			cdgh = _mm_sha256rnds2_epu32(cdgh, abef, t);
+			abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(t, 0x0E));
+
+			if(r < 12){
+				__m128i w = _mm_sha256msg1_epu32(msg[r & 3], msg[(r + 1) & 3]);
+				w = _mm_add_epi32(w, _mm_alignr_epi8(msg[(r + 3) & 3], msg[(r + 2) & 3], 4));
+				msg[r & 3] = _mm_sha256msg2_epu32(w, msg[(r + 3) & 3]);
+			}
+		}
+
+		abef = _mm_add_epi32(abef, abef_save);
+		cdgh = _mm_add_epi32(cdgh, cdgh_save);
+	}
+
+	tmp = _mm_shuffle_epi32(abef, 0x1B);
+	cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+	_mm_storeu_si128((__m128i*)state, _mm_blend_epi16(tmp, cdgh, 0xF0));
+	_mm_storeu_si128((__m128i*)(state + 4), _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+#endif
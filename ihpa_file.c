@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ihpa.h"
+
+/** @brief Callback buffer size; data is copied into the mapping anyway. */
+#define IHPA_FILE_BUFFER 256
+
+/** @brief Written part of the window, relative to its base. */
+struct ihpa_span {
+	uint64_t start;
+	uint64_t end;
+};
+
+struct ihpa_file {
+	uint8_t* map;
+	uint32_t base;
+	size_t len;
+
+	/** @brief Written spans, sorted and neither touching nor overlapping. */
+	struct ihpa_span* spans;
+	size_t count;
+	size_t capacity;
+};
+
+static bool ihpa_file_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len);
+
+static bool ihpa_file_mark(struct ihpa_file* f, uint64_t start, uint64_t end);
+
+unsigned ihpa_populate_file(uint32_t base, size_t img_len, uint8_t pad, FILE* input, int fd)
+{
+	/* Size a regular file with a single resize, which leaves it as it was
+	 * if it fails. Bytes past its old end are holes that read as 0; only
+	 * those before may hold old data. Other files, such as devices, must
+	 * already be big enough. */
+	struct stat st;
+	void* m = MAP_FAILED;
+	uint64_t dirty = img_len;
+	if(!fstat(fd, &st)){
+		bool sized = true;
+		if(S_ISREG(st.st_mode)){
+			if((uint64_t)st.st_size < dirty)
+				dirty = st.st_size;
+			sized = (size_t)st.st_size == img_len || !ftruncate(fd, img_len);
+		}
+		if(!img_len)
+			m = NULL;
+		else if(sized)
+			m = mmap(NULL, img_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	uint8_t* mem = MAP_FAILED == m ? NULL : malloc(ihp_file_size(IHPA_FILE_BUFFER));
+	if(!mem){
+		if(m && MAP_FAILED != m)
+			munmap(m, img_len);
+		fclose(input);
+		return COUNT_IHP_ERR;
+	}
+
+	struct ihpa_file f = {
+		.map = m
+		,.base = base
+		,.len = img_len
+	};
+
+	struct ihp_ctx* ic = ihp_file_buffered(mem, IHPA_FILE_BUFFER, input);
+	ic->user_data = &f;
+	ic->cb = ihpa_file_cb;
+
+	unsigned err = ihp_run(ic);
+	ihp_destroy(ic);
+
+	/* Pad only the gaps; with pad 0, only those that may hold old data. */
+	if(IHP_ERR_OK == err){
+		uint64_t limit = pad ? img_len : dirty;
+		uint64_t pos = 0;
+		for(size_t i = 0; i <= f.count && pos < limit; ++i){
+			uint64_t end = i < f.count ? f.spans[i].start : img_len;
+			if(end > limit)
+				end = limit;
+			memset(f.map + pos, pad, end - pos);
+			if(i < f.count)
+				pos = f.spans[i].end;
+		}
+	}
+
+	free(f.spans);
+	free(mem);
+	if(m)
+		munmap(m, img_len);
+	return err;
+}
+
+/* Internal functions. */
+
+static bool ihpa_file_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len)
+{
+	if(!data){
+		return len ? true : false;
+	}
+
+	/* Bounds check the data against the window. */
+	struct ihpa_file* f = (struct ihpa_file*)ctx->user_data;
+	if(address < f->base || (uint64_t)address - f->base + len > f->len)
+		return false;
+
+	uint64_t start = address - f->base;
+	memcpy(f->map + start, data, len);
+	return ihpa_file_mark(f, start, start + len);
+}
+
+/** @brief Add a written span, merging it with those it touches. */
+static bool ihpa_file_mark(struct ihpa_file* f, uint64_t start, uint64_t end)
+{
+	/* In-order data extends the last span. */
+	struct ihpa_span* last = f->count ? f->spans + f->count - 1 : NULL;
+	if(last && start >= last->start && start <= last->end){
+		if(end > last->end)
+			last->end = end;
+		return true;
+	}
+
+	/* Otherwise find the first span ending at or after start. */
+	size_t lo = 0;
+	size_t hi = f->count;
+	while(lo < hi){
+		size_t mid = lo + (hi - lo) / 2;
+		if(f->spans[mid].end < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* Swallow every span from there that starts at or before end. */
+	size_t n = lo;
+	while(n < f->count && f->spans[n].start <= end){
+		if(f->spans[n].start < start)
+			start = f->spans[n].start;
+		if(f->spans[n].end > end)
+			end = f->spans[n].end;
+		++n;
+	}
+
+	if(n == lo){
+		if(f->count == f->capacity){
+			size_t capacity = f->capacity ? 2 * f->capacity : 64;
+			struct ihpa_span* spans = realloc(f->spans, capacity * sizeof(*spans));
+			if(!spans)
+				return false;
+			f->spans = spans;
+			f->capacity = capacity;
+		}
+		memmove(f->spans + lo + 1, f->spans + lo, (f->count - lo) * sizeof(*f->spans));
+		++f->count;
+	}
+	else{
+		memmove(f->spans + lo + 1, f->spans + n, (f->count - n) * sizeof(*f->spans));
+		f->count -= n - lo - 1;
+	}
+
+	f->spans[lo] = (struct ihpa_span){.start = start, .end = end};
+	return true;
+}
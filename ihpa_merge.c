@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ihpa.h"
+
+/** @brief One input of a merge, parsed by its own thread. */
+struct ihpa_merge_input {
+	FILE* input;
+	struct ihpa_sparse img;
+
+	/** @brief Parse result. */
+	unsigned err;
+};
+
+static void* ihpa_merge_worker(void* arg);
+
+static void ihpa_merge_compare(const struct ihpa_sparse* a, const struct ihpa_sparse* b,
+	unsigned first, unsigned second, struct ihpa_merge* m);
+
+static void ihpa_merge_conflicts(const uint8_t* p, const uint8_t* q, uint64_t start, size_t len,
+	unsigned first, unsigned second, struct ihpa_merge* m);
+
+unsigned ihpa_merge_sparse(struct ihpa_sparse* img, FILE* const* inputs, unsigned count,
+	struct ihpa_merge* m)
+{
+	m->overlap_count = 0;
+	m->failed = count;
+	if(!count)
+		return IHP_ERR_OK;
+
+	struct ihpa_merge_input* in = calloc(count, sizeof(*in));
+	if(!in){
+		for(unsigned i = 0; i < count; ++i)
+			fclose(inputs[i]);
+		return IHP_ERR_USER_ABORT;
+	}
+
+	/* Parse every input into a sparse image of its own; the calling
+	 * thread takes the first one, and any a thread could not be
+	 * started for. */
+	pthread_t tids[count];
+	bool started[count];
+	for(unsigned i = 0; i < count; ++i){
+		in[i].input = inputs[i];
+		ihpa_sparse_init(&in[i].img);
+	}
+	for(unsigned i = 1; i < count; ++i)
+		started[i] = !pthread_create(tids + i, NULL, ihpa_merge_worker, in + i);
+
+	ihpa_merge_worker(in);
+	for(unsigned i = 1; i < count; ++i){
+		if(started[i])
+			pthread_join(tids[i], NULL);
+		else
+			ihpa_merge_worker(in + i);
+	}
+
+	unsigned err = IHP_ERR_OK;
+	for(unsigned i = 0; i < count && IHP_ERR_OK == err; ++i){
+		err = in[i].err;
+		if(err)
+			m->failed = i;
+	}
+
+	/* Compare every pair of inputs. */
+	for(unsigned i = 0; IHP_ERR_OK == err && i < count; ++i){
+		for(unsigned j = i + 1; j < count; ++j)
+			ihpa_merge_compare(&in[i].img, &in[j].img, i, j, m);
+	}
+	if(IHP_ERR_OK == err && m->overlap_count && IHPA_MERGE_ERROR == m->policy)
+		err = IHPA_ERR_OVERLAP;
+
+	/* Start from the input with the lowest priority and lay the others
+	 * over it, so the winner's data is added last. */
+	if(IHP_ERR_OK == err){
+		bool first_wins = IHPA_MERGE_FIRST_WINS == m->policy;
+		unsigned base = first_wins ? count - 1 : 0;
+		*img = in[base].img;
+		ihpa_sparse_init(&in[base].img);
+
+		for(unsigned n = 1; n < count && IHP_ERR_OK == err; ++n){
+			const struct ihpa_sparse* s = &in[first_wins ? count - 1 - n : n].img;
+			for(size_t e = 0; e < s->count; ++e){
+				const struct ihpa_extent* x = s->extents + e;
+				if(!ihpa_sparse_add(img, x->start, x->data, x->length)){
+					err = IHP_ERR_USER_ABORT;
+					break;
+				}
+			}
+		}
+	}
+
+	for(unsigned i = 0; i < count; ++i)
+		ihpa_sparse_free(&in[i].img);
+	free(in);
+	return err;
+}
+
+unsigned ihpa_merge_populate(size_t img_len, uint8_t* img_mem, uint8_t pad,
+	FILE* const* inputs, unsigned count, struct ihpa_merge* m)
+{
+	struct ihpa_sparse img;
+	ihpa_sparse_init(&img);
+
+	unsigned err = ihpa_merge_sparse(&img, inputs, count, m);
+	if(IHP_ERR_OK == err && img.count){
+		const struct ihpa_extent* last = img.extents + img.count - 1;
+		if((uint64_t)last->start + last->length > img_len)
+			err = IHP_ERR_USER_ABORT;
+	}
+
+	if(IHP_ERR_OK == err)
+		ihpa_sparse_flatten(&img, 0, img_len, img_mem, pad);
+
+	ihpa_sparse_free(&img);
+	return err;
+}
+
+/* Internal functions. */
+
+static void* ihpa_merge_worker(void* arg)
+{
+	struct ihpa_merge_input* in = arg;
+	in->err = ihpa_sparse_populate(&in->img, in->input);
+	return NULL;
+}
+
+/** @brief Report where the extents of a and b intersect with different data. */
+static void ihpa_merge_compare(const struct ihpa_sparse* a, const struct ihpa_sparse* b,
+	unsigned first, unsigned second, struct ihpa_merge* m)
+{
+	/* Both lists are sorted, so walk them together. */
+	size_t i = 0;
+	size_t j = 0;
+	while(i < a->count && j < b->count){
+		const struct ihpa_extent* x = a->extents + i;
+		const struct ihpa_extent* y = b->extents + j;
+		uint64_t x_end = (uint64_t)x->start + x->length;
+		uint64_t y_end = (uint64_t)y->start + y->length;
+
+		uint64_t from = x->start > y->start ? x->start : y->start;
+		uint64_t to = x_end < y_end ? x_end : y_end;
+		if(from < to){
+			ihpa_merge_conflicts(x->data + (from - x->start), y->data + (from - y->start),
+				from, to - from, first, second, m);
+		}
+
+		if(x_end < y_end)
+			++i;
+		else
+			++j;
+	}
+}
+
+/** @brief Report each maximal run of bytes that differ between p and q,
+ *  which hold the data of both inputs from start. */
+static void ihpa_merge_conflicts(const uint8_t* p, const uint8_t* q, uint64_t start, size_t len,
+	unsigned first, unsigned second, struct ihpa_merge* m)
+{
+	for(size_t i = 0; i < len;){
+		/* Skip equal data a block at a time, then up to the next change. */
+		while(i + 64 <= len && !memcmp(p + i, q + i, 64))
+			i += 64;
+		while(i < len && p[i] == q[i])
+			++i;
+		if(i == len)
+			break;
+
+		size_t run = i;
+		while(i < len && p[i] != q[i])
+			++i;
+
+		if(m->overlaps && m->overlap_count < m->overlap_max){
+			m->overlaps[m->overlap_count] = (struct ihpa_overlap){
+				.start = start + run
+				,.length = i - run
+				,.first = first
+				,.second = second
+			};
+		}
+		++m->overlap_count;
+	}
+}
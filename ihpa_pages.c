@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ihpa.h"
+
+/** @brief Address of a slot that holds no page. */
+#define IHPA_PAGE_FREE UINT64_MAX
+
+struct ihpa_pages {
+	struct ihp_ctx* out;
+	size_t page;
+	unsigned slots;
+	uint8_t fill;
+
+	/** @brief Slot used last; where in-order input looks first. */
+	unsigned last;
+
+	/** @brief Set once out->cb has returned false. */
+	bool failed;
+
+	/** @brief Page address held by each slot, followed by the slot data. */
+	uint64_t address[];
+};
+
+static uint8_t* ihpa_pages_slot(struct ihpa_pages* p, unsigned slot);
+
+static bool ihpa_pages_emit(struct ihpa_pages* p, unsigned slot);
+
+static bool ihpa_pages_flush(struct ihpa_pages* p);
+
+size_t ihpa_pages_size(size_t page, unsigned slots)
+{
+	return sizeof(struct ihpa_pages) + slots * (sizeof(uint64_t) + page);
+}
+
+struct ihpa_pages* ihpa_pages_init(uint8_t* mem, size_t page, unsigned slots,
+	uint8_t fill, struct ihp_ctx* out)
+{
+	if(!page || !slots)
+		return NULL;
+
+	__auto_type ret = (struct ihpa_pages*)mem;
+	memset(ret, 0, sizeof(*ret));
+	ret->out = out;
+	ret->page = page;
+	ret->slots = slots;
+	ret->fill = fill;
+	for(unsigned i = 0; i < slots; ++i)
+		ret->address[i] = IHPA_PAGE_FREE;
+	return ret;
+}
+
+bool ihpa_pages_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len)
+{
+	__auto_type p = (struct ihpa_pages*)ctx->user_data;
+
+	/* End of input: pass on the remaining pages, then the end itself.
+	 * On error, the pages held are incomplete and dropped. */
+	if(!data){
+		bool ok = len || ihpa_pages_flush(p);
+		p->out->cb(p->out, 0, NULL, ok ? len : IHP_ERR_USER_ABORT);
+		return ok;
+	}
+
+	while(len){
+		uint64_t page = address - address % p->page;
+
+		/* Find the slot holding the page; failing that, a free one;
+		 * failing that, pass on the lowest page to free its slot. */
+		unsigned slot = p->last;
+		if(p->address[slot] != page){
+			unsigned free_slot = p->slots;
+			unsigned low = 0;
+			for(slot = 0; slot < p->slots && p->address[slot] != page; ++slot){
+				if(IHPA_PAGE_FREE == p->address[slot])
+					free_slot = slot;
+				else if(p->address[slot] < p->address[low])
+					low = slot;
+			}
+
+			if(slot == p->slots){
+				slot = free_slot;
+				if(slot == p->slots){
+					slot = low;
+					if(!ihpa_pages_emit(p, slot))
+						return false;
+				}
+				p->address[slot] = page;
+				memset(ihpa_pages_slot(p, slot), p->fill, p->page);
+			}
+			p->last = slot;
+		}
+
+		size_t off = address - page;
+		size_t cur = p->page - off;
+		if(cur > len)
+			cur = len;
+		memcpy(ihpa_pages_slot(p, slot) + off, data, cur);
+
+		address += cur;
+		data += cur;
+		len -= cur;
+	}
+
+	return true;
+}
+
+unsigned ihpa_pages_run(size_t page, unsigned slots, uint8_t fill,
+	struct ihp_ctx* out, FILE* input)
+{
+	/* The stage and the parser context share one allocation. */
+	size_t offset = (ihpa_pages_size(page, slots) + 15) & ~(size_t)15;
+	uint8_t* mem = malloc(offset + ihp_file_size(256));
+	struct ihpa_pages* p = mem ? ihpa_pages_init(mem, page, slots, fill, out) : NULL;
+	if(!p){
+		free(mem);
+		fclose(input);
+		return COUNT_IHP_ERR;
+	}
+
+	/* Records are gathered into pages anyway, so a small callback buffer
+	 * will do. */
+	struct ihp_ctx* ic = ihp_file_buffered(mem + offset, 256, input);
+	ic->user_data = p;
+	ic->cb = ihpa_pages_cb;
+
+	unsigned err = ihp_run(ic);
+	ihp_destroy(ic);
+	if(IHP_ERR_OK == err && p->failed)
+		err = IHP_ERR_USER_ABORT;
+
+	free(mem);
+	return err;
+}
+
+/* Internal functions. */
+
+static uint8_t* ihpa_pages_slot(struct ihpa_pages* p, unsigned slot)
+{
+	return (uint8_t*)(p->address + p->slots) + slot * p->page;
+}
+
+/** @brief Pass on the page in slot unless it is all fill, and free the slot. */
+static bool ihpa_pages_emit(struct ihpa_pages* p, unsigned slot)
+{
+	const uint8_t* data = ihpa_pages_slot(p, slot);
+	uint32_t address = p->address[slot];
+	p->address[slot] = IHPA_PAGE_FREE;
+
+	/* All fill if the first byte is, and every byte equals the next. */
+	if(data[0] == p->fill && !memcmp(data, data + 1, p->page - 1))
+		return true;
+
+	if(!p->out->cb(p->out, address, data, p->page))
+		p->failed = true;
+	return !p->failed;
+}
+
+/** @brief Pass on all pages held, in address order. */
+static bool ihpa_pages_flush(struct ihpa_pages* p)
+{
+	for(;;){
+		unsigned low = p->slots;
+		for(unsigned i = 0; i < p->slots; ++i){
+			if(IHPA_PAGE_FREE != p->address[i]
+				&& (low == p->slots || p->address[i] < p->address[low]))
+			{
+				low = i;
+			}
+		}
+
+		if(low == p->slots)
+			return true;
+		if(!ihpa_pages_emit(p, low))
+			return false;
+	}
+}
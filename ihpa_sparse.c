@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ihpa.h"
+
+/** @brief Callback buffer size used when populating a sparse image. */
+#define IHPA_SPARSE_BUFFER 4096
+
+static bool ihpa_sparse_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len);
+
+static size_t ihpa_sparse_search(const struct ihpa_sparse* img, uint64_t address);
+
+static bool ihpa_extent_reserve(struct ihpa_extent* e, size_t len);
+
+static uint64_t ihpa_extent_end(const struct ihpa_extent* e);
+
+void ihpa_sparse_init(struct ihpa_sparse* img)
+{
+	memset(img, 0, sizeof(*img));
+}
+
+void ihpa_sparse_free(struct ihpa_sparse* img)
+{
+	for(size_t i = 0; i < img->count; ++i)
+		free(img->extents[i].data);
+	free(img->extents);
+	ihpa_sparse_init(img);
+}
+
+bool ihpa_sparse_add(struct ihpa_sparse* img, uint32_t address, const uint8_t* data, size_t len)
+{
+	if(!len)
+		return true;
+
+	uint64_t end = (uint64_t)address + len;
+
+	/* First extent that ends at or after the new data, so it touches or
+	 * overlaps it; in-order input always lands on the last extent. */
+	size_t first = img->count;
+	if(first && ihpa_extent_end(img->extents + first - 1) >= address)
+		--first;
+	if(first && ihpa_extent_end(img->extents + first - 1) >= address)
+		first = ihpa_sparse_search(img, address);
+
+	/* One past the last extent that starts at or before the end of the
+	 * new data. */
+	size_t last = first;
+	while(last < img->count && img->extents[last].start <= end)
+		++last;
+
+	/* Nothing to merge with, so make a new extent. */
+	if(first == last){
+		if(img->count == img->capacity){
+			size_t cap = img->capacity ? 2 * img->capacity : 16;
+			struct ihpa_extent* ext = realloc(img->extents, cap * sizeof(*ext));
+			if(!ext)
+				return false;
+			img->extents = ext;
+			img->capacity = cap;
+		}
+
+		struct ihpa_extent e = {.start = address};
+		if(!ihpa_extent_reserve(&e, len))
+			return false;
+		memcpy(e.data, data, len);
+		e.length = len;
+
+		memmove(img->extents + first + 1, img->extents + first,
+			(img->count - first) * sizeof(*img->extents));
+		img->extents[first] = e;
+		++img->count;
+		return true;
+	}
+
+	/* Grow the first extent to cover everything from first to last. */
+	struct ihpa_extent* e = img->extents + first;
+	uint64_t start = address < e->start ? address : e->start;
+	uint64_t stop = ihpa_extent_end(img->extents + last - 1);
+	if(stop < end)
+		stop = end;
+
+	if(!ihpa_extent_reserve(e, stop - start))
+		return false;
+
+	if(start < e->start){
+		memmove(e->data + (e->start - start), e->data, e->length);
+		e->start = start;
+	}
+	e->length = stop - start;
+
+	/* Absorb the following extents, then lay the new data on top. */
+	for(size_t i = first + 1; i < last; ++i){
+		struct ihpa_extent* n = img->extents + i;
+		memcpy(e->data + (n->start - start), n->data, n->length);
+		free(n->data);
+	}
+	memcpy(e->data + (address - start), data, len);
+
+	memmove(img->extents + first + 1, img->extents + last,
+		(img->count - last) * sizeof(*img->extents));
+	img->count -= last - first - 1;
+	return true;
+}
+
+unsigned ihpa_sparse_populate(struct ihpa_sparse* img, FILE* input)
+{
+	uint8_t* mem = malloc(ihp_file_size(IHPA_SPARSE_BUFFER));
+	if(!mem){
+		fclose(input);
+		return COUNT_IHP_ERR;
+	}
+
+	struct ihp_ctx* ic = ihp_file_buffered(mem, IHPA_SPARSE_BUFFER, input);
+	ic->user_data = img;
+	ic->cb = ihpa_sparse_cb;
+
+	unsigned err = ihp_run(ic);
+	ihp_destroy(ic);
+	free(mem);
+	return err;
+}
+
+const struct ihpa_extent* ihpa_sparse_find(const struct ihpa_sparse* img, uint32_t address)
+{
+	size_t i = ihpa_sparse_search(img, (uint64_t)address + 1);
+	if(i < img->count && img->extents[i].start <= address)
+		return img->extents + i;
+	return NULL;
+}
+
+size_t ihpa_sparse_read(const struct ihpa_sparse* img, uint32_t address,
+	uint8_t* dest, size_t len, uint8_t pad)
+{
+	memset(dest, pad, len);
+
+	uint64_t end = (uint64_t)address + len;
+	size_t found = 0;
+	for(size_t i = ihpa_sparse_search(img, (uint64_t)address + 1);
+		i < img->count && img->extents[i].start < end; ++i)
+	{
+		const struct ihpa_extent* e = img->extents + i;
+		uint64_t from = e->start > address ? e->start : address;
+		uint64_t to = ihpa_extent_end(e) < end ? ihpa_extent_end(e) : end;
+
+		memcpy(dest + (from - address), e->data + (from - e->start), to - from);
+		found += to - from;
+	}
+
+	return found;
+}
+
+bool ihpa_sparse_iterate(const struct ihpa_sparse* img, struct ihp_ctx* ctx)
+{
+	for(size_t i = 0; i < img->count; ++i){
+		const struct ihpa_extent* e = img->extents + i;
+		if(!ctx->cb(ctx, e->start, e->data, e->length))
+			return false;
+	}
+
+	return true;
+}
+
+size_t ihpa_sparse_flatten(const struct ihpa_sparse* img, uint32_t base,
+	size_t img_len, uint8_t* img_mem, uint8_t pad)
+{
+	return ihpa_sparse_read(img, base, img_mem, img_len, pad);
+}
+
+/* Internal functions. */
+
+static bool ihpa_sparse_cb(struct ihp_ctx* ctx, uint32_t address, const uint8_t* data, size_t len)
+{
+	if(!data)
+		return len ? true : false;
+
+	return ihpa_sparse_add((struct ihpa_sparse*)ctx->user_data, address, data, len);
+}
+
+/** @brief Index of the first extent ending after address - 1,
+ *  i.e. that reaches address. */
+static size_t ihpa_sparse_search(const struct ihpa_sparse* img, uint64_t address)
+{
+	size_t lo = 0;
+	size_t hi = img->count;
+	while(lo < hi){
+		size_t mid = lo + (hi - lo) / 2;
+		if(ihpa_extent_end(img->extents + mid) < address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static bool ihpa_extent_reserve(struct ihpa_extent* e, size_t len)
+{
+	if(len <= e->capacity)
+		return true;
+
+	/* Grow geometrically so that appending record by record is cheap. */
+	size_t cap = 2 * e->capacity;
+	if(cap < len)
+		cap = len;
+
+	uint8_t* data = realloc(e->data, cap);
+	if(!data)
+		return false;
+
+	e->data = data;
+	e->capacity = cap;
+	return true;
+}
+
+static uint64_t ihpa_extent_end(const struct ihpa_extent* e)
+{
+	return (uint64_t)e->start + e->length;
+}